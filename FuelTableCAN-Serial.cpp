@@ -1,871 +1,3734 @@
 #include <SPI.h>
 #include <mcp_can.h>
 #include <Wire.h>
+#include <SD.h>
+#include <EEPROM.h>
 
-#define MOTOR_ENA 9   //Enable pin for L298N
-#define MOTOR_IN1 8   //Input 1 for L298N
-#define MOTOR_IN2 7   //Input 2 for L298N
-
-#define CAN_CS 10      //Chip Select for MCP2515 CAN module
-
-#define WT901_SERIAL Serial2  //WITMotion WT901 connected to Serial2
-#define FUEL_SERIAL Serial3   //Reventec LS200-400C connected to Serial3
+//Pins, sensor ports, LS200 CAN setup and test profiles are in the rig description (RIG) below the profiles
 
 //Constant definitions for data logging
 const unsigned long DATA_INTERVAL = 10;  //Stream data every 10ms (100Hz)
+const bool SAMPLE_AND_HOLD = true;       //Emit a row every tick with the last valid pitch and its age;
+                                         //false emits a row only when a new angle packet arrived
+
+//Pitch is handled in hundredths of a degree (centidegrees) as int16_t, so sampling and control
+//run without software float on the AVR. Limits are written in degrees and converted at compile time.
+constexpr int16_t centideg(float degrees) {
+    return (int16_t)(degrees * 100.0f + (degrees >= 0 ? 0.5f : -0.5f));
+}
+
+//Element count of an array, for table lengths in constants
+template <typename T, byte N>
+constexpr byte countOf(const T (&)[N]) {
+    return N;
+}
+const int16_t PITCH_INVALID = -32768;           //readPitch() without a recent angle packet
+const int16_t PITCH_LIMIT = centideg(25.0);     //Readings outside +/-25 degrees are rejected
+
+//Pitch control
+enum ControlMode : byte {
+    CONTROL_PULSE,  //Fixed full-power pulses, stop and re-read between them
+    CONTROL_PID     //Continuous PID on pitch, PWM duty on the motor enable pin
+};
+const ControlMode CONTROL_MODE = CONTROL_PID;
+const int16_t ZERO_TOLERANCE = centideg(0.1);  //Used when zeroing the table
+
+//CONTROL_PULSE settings
+const unsigned long MOTOR_PULSE_MS = 200;       //Actuator run time per adjustment step
+const unsigned long STABILIZE_MS = 1000;        //Longest wait after each pulse before re-reading pitch
+
+//CONTROL_PID settings. Gains are in duty counts and need tuning per rig.
+constexpr float PID_KP = 60.0;                  //Duty per degree of error
+constexpr float PID_KI = 10.0;                  //Duty per degree-second of error
+constexpr float PID_KD = 5.0;                   //Duty per degree/second of pitch rate
+const int PID_MIN_DUTY = 70;                    //Smallest duty that still moves the actuator
+const int PID_MAX_DUTY = 255;
+
+//The controller runs on integers: error in centidegrees, the integral in centidegrees times
+//1024us, the rate in centidegrees per second and the output in 1/4096 duty counts
+const byte PID_OUTPUT_SHIFT = 12;
+const byte PID_KI_SHIFT = 22;                   //The integral gain has 10 more fraction bits
+constexpr float PID_INTEGRAL_UNIT_S = 1024e-6;
+const long PID_KP_FIXED = (long)(PID_KP / 100 * (1L << PID_OUTPUT_SHIFT) + 0.5);
+const long PID_KI_FIXED = (long)(PID_KI / 100 * PID_INTEGRAL_UNIT_S * (1L << PID_KI_SHIFT) + 0.5);
+const long PID_KD_FIXED = (long)(PID_KD / 100 * (1L << PID_OUTPUT_SHIFT) + 0.5);
+//Largest integral, where its term alone gives full duty. Also keeps integral * PID_KI_FIXED in range.
+const long PID_INTEGRAL_LIMIT = (PID_KI > 0) ? (long)(PID_MAX_DUTY / (PID_KI / 100 * PID_INTEGRAL_UNIT_S)) : 0;
+const unsigned long SETTLE_HOLD_MS = 500;       //Pitch must stay within tolerance this long to count as settled
+const unsigned long MOVE_TIMEOUT_MS = 60000;    //Give up on a move after this long
+
+//Fast start: setup() doesn't wait for USB or sleep between steps, tries the CAN bit rate that last
+//received LS200 frames first (kept in EEPROM), stops probing the WT901 as soon as it answers, and
+//zeroes with the PID controller inside FAST_ZERO_BUDGET_MS while streaming rows as "Zeroing".
+//false keeps the original sequence. setup() runs again on every reset.
+const bool FAST_START = true;
+const unsigned long FAST_ZERO_BUDGET_MS = 20000;  //Then the test starts from wherever the table is
+const int EEPROM_CAN_SPEED_ADDR = 0;            //EEPROM_CAN_SPEED_MAGIC, then the MCP2515 bit rate code
+const byte EEPROM_CAN_SPEED_MAGIC = 0xC5;
+
+//Settle detection over a rolling window of samples: still when both the standard deviation
+//and the least-squares slope of the window are below their limits
+const byte SETTLE_WINDOW = 16;                  //Samples per window
+const unsigned long SETTLE_MAX_SPAN_MS = 10000; //A window spread wider than this (lost samples) is never settled
+const long SETTLE_MAX_OFFSET = 10000;           //Nor one with a sample this far from the oldest
+const int16_t PITCH_SETTLE_STDDEV = centideg(0.02);
+const int16_t PITCH_SETTLE_SLOPE = centideg(0.05);   //Per second
+const bool DWELL_ENDS_ON_FUEL_SETTLE = false;   //End stationary periods once the fuel level has converged
+const unsigned long DWELL_MIN_MS = 3000;        //Shortest dwell when ending on fuel settle
+const unsigned long FUEL_SETTLE_INTERVAL_MS = 100;  //Fuel level is fed to its window at most this often
+const long FUEL_SETTLE_STDDEV = 5;              //Raw LS200 counts
+const long FUEL_SETTLE_SLOPE = 2;               //Raw LS200 counts per second
+
+//One step of a test profile. Stored in PROGMEM, read with memcpy_P().
+struct PitchStep {
+    int16_t target;          //Centidegrees
+    int16_t tolerance;       //Centidegrees either side of target
+    unsigned long dwellMs;   //Stationary time after the target is reached
+};
+
+const int16_t STEP_TOLERANCE = centideg(0.1);
+
+//Standard test: +5, -5, +10, -10
+const PitchStep STANDARD_STEPS[] PROGMEM = {
+    {centideg(5.0), STEP_TOLERANCE, 10000},
+    {centideg(-5.0), STEP_TOLERANCE, 10000},
+    {centideg(10.0), STEP_TOLERANCE, 10000},
+    {centideg(-10.0), STEP_TOLERANCE, 10000}
+};
+
+//20 step sweep through +/-10 degrees in 2 degree steps
+const PitchStep SWEEP_STEPS[] PROGMEM = {
+    {centideg(2.0), STEP_TOLERANCE, 5000}, {centideg(4.0), STEP_TOLERANCE, 5000},
+    {centideg(6.0), STEP_TOLERANCE, 5000}, {centideg(8.0), STEP_TOLERANCE, 5000},
+    {centideg(10.0), STEP_TOLERANCE, 5000}, {centideg(8.0), STEP_TOLERANCE, 5000},
+    {centideg(6.0), STEP_TOLERANCE, 5000}, {centideg(4.0), STEP_TOLERANCE, 5000},
+    {centideg(2.0), STEP_TOLERANCE, 5000}, {centideg(0.0), STEP_TOLERANCE, 5000},
+    {centideg(-2.0), STEP_TOLERANCE, 5000}, {centideg(-4.0), STEP_TOLERANCE, 5000},
+    {centideg(-6.0), STEP_TOLERANCE, 5000}, {centideg(-8.0), STEP_TOLERANCE, 5000},
+    {centideg(-10.0), STEP_TOLERANCE, 5000}, {centideg(-8.0), STEP_TOLERANCE, 5000},
+    {centideg(-6.0), STEP_TOLERANCE, 5000}, {centideg(-4.0), STEP_TOLERANCE, 5000},
+    {centideg(-2.0), STEP_TOLERANCE, 5000}, {centideg(0.0), STEP_TOLERANCE, 5000}
+};
+
+struct TestProfile {
+    const char* name;
+    const PitchStep* steps;  //PROGMEM
+    byte stepCount;
+};
+
+const TestProfile PROFILES[] = {
+    {"standard", STANDARD_STEPS, countOf(STANDARD_STEPS)},
+    {"sweep", SWEEP_STEPS, countOf(SWEEP_STEPS)}
+};
+
+//LS200 path behind the fuel columns, fuel settle detection and bursts
+enum FuelSource : byte {
+    FUEL_SOURCE_CAN,         //CAN frames
+    FUEL_SOURCE_SERIAL,      //Lines on RIG.fuelSerial
+    FUEL_SOURCE_NEWEST       //Whichever delivered the latest reading, the UART covers a congested bus
+};
+
+//Everything that differs between the tables we build. RIG is constexpr, so hardware a rig
+//doesn't have compiles out the same way the const bool options do: with hasFuelSerial false the
+//UART is never opened or polled, and with no canFallbacks setup() has no fallback loop.
+struct RigConfig {
+    byte motorEna;                     //Enable pin for L298N
+    byte motorIn1;                     //Input 1 for L298N
+    byte motorIn2;                     //Input 2 for L298N
+    byte canCs;                        //Chip Select for MCP2515 CAN module
+    byte canInt;                       //MCP2515 INT output (active low), must be an external interrupt pin
+    byte sdCs;                         //Chip Select for the SD card, shares the SPI bus with the MCP2515
+    HardwareSerial* wt901Serial;       //WITMotion WT901
+    bool hasFuelSerial;                //LS200 serial output is wired, false when it is only read on CAN
+    HardwareSerial* fuelSerial;        //Its UART, only used with hasFuelSerial
+    unsigned long fuelBaud;
+    FuelSource fuelSource;
+    byte canSpeed;                     //MCP2515 bit rate (CAN_1000KBPS...) tried first
+    const byte* canFallbacks;          //Bit rates tried in turn if it fails
+    byte canFallbackCount;
+    bool canExtended;                  //LS200 sends 29-bit IDs
+    const unsigned long* canIds;       //ID(s) configured on the sensor, the filters take up to 6
+    byte canIdCount;
+    const TestProfile* profiles;       //Selectable with the run command, the first runs at startup
+    byte profileCount;
+};
+
+constexpr byte CAN_SPEED_FALLBACKS[] = {CAN_500KBPS, CAN_250KBPS, CAN_125KBPS};
+constexpr unsigned long MEGA_CAN_IDS[] = {0x100};
+
+//Mega with the WT901 on Serial2 and the LS200-400C on CAN at 1Mbps. Its serial output is wired to
+//Serial3 but not read until the line format is confirmed.
+constexpr RigConfig MEGA_RIG = {
+    9, 8, 7,
+    10, 2, 4,
+    &Serial2,
+    false, &Serial3, 9600, FUEL_SOURCE_CAN,
+    CAN_1000KBPS, CAN_SPEED_FALLBACKS, countOf(CAN_SPEED_FALLBACKS),
+    false, MEGA_CAN_IDS, countOf(MEGA_CAN_IDS),
+    PROFILES, countOf(PROFILES)
+};
+
+constexpr RigConfig RIG = MEGA_RIG;  //Rig this build is for
+static_assert(RIG.hasFuelSerial || RIG.fuelSource == FUEL_SOURCE_CAN, "fuelSource needs the LS200 UART");
+
+//Line commands received on Serial, replies on Serial1:
+//  run [profile] [cycles]   Run a profile, repeated for cycles (default 1), returning to zero at the end
+//  abort                    End the running test, then return to zero
+//  status                   Report state, cycle, step and pitch
+//  set rate <Hz>            Change the sample rate
+//  set format csv|binary    Change the data stream format, while idle
+//  set baud <rate>          Change the Serial baud rate, while idle. Commands then use the new rate too.
+//  set raw full|off|<N>     Stream every row, none or every Nth. Phase summaries and the SD log
+//                           are unaffected.
+//  bench [seconds]          Stream with the table still for seconds (default 10), then report the
+//                           achieved rate, drops, CAN loss and latency, while idle. See bench.py.
+//  reset                    Reinitialize and run the startup test again
+const byte COMMAND_LINE_SIZE = 48;
+const unsigned int MAX_SAMPLE_RATE_HZ = 500;
+const unsigned int MAX_CYCLES = 1000;
+const unsigned int DEFAULT_BENCH_SECONDS = 10;
+const unsigned int MAX_BENCH_SECONDS = 3600;
+const unsigned long DATA_BAUD = 115200;        //Serial baud rate at startup and after reset
+const unsigned long MIN_DATA_BAUD = 9600;
+const unsigned long MAX_DATA_BAUD = 2000000;
+
+//Output queues in front of Serial and Serial1. Producers never block on the UART.
+const uint16_t DATA_QUEUE_SIZE = 512;
+const uint16_t DEBUG_QUEUE_SIZE = 384;
+
+//Scheduler periods, in microseconds
+const unsigned long OUTPUT_PERIOD_US = 1000;     //Move queued output into the UART TX buffers
+const unsigned long DRAIN_PERIOD_US = 2000;      //Move WT901 bytes and CAN frames out of their buffers
+const unsigned long CONTROL_PERIOD_US = 20000;   //Motor feedback watchdog
+const unsigned long DEBUG_PERIOD_US = 1000000;   //Status line on Serial1
+const unsigned long STATS_PERIOD_US = 10000000;  //Instrumentation stats on Serial1
+const unsigned long BURST_FLUSH_PERIOD_US = 20000;  //One buffered burst sample sent per period while stationary
+const unsigned long COMMAND_PERIOD_US = 10000;   //Read command bytes from Serial
+const unsigned long SUMMARY_PERIOD_US = 20000;   //One phase summary line sent per period
+
+//CAN receive
+const bool CAN_USE_INTERRUPT = true;  //Drain the MCP2515 from its INT pin; false polls from readCANData()
+const byte CAN_RING_SIZE = 16;        //Received frames buffered between ISR and main loop, power of two
+const unsigned long CAN_PROBE_MS = 200;  //A bit rate is only used once a frame arrives at it within this long
+
+//CAN acceptance. With CAN_FILTER_IDS the MCP2515 masks and filters only pass RIG.canIds,
+//so other bus traffic never reaches the RX buffers or the SPI link.
+const bool CAN_FILTER_IDS = true;
+const byte CAN_RX_MODE = CAN_FILTER_IDS ? MCP_STDEXT : MCP_ANY;
+const unsigned long CAN_ID_FLAGS = 0xC0000000;        //Extended and remote flags mcp_can adds to received IDs
+
+//LS200 serial output: one ASCII line per reading, "<fuelLevel>,<internalTemp>,<externalTemp>" and
+//CR LF, in the same raw counts and status codes as the CAN frame. This format is provisional, not
+//yet checked against the sensor's documentation, so no rig enables hasFuelSerial until it is.
+const byte LS200_LINE_SIZE = 24;      //Longer lines are dropped as framing errors
+
+//Burst capture: while the motor runs and for BURST_WINDOW_MS after it stops, every angle packet and
+//every LS200 frame is captured into a RAM ring, at the rates the sensors send them. The ring keeps
+//the most recent BURST_SAMPLES, so the slosh after the stop always survives a long move. It is sent
+//during the next stationary period after a header giving the samples lost off its start, a sample
+//per BURST_FLUSH_PERIOD_US, on top of the normal rows.
+const bool BURST_CAPTURE = true;
+const uint16_t BURST_SAMPLES = 256;             //Ring size, older samples are overwritten and counted
+const uint16_t BURST_RING_SIZE = BURST_CAPTURE ? BURST_SAMPLES : 1;  //No ring in SRAM without BURST_CAPTURE
+const unsigned long BURST_WINDOW_MS = 1500;     //Capture continues this long after the motor stops
+const byte BURST_FLUSH_MIN_ROOM = 64;           //Free bytes in the data queue needed to send a sample
+
+//BurstSample.flags
+const byte BURST_FLAG_PITCH = 0x01;             //Captured on a new angle packet
+const byte BURST_FLAG_CAN = 0x02;               //Captured on a new LS200 frame
+const byte BURST_FLAG_CAN_VALID = 0x04;         //fuelLevel holds a reading
+
+//Phase summaries: every row is also reduced on the device to the count, mean, min, max and
+//standard deviation of its values per phase, sent as "# Phase" lines when the phase ends along
+//with the time a stationary phase took for the fuel level to settle. With raw rows decimated or
+//off, a multi-day soak run streams little more than the summaries. The SD log keeps every row.
+const bool PHASE_SUMMARIES = true;
+const byte SUMMARY_MIN_ROOM = 96;               //Free bytes in the data queue needed to send a line
+const unsigned long SETTLE_NOT_SEEN = 0xFFFFFFFF;  //PhaseSummaryRecord.settleMs outside a settled dwell
+
+//Rows streamed on Serial, set raw changes it
+enum RawMode : byte {
+    RAW_FULL,       //Every row (default)
+    RAW_DECIMATED,  //Every rawDecimation-th row
+    RAW_OFF         //No rows, only the summaries and reports
+};
+const RawMode STARTUP_RAW_MODE = RAW_FULL;
+const uint16_t STARTUP_RAW_DECIMATION = 10;
+const uint16_t MAX_RAW_DECIMATION = 60000;
+
+//Values reduced per phase, named as their CSV columns
+enum SummaryValue : byte {
+    SUMMARY_FUEL_LEVEL,
+    SUMMARY_INTERNAL_TEMP,
+    SUMMARY_EXTERNAL_TEMP,   //Only readings, not status codes
+    SUMMARY_PITCH,           //Centidegrees
+    SUMMARY_VALUE_COUNT
+};
+
+//Instrumentation: micros() per function, sample tick lateness, dropped CAN frames and free SRAM,
+//printed on Serial1 every STATS_PERIOD_US while streaming and as a summary at the end of each test.
+//With false everything below compiles out.
+const bool ENABLE_INSTRUMENTATION = false;
+const unsigned long LATENESS_BIN_US[] = {100, 250, 500, 1000, 2500, 5000};  //Histogram bin upper bounds, last bin is open
+const byte LATENESS_BIN_COUNT = sizeof(LATENESS_BIN_US) / sizeof(LATENESS_BIN_US[0]) + 1;
+const byte STACK_PAINT = 0xA5;        //Fill for unused SRAM, the SRAM low watermark is where it was overwritten
+const byte STACK_PAINT_MARGIN = 32;   //Bytes below the painting function's frame left alone
+
+//MCP2515 registers used directly to clear the RX overflow flags, mcp_can only reads EFLG
+const byte MCP2515_BIT_MODIFY = 0x05;
+const byte MCP2515_REG_EFLG = 0x2D;
+const unsigned long MCP2515_SPI_CLOCK = 10000000;
+
+//On-device log. Every sample is also written to a file on the SD card, so a run survives the host
+//sleeping or the USB cable dropping. See LogHeader for the file layout, read with postprocess.py.
+const bool SD_LOGGING = false;
+const uint16_t LOG_SECTOR_SIZE = 512;
+const byte LOG_RECORD_SIZE = 32;                //Fixed record slot, slot 0 of each sector is the LogSectorHeader
+const byte LOG_RECORDS_PER_SECTOR = LOG_SECTOR_SIZE / LOG_RECORD_SIZE - 1;
+const byte LOG_MAX_STEPS = 32;                  //Profile steps kept in the header
+const byte LOG_INDEX_SIZE = 48;                 //Phase starts indexed, later phases are found by scanning
+const uint16_t LOG_BUFFER_SIZE = SD_LOGGING ? LOG_SECTOR_SIZE : 1;  //With SD_LOGGING false the logger
+const byte LOG_INDEX_SLOTS = SD_LOGGING ? LOG_INDEX_SIZE : 1;       //buffers take no SRAM
+const byte LOG_SYNC_SECTORS = 64;               //Update the file size on the card at least this often
+const uint32_t LOG_MAGIC = 0x474C5446;          //"FTLG"
+const uint32_t LOG_SECTOR_MAGIC = 0x43455346;   //"FSEC"
+const uint16_t LOG_VERSION = 4;               //2 added SampleRecord.canAgeMs, 3 has PitchStep in centidegrees,
+                                              //4 added the LS200 serial reading
+
+//Output format for the main data stream on Serial
+enum OutputFormat : byte {
+    OUTPUT_CSV,     //One ASCII CSV row per sample (default)
+    OUTPUT_BINARY   //Compact framed records, decoded by capture_serial.py (BINARY_MODE = True)
+};
+const OutputFormat STARTUP_OUTPUT_FORMAT = OUTPUT_CSV;  //Format selected by loop() before the first sample
+
+//Binary framing: SYNC1 SYNC2 TYPE LEN PAYLOAD[LEN] CRC16 (little endian)
+//CRC is CRC-16/CCITT-FALSE over TYPE, LEN and PAYLOAD
+const byte FRAME_SYNC1 = 0xA5;
+const byte FRAME_SYNC2 = 0x5A;
+const byte FRAME_TYPE_SAMPLE = 0x01;  //Payload is a SampleRecord
+const byte FRAME_TYPE_LABEL = 0x02;   //Payload is a label id followed by its text (no terminator)
+const byte FRAME_TYPE_DROPS = 0x03;   //Payload is a DropReport
+const byte FRAME_TYPE_BURST = 0x04;   //Payload is a BurstRecord
+const byte FRAME_TYPE_BENCH = 0x05;   //Payload is a BenchReport
+const byte FRAME_TYPE_PHASE = 0x06;   //Payload is a PhaseSummaryRecord
+const byte FRAME_TYPE_PHASE_VALUE = 0x07;  //Payload is a PhaseValueRecord
+const byte FRAME_TYPE_BURST_HEADER = 0x08;  //Payload is a BurstHeaderRecord
+const byte MAX_FRAME_PAYLOAD = 38;   //Largest payload, a BenchReport
+const byte MAX_LABEL_LENGTH = 23;
+
+//Flag bits for SampleRecord.flags
+const byte SAMPLE_FLAG_CAN_DATA = 0x01;      //At least one CAN frame has been received
+const byte SAMPLE_FLAG_EXT_TEMP_VALID = 0x02;  //External temperature holds a reading, not a status code
+const byte SAMPLE_FLAG_PITCH_VALID = 0x04;   //At least one angle packet has been received
+const byte SAMPLE_FLAG_PITCH_FRESH = 0x08;   //A new angle packet arrived since the previous record
+const byte SAMPLE_FLAG_CAN_FRESH = 0x10;     //A new LS200 frame arrived since the previous record
+const byte SAMPLE_FLAG_SERIAL_DATA = 0x20;   //At least one LS200 serial line has been read
+
+//One sample in binary mode, fixed width fields
+struct __attribute__((packed)) SampleRecord {
+    uint16_t sequence;       //Increments per record, gaps mean lost records
+    uint32_t timeMs;         //Elapsed time since test start
+    uint16_t fuelLevel;      //Raw LS200 value
+    uint16_t internalTemp;   //Raw LS200 value
+    uint16_t externalTemp;   //Raw LS200 value, including 0xFFFF/0x8001/0x8002 status codes
+    int16_t pitchCenti;      //Pitch in hundredths of a degree
+    byte phaseId;            //Label id sent earlier in a FRAME_TYPE_LABEL record
+    byte directionId;        //Label id sent earlier in a FRAME_TYPE_LABEL record
+    byte flags;              //SAMPLE_FLAG_* bits
+    uint16_t pitchAgeMs;     //Age of the angle packet behind pitchCenti, saturates at 65535
+    uint16_t canAgeMs;       //Age of the LS200 frame behind the CAN values, saturates at 65535
+    uint16_t serialFuelLevel;  //Raw LS200 value from the serial path
+    uint16_t serialAgeMs;    //Age of that reading, saturates at 65535
+};
+
+//Status codes the LS200 reports in place of an external temperature
+enum ExternalTempStatus : byte {
+    EXT_TEMP_OK,             //externalTemp holds a reading
+    EXT_TEMP_DISABLED,       //0xFFFF
+    EXT_TEMP_OPEN_CIRCUIT,   //0x8001
+    EXT_TEMP_SHORT_CIRCUIT   //0x8002
+};
+
+//Records the output queues had to drop, sent in the data stream whenever the counts change
+struct __attribute__((packed)) DropReport {
+    uint32_t dataRecords;    //Rows or frames dropped from the Serial queue
+    uint32_t debugRecords;   //Lines dropped from the Serial1 queue
+};
+
+//Result of a bench run, sent in the data stream at its end. 16-bit counts saturate at 0xFFFF.
+struct __attribute__((packed)) BenchReport {
+    uint32_t durationMs;     //Time streamed
+    uint16_t rateHz;         //Sample rate
+    uint32_t baud;           //Serial baud rate
+    uint32_t rows;           //Rows built by the sample task
+    uint16_t droppedRecords; //Rows or frames dropped from the Serial queue
+    uint16_t missedTicks;    //Sample periods skipped because the task fell a period behind
+    uint16_t maxLatenessUs;  //Latest a sample tick ran
+    uint32_t canFrames;      //LS200 frames read
+    uint16_t canLost;        //Frames lost in the MCP2515 (overflow events) or the frame ring
+    uint32_t latencyMinUs;   //Angle packet header read to the last byte of its row handed to the UART,
+    uint32_t latencyMeanUs;  //0 when no row was followed
+    uint32_t latencyMaxUs;
+};
+
+//End of a phase, sent when the next one starts or streaming stops
+struct __attribute__((packed)) PhaseSummaryRecord {
+    byte phaseId;            //Label id sent earlier in a FRAME_TYPE_LABEL record
+    uint32_t startMs;        //Elapsed time of the phase's first row
+    uint32_t durationMs;     //To its last row
+    uint32_t rows;           //Rows built, streamed or not
+    uint32_t settleMs;       //Dwell time until the fuel level settled, SETTLE_NOT_SEEN if it didn't
+};
+
+//One value of a finished phase, follows its PhaseSummaryRecord. min and max are in the units of
+//the CSV column (pitch in centidegrees), mean and stdDev in hundredths of those.
+struct __attribute__((packed)) PhaseValueRecord {
+    byte phaseId;
+    byte value;              //SummaryValue
+    uint32_t count;          //Rows holding the value
+    int32_t mean;
+    int32_t min;
+    int32_t max;
+    uint32_t stdDev;         //Population standard deviation
+};
 
-//Structure to hold CAN data
+//Sector 0 of a log file, zero padded to LOG_SECTOR_SIZE. Rewritten when the log is closed;
+//a log that was never closed has dataSectors = 0 and is read by scanning sector headers.
+//Data sectors follow, then indexCount LogIndexEntry values packed from sector indexSector.
+struct __attribute__((packed)) LogHeader {
+    uint32_t magic;              //LOG_MAGIC
+    uint16_t version;
+    uint16_t sectorSize;
+    uint16_t recordSize;
+    uint32_t sampleIntervalUs;
+    char profileName[16];
+    byte stepCount;
+    uint32_t dataSectors;        //Data sectors written, from sector 1
+    uint32_t indexSector;        //First index sector, 0 without an index
+    uint16_t indexCount;
+    PitchStep steps[LOG_MAX_STEPS];
+};
+
+//Slot 0 of every data sector, records fill slots 1 to LOG_RECORDS_PER_SECTOR
+struct __attribute__((packed)) LogSectorHeader {
+    uint32_t magic;              //LOG_SECTOR_MAGIC
+    uint32_t sector;             //Position in the file, so stale sectors past the end are recognised
+    uint32_t firstTimeMs;        //Elapsed test time when the sector was started
+    byte recordCount;
+};
+
+//Each record slot: type (FRAME_TYPE_*), payload length, payload as in the binary stream
+struct __attribute__((packed)) LogRecordHeader {
+    byte type;
+    byte length;
+};
+
+//Sector where a phase starts. Indexed sectors begin with the label records they need.
+struct __attribute__((packed)) LogIndexEntry {
+    uint32_t sector;
+    uint32_t timeMs;
+};
+
+//One burst sample as buffered, the latest pitch and fuel level when either of them changed
+struct __attribute__((packed)) BurstSample {
+    uint16_t offsetMs;       //From BurstBuffer.baseMs
+    int16_t pitchCenti;
+    uint16_t fuelLevel;      //Raw LS200 value
+    byte flags;              //BURST_FLAG_* bits
+};
+
+//One burst sample in binary mode and in the SD log
+struct __attribute__((packed)) BurstRecord {
+    uint16_t burstId;        //Increments per burst, one burst covers one or more motions
+    uint32_t timeMs;         //Elapsed time since test start
+    int16_t pitchCenti;
+    uint16_t fuelLevel;
+    byte flags;
+};
+
+//Sent ahead of a burst's samples, in binary mode and in the SD log
+struct __attribute__((packed)) BurstHeaderRecord {
+    uint16_t burstId;
+    uint32_t startMs;        //Elapsed test time of the first sample sent
+    uint16_t samples;        //Samples that follow
+    uint32_t lost;           //Samples overwritten before they could be sent
+};
+
+//Ring of the samples captured around motion and not yet sent
+struct BurstBuffer {
+    BurstSample samples[BURST_RING_SIZE];
+    uint16_t head;               //Oldest sample
+    uint16_t count;              //Samples held, from head
+    uint16_t sent;               //Samples already sent, from head
+    bool headerSent;             //The header is out, samples follow
+    unsigned long baseMs;        //Elapsed test time the sample offsets count from
+    unsigned long windowEndMs;   //millis() when capture ends after the motor stopped
+    uint16_t id;
+    int16_t pitchCenti;          //Latest values, repeated in samples of the other source
+    uint16_t fuelLevel;
+    bool canValid;
+    bool capturing;
+    bool sendAllowed;            //Stationary, buffered samples may be sent
+    unsigned long overflows;     //Samples of this burst overwritten by newer ones
+};
+
+//Running sums of one value over a phase. Values count from the phase's first one, so the 64-bit
+//sums are exact and stay small, and the spread isn't lost to cancellation when it's worked out.
+struct RunningStats {
+    unsigned long count;
+    long offset;             //First value
+    int64_t sum;             //Of value - offset
+    uint64_t sumSquares;     //Of (value - offset)^2
+    long min;
+    long max;
+};
+
+//Reduction of the phase being streamed
+struct PhaseStats {
+    char phase[MAX_LABEL_LENGTH + 1];  //Empty while no phase is open
+    unsigned long startMs;
+    unsigned long lastMs;              //Elapsed time of the latest row
+    unsigned long rows;
+    unsigned long settleMs;
+    RunningStats values[SUMMARY_VALUE_COUNT];
+};
+
+//Summary of a finished phase, sent a line at a time by the summary task
+struct PhaseReport {
+    bool pending;
+    byte nextLine;                     //0 the summary, then one per value
+    char phase[MAX_LABEL_LENGTH + 1];
+    PhaseSummaryRecord summary;
+    PhaseValueRecord values[SUMMARY_VALUE_COUNT];
+};
+
+//Pitch as sampled for one output row
+struct PitchSample {
+    int16_t pitchCenti;      //Last validated angle packet
+    unsigned long ageMs;     //Time since that packet's first byte was read
+    bool valid;              //False until the first angle packet
+    bool fresh;              //A new packet arrived since the previous row
+};
+
+//Structure to hold CAN data, raw values only. Text is formatted at the output edge.
 struct CANData {
-    String fuelLevel;
-    String internalTemp;
-    String externalTemp;
-    bool externalSensorValid;
+    uint16_t fuelLevel;
+    uint16_t internalTemp;
+    uint16_t externalTemp;             //Raw value, including status codes
+    ExternalTempStatus externalStatus;
+    bool hasData;                      //True once a fuel data frame has been received
+    unsigned long timeUs;              //micros() when the frame holding these values was received
+    unsigned long ageMs;               //Per output row: time since that frame was received
+    bool fresh;                        //Per output row: a new frame arrived since the previous row
+};
+
+//One received CAN frame, stamped when it was read from the MCP2515
+struct CANFrame {
+    unsigned long timeUs;
+    unsigned long id;
+    byte len;
+    byte data[8];
+};
+
+//Lock-free single-producer/single-consumer ring. Only the producer (canISR) writes head,
+//only the consumer (readCANData) writes tail.
+struct CANRing {
+    CANFrame frames[CAN_RING_SIZE];
+    volatile byte head;
+    volatile byte tail;
+    volatile unsigned long overflows;  //Frames read from the MCP2515 but dropped because the ring was full
+    unsigned long rejected;            //Frames discarded by the software ID check
+};
+
+//WT901 packet layout: 0x55, type, 8 data bytes (four int16 LSB first), sum of the first 10 bytes
+const byte WT901_HEADER = 0x55;
+const byte WT901_PACKET_SIZE = 11;
+const byte WT901_TYPE_ACCEL = 0x51;
+const byte WT901_TYPE_GYRO = 0x52;
+const byte WT901_TYPE_ANGLE = 0x53;
+const unsigned long WT901_TIMEOUT_MS = 1000;  //Angle older than this is reported as PITCH_INVALID (sensor lost)
+
+//WT901 startup configuration. Commands are FF AA <register> <value LSB> <value MSB>.
+const unsigned long WT901_DEFAULT_BAUD = 9600;
+const unsigned long WT901_FAST_BAUD = 115200;
+const byte WT901_REG_SAVE = 0x00;
+const byte WT901_REG_OUTPUT = 0x02;           //RSW, bit per packet type
+const byte WT901_REG_RATE = 0x03;             //RRATE
+const byte WT901_REG_BAUD = 0x04;
+const byte WT901_REG_UNLOCK = 0x69;
+const uint16_t WT901_UNLOCK_KEY = 0xB588;
+const uint16_t WT901_OUTPUT_ANGLE = 0x0008;   //Angle packets only
+const uint16_t WT901_RATE_FAST = 0x09;        //100Hz (0x0B = 200Hz)
+const uint16_t WT901_RATE_FALLBACK = 0x08;    //50Hz, angle-only output still fits 9600 baud
+const uint16_t WT901_BAUD_115200 = 0x06;
+const unsigned long WT901_COMMAND_DELAY_MS = 50;
+const unsigned long WT901_PROBE_MS = 300;     //Listen this long when checking the sensor answers at a baud rate
+const unsigned long WT901_PROBE_MIN_PACKETS = 3;
+
+//Latest validated packet of one type
+struct WT901Packet {
+    int16_t values[4];     //Raw fields in packet order
+    unsigned long timeMs;  //millis() when the packet was validated
+    unsigned long timeUs;  //micros() when its header byte was read from the UART
+    bool valid;            //True once a packet of this type has been received
 };
 
-MCP_CAN CAN(CAN_CS);
+//Cached WT901 state, updated by pollWT901()
+struct WT901State {
+    WT901Packet accel;     //ax, ay, az, temperature
+    WT901Packet gyro;      //wx, wy, wz, voltage
+    WT901Packet angle;     //x (table pitch), y, z, version
+    int16_t pitchCenti;    //Table pitch from the latest angle packet
+    byte buffer[WT901_PACKET_SIZE];
+    byte index;            //Bytes of the current packet received so far
+    unsigned long packetStartUs;  //micros() when the header of the current packet was read
+    unsigned long probeMs;        //Length of the last probeWT901()
+    unsigned long checksumErrors;
+    unsigned long anglePackets;  //Validated angle packets since startup
+};
+
+//LS200 serial line parser state
+struct LS200SerialState {
+    char line[LS200_LINE_SIZE];
+    byte length;
+    bool overflow;               //Line too long, ignored up to its end
+    unsigned long lineStartUs;   //micros() when the first byte of the current line was read
+    CANData data;                //Latest reading, ageMs is set per output row
+    unsigned long lines;         //Readings parsed
+    unsigned long errors;        //Lines that didn't parse
+};
+
+//Rolling window of timestamped samples for settle detection
+struct SettleDetector {
+    long values[SETTLE_WINDOW];    //Centidegrees or raw LS200 counts
+    unsigned long timesMs[SETTLE_WINDOW];
+    byte count;   //Valid samples, up to SETTLE_WINDOW
+    byte next;    //Slot the next sample goes in
+};
+
+//State of the closed-loop pitch controller, updated by the control task
+struct PitchController {
+    int16_t target;
+    int16_t tolerance;
+    const char* phaseLabel;        //Phase streamed while moving, NULL streams nothing
+    long integral;                 //Error in centidegrees times 1024us
+    long derivative;               //Centidegrees per second from the last two angle packets
+    int16_t lastPitch;
+    unsigned long lastPacketMs;    //Angle packet time behind lastPitch
+    unsigned long lastUpdateUs;
+    unsigned long startMs;
+    unsigned long inBandSinceMs;   //When pitch last entered the tolerance band
+    bool inBand;
+    int8_t approach;               //+1 when approaching from below, -1 from above
+    int16_t overshoot;             //Largest excursion past target
+    unsigned long settlingMs;      //Start of the move until pitch entered the band for good
+    bool active;
+    bool failed;                   //Pitch feedback was lost during the move
+};
+
+//Application-level transmit ring in front of a HardwareSerial. Writes never block:
+//output goes to the UART only as fast as it has room (drain()). A record that doesn't
+//fit is dropped whole and counted. A record is the bytes between beginRecord() and
+//endRecord(), or else one text line ending in '\n'.
+class TxQueue : public Print {
+public:
+    TxQueue(HardwareSerial& port, byte* buffer, uint16_t size);
+    size_t write(uint8_t b);
+    size_t write(const uint8_t* data, size_t length);
+    using Print::write;
+    void beginRecord();
+    bool endRecord();          //False if the record was dropped
+    void drain();              //Move as many bytes as the UART accepts without blocking
+    void flush();              //Block until empty, only for setup()
+    int availableForWrite();   //Bytes that can be queued now
+    unsigned long droppedRecords;
+    unsigned long sentBytes;   //Bytes handed to the UART since startup
+    
+private:
+    void endOfRecord();
+    
+    HardwareSerial& port;
+    byte* buffer;
+    uint16_t size;
+    uint16_t head;             //Next byte written
+    uint16_t tail;             //Next byte sent
+    uint16_t recordStart;      //head when the current record started
+    bool inRecord;             //Between beginRecord() and endRecord()
+    bool discarding;           //Current record didn't fit, drop the rest of it
+};
+
+//Functions timed by the instrumentation
+enum TimingId : byte {
+    TIMING_READ_PITCH,   //readPitch(), including draining the WT901 parser
+    TIMING_READ_CAN,     //readCANData()
+    TIMING_STREAM_ROW,   //Formatting and queueing one output row
+    TIMING_OUTPUT,       //Writing the output queues to the UARTs
+    TIMING_COUNT
+};
+
+//micros() spent per call of one function
+struct TimingStat {
+    unsigned long count;
+    unsigned long totalUs;
+    unsigned long minUs;
+    unsigned long maxUs;
+};
+
+//Everything the instrumentation collects, since the start of the test
+struct Instrumentation {
+    TimingStat timings[TIMING_COUNT];
+    unsigned long lateness[LATENESS_BIN_COUNT];  //Sample ticks by how late they ran
+    unsigned long maxLatenessUs;
+    unsigned long canControllerOverflows;        //MCP2515 RX overflow events, each lost at least one frame
+    unsigned long canRingOverflowsAtStart;       //canRing.overflows when collection started
+};
+
+//Counters of a bench run, reset when it starts
+struct Benchmark {
+    bool active;
+    unsigned long rows;
+    unsigned long droppedAtStart;        //dataOut.droppedRecords when the run started
+    unsigned long canOverflowsAtStart;   //canRing.overflows when the run started
+    unsigned long canFrames;             //LS200 frames read
+    unsigned long canControllerOverflows;
+    unsigned long maxLatenessUs;
+    unsigned long latencyCount;
+    unsigned long latencyTotalUs;
+    unsigned long latencyMinUs;
+    unsigned long latencyMaxUs;
+    bool probePending;                   //A row is being followed through dataOut
+    unsigned long probeStartUs;          //Header time of the angle packet in that row
+    unsigned long probeSentBytes;        //dataOut.sentBytes once the row's last byte has gone
+};
+
+//Fixed-rate cooperative task. Deadlines advance by the period, so work time doesn't shift later runs.
+struct Task {
+    void (*run)();
+    unsigned long periodUs;
+    unsigned long nextUs;        //micros() deadline of the next run
+    unsigned long missed;        //Periods skipped because the task fell more than a period behind
+};
+
+enum TaskId : byte {
+    TASK_SAMPLE,   //Stream one row (DATA_INTERVAL)
+    TASK_DRAIN,    //Drain the WT901 parser and the CAN frame ring
+    TASK_CONTROL,  //Pitch controller update, stops the motor if pitch feedback is lost
+    TASK_DEBUG,    //Periodic status on Serial1
+    TASK_OUTPUT,   //Drain the output queues into the UARTs
+    TASK_STATS,    //Instrumentation stats on Serial1
+    TASK_BURST,    //Send buffered burst samples while stationary
+    TASK_COMMAND,  //Read and dispatch line commands from Serial
+    TASK_SUMMARY,  //Send the summary of the last phase
+    TASK_COUNT
+};
+
+//Last label sent for one field of the binary record
+struct LabelSlot {
+    char text[MAX_LABEL_LENGTH + 1];
+    byte id;
+};
+
+//Open log file and the sector being filled
+struct SDLogger {
+    File file;
+    byte sector[LOG_BUFFER_SIZE];
+    byte slot;                   //Next record slot, 0 while the sector is empty
+    unsigned long sectorCount;   //Data sectors written
+    uint16_t sequence;           //Sequence number of the next logged sample
+    LogIndexEntry index[LOG_INDEX_SLOTS];
+    byte indexCount;
+    LabelSlot phaseLabel;
+    LabelSlot directionLabel;
+    bool ready;                  //Card initialized
+    bool active;                 //A log file is open
+};
+
+MCP_CAN CAN(RIG.canCs);
+
+byte dataQueueBuffer[DATA_QUEUE_SIZE];
+byte debugQueueBuffer[DEBUG_QUEUE_SIZE];
+TxQueue dataOut(Serial, dataQueueBuffer, DATA_QUEUE_SIZE);     //CSV rows or binary records
+TxQueue debugOut(Serial1, debugQueueBuffer, DEBUG_QUEUE_SIZE); //'#' debug messages
 
 bool isMoving = false;
 unsigned long lastCanMsgTime = 0;  //To track last CAN message
 unsigned long startTime = 0;       //For calculating elapsed time
 bool testComplete = false;         //Flag to indicate test completion
 bool headersWritten = false;       //Flag to track if CSV headers have been written
+OutputFormat outputFormat = OUTPUT_CSV;  //Active format of the data stream
+uint16_t recordSequence = 0;       //Sequence number of the next binary record
+byte nextLabelId = 0;              //Next id handed out to a new label
+LabelSlot phaseLabel;              //Phase label last sent in binary mode
+LabelSlot directionLabel;          //Direction label last sent in binary mode
+LabelSlot summaryLabel;            //Phase label of the last summary sent in binary mode
+WT901State wt901;                  //Inclinometer parser state and latest packets
+CANRing canRing;                   //Frames received from the MCP2515
+LS200SerialState ls200Serial;      //Only used with RIG.hasFuelSerial
+byte canSpeed = 0;                 //Bit rate the MCP2515 was started at
+bool canSpeedSaved = true;         //canSpeed is in EEPROM or not worth saving, see saveCANSpeed()
+const char* currentPhase = NULL;   //Phase label the sample task streams, NULL while not streaming
+const char* currentDirection = NULL;
+const TestProfile* activeProfile = &RIG.profiles[0];  //Profile walked by loop()
+char stepPhaseText[MAX_LABEL_LENGTH + 1];        //Phase label of the running step
+PitchController controller;                      //Closed-loop move in progress
+SettleDetector pitchSettle;                      //Fed with every angle packet
+SettleDetector fuelSettle;                       //Fed with the fuel level every FUEL_SETTLE_INTERVAL_MS
+Instrumentation stats;                           //Only updated with ENABLE_INSTRUMENTATION
+SDLogger logger;                                 //Only used with SD_LOGGING
+BurstBuffer burst;                               //Only used with BURST_CAPTURE
+PhaseStats phaseStats;                           //Only used with PHASE_SUMMARIES
+PhaseReport phaseReport;
+RawMode rawMode = STARTUP_RAW_MODE;              //Rows streamed on Serial, changed by set raw
+uint16_t rawDecimation = STARTUP_RAW_DECIMATION; //With RAW_DECIMATED
+Benchmark bench;                                 //Only updated during a bench run
+unsigned int benchSeconds = 0;                   //Set by the bench command, run by loop(), 0 when none is queued
+unsigned long dataBaud = DATA_BAUD;              //Serial baud rate, changed by set baud
+unsigned int runCycles = 1;                      //Cycles of activeProfile in the current run
+unsigned int currentCycle = 0;                   //1-based, 0 while idle
+byte currentStep = 0;                            //1-based step of the current cycle, 0 between steps
+bool runRequested = false;                       //Set by the run command, started by loop()
+bool abortRequested = false;                     //Set by the abort command, ends every wait early
+bool resetRequested = false;                     //Set by the reset command, handled by loop()
+char commandLine[COMMAND_LINE_SIZE];             //Command being received
+byte commandLength = 0;
+bool commandOverflow = false;                    //Line too long, ignored up to its end
+
+const char* const TIMING_NAMES[TIMING_COUNT] = {"readPitch", "readCANData", "streamRow", "output"};
+const char* const SUMMARY_VALUE_NAMES[SUMMARY_VALUE_COUNT] = {"FuelLevel", "InternalTemp", "ExternalTemp", "Pitch"};
+
+extern char __heap_start;  //Provided by avr-libc, SRAM between the heap and the stack is free
+extern char* __brkval;
 
 //Function declarations
-void moveMotorForward();
-void moveMotorBackward();
+void moveMotorForward(byte duty = 255);
+void moveMotorBackward(byte duty = 255);
 void stopMotor();
-float readPitch();
+int16_t readPitch();
+bool pitchInRange(int16_t pitch);
+void printCentideg(Print& out, int16_t centi);
+void pollWT901();
+void processWT901Packet();
+void configureWT901();
+void writeWT901Register(byte reg, uint16_t value);
+unsigned long probeWT901(unsigned long baud);
+int16_t waitForValidPitch();
+void printWT901Rate(unsigned long baud, unsigned long packets);
+bool moveToPitch(int16_t target, int16_t tolerance, const char* phaseLabel,
+                 ControlMode mode = CONTROL_MODE, unsigned long timeoutMs = MOVE_TIMEOUT_MS);
 void adjustToZeroPitch();
 void returnToZeroPitch();
-void adjustToPosFivePitch();
-void adjustToPosTenPitch();
-void adjustToNegFivePitch();
-void adjustToNegTenPitch();
-CANData readCANData();
+bool selectProfile(const char* name);
+void formatAdjustLabel(char* text, int16_t target);
+void checkCANTimeout();
+void driveMotor(int duty);
+bool pulseToPitch(int16_t pitch, int16_t target, int16_t tolerance, const char* phaseLabel);
+bool runPitchController(int16_t pitch, int16_t target, int16_t tolerance, const char* phaseLabel, unsigned long timeoutMs);
+void updatePitchController();
+void resetSettle(SettleDetector& detector);
+void addSettleSample(SettleDetector& detector, long value, unsigned long timeMs);
+bool isSettled(const SettleDetector& detector, long maxStdDev, long maxSlope);
+void waitForPitchSettle(unsigned long maxMs);
+void dwell(unsigned long dwellMs);
+const CANData& readCANData();
+void canISR();
+void drainCANController();
+void configureCANFilters();
+const char* canSpeedName(byte speed);
+byte beginCAN();
+bool isRigCANSpeed(byte speed);
+void saveCANSpeed();
+bool probeCANSpeed();
+bool isLS200Frame(unsigned long id);
+void setExternalStatus(CANData& data);
+void fuelReadingReceived(const CANData& data, FuelSource path);
+void pollLS200Serial();
+bool parseLS200Line(const char* line, CANData& data);
+const CANData& selectFuelReading(const CANData& canData, const CANData& serialData);
+void printCANValue(Print& out, const CANData& canData, uint16_t value);
+void printExternalTemp(Print& out, const CANData& canData);
 void streamCSVData(const char* phase, const char* direction);
+void sampleTask();
+void drainTask();
+void controlTask();
+void debugTask();
+void outputTask();
+void reportDrops();
+void startTasks();
+void runTasks();
+void runFor(unsigned long durationMs);
+void setPhase(const char* phase, const char* direction);
+void setSampleInterval(unsigned long intervalUs);
+uint16_t crc16Update(uint16_t crc, byte data);
+bool writeFrame(byte type, const byte* payload, byte length);
+byte labelId(LabelSlot& slot, const char* text, bool (*send)(byte, const byte*, byte));
+void resetLabels();
+void fillSampleRecord(SampleRecord& record, unsigned long elapsedTime, const PitchSample& pitch, const CANData& canData);
+bool streamBinaryData(unsigned long elapsedTime, const PitchSample& pitch, const CANData& canData, const char* phase, const char* direction);
+void beginLog();
+void startLog();
+void logSample(unsigned long elapsedTime, const PitchSample& pitch, const CANData& canData, const char* phase, const char* direction);
+bool logRecord(byte type, const byte* payload, byte length);
+void startIndexedSector(unsigned long elapsedTime);
+bool writeLogSector();
+void stopLog();
+void startBurst();
+void endBurstMotion();
+void captureBurstSample(byte source, unsigned long timeMs);
+void rebaseBurst(unsigned long offsetMs);
+bool sendBurstHeader();
+void burstTask();
+void allowBurstSend(bool allowed);
+void summarizeRow(const char* phase, unsigned long elapsedTime, const PitchSample& pitch, const CANData& canData);
+void addStatsValue(RunningStats& stats, long value);
+void finishPhase();
+void fillPhaseValue(PhaseValueRecord& record, const RunningStats& stats);
+void summaryTask();
+void sendNextPhaseLine(bool force);
+bool sendPhaseLine(byte line);
+void printFixed(Print& out, long value, byte decimals);
+bool streamRawRow();
+void printRawMode(Print& out);
+void commandTask();
+void handleCommand(char* line);
+void runCommand(char* profileName, char* cycles);
+void setCommand(char* setting, char* value);
+void benchCommand(char* seconds);
+void printStatus();
+void writeHeaders();
+void runBench();
+void benchRow(const PitchSample& pitch, bool queued);
+void checkLatencyProbe();
+void printBenchReport(Print& out, const BenchReport& report);
+uint16_t saturate16(unsigned long value);
+void statsTask();
+void resetStats();
+void recordTiming(TimingId id, unsigned long startUs);
+void recordLateness(unsigned long lateUs);
+void checkCANOverflow();
+void printStats(const char* title);
+char* heapEnd();
+unsigned int freeSram();
+void paintStack();
+unsigned int sramLowWatermark();
+
+Task tasks[TASK_COUNT] = {
+    {sampleTask, DATA_INTERVAL * 1000UL, 0, 0},
+    {drainTask, DRAIN_PERIOD_US, 0, 0},
+    {controlTask, CONTROL_PERIOD_US, 0, 0},
+    {debugTask, DEBUG_PERIOD_US, 0, 0},
+    {outputTask, OUTPUT_PERIOD_US, 0, 0},
+    {statsTask, STATS_PERIOD_US, 0, 0},
+    {burstTask, BURST_FLUSH_PERIOD_US, 0, 0},
+    {commandTask, COMMAND_PERIOD_US, 0, 0},
+    {summaryTask, SUMMARY_PERIOD_US, 0, 0}
+};
 
 void setup() {
-    Serial.begin(115200);  //Debugging output
-    while (!Serial && millis() < 3000) {
+    unsigned long setupStartMs = millis();
+    Serial.begin(DATA_BAUD);  //Data stream and commands
+    dataBaud = DATA_BAUD;
+    while (!FAST_START && !Serial && millis() < 3000) {
         ; //Wait for serial port to connect (needed for native USB port only)
     }
     
     //All debug messages go to Serial1, keeping main Serial clean for CSV & Data Parsing
     Serial1.begin(115200);
-    Serial1.println("# Test Data Collection Starting");
-    Serial1.println("# Initializing system...");
+    debugOut.println(F("# Test Data Collection Starting"));
+    debugOut.println(F("# Initializing system..."));
     
-    WT901_SERIAL.begin(9600);  //WT901 default baud rate
-    FUEL_SERIAL.begin(9600);  //Fuel sensor default baud rate
+    configureWT901();  //WT901 to 115200 baud, fast angle-only output
+    if (RIG.hasFuelSerial) {
+        RIG.fuelSerial->begin(RIG.fuelBaud);  //Fuel sensor default baud rate
+    }
 
-    pinMode(MOTOR_ENA, OUTPUT);
-    pinMode(MOTOR_IN1, OUTPUT);
-    pinMode(MOTOR_IN2, OUTPUT);
+    pinMode(RIG.motorEna, OUTPUT);
+    pinMode(RIG.motorIn1, OUTPUT);
+    pinMode(RIG.motorIn2, OUTPUT);
     
-    pinMode(CAN_CS, OUTPUT);
-    digitalWrite(CAN_CS, HIGH);  //Make sure CAN CS is high when not in use
-    
-    delay(100);
-
-    //Initialize CAN with more detailed error reporting
-    Serial1.println("# Initializing CAN bus...");
+    pinMode(RIG.canCs, OUTPUT);
+    digitalWrite(RIG.canCs, HIGH);  //Make sure CAN CS is high when not in use
+    pinMode(RIG.canInt, INPUT_PULLUP);
     
-    //1.0 Mbps baud rate
-    byte canStatus = CAN.begin(MCP_ANY, CAN_1000KBPS, MCP_8MHZ);
+    //Keep the ISR away from the MCP2515 while it is being (re)configured
+    detachInterrupt(digitalPinToInterrupt(RIG.canInt));
     
-    if (canStatus == CAN_OK) {
-        Serial1.println("# CAN module initialized successfully at 1Mbps");
-    } else {
-        Serial1.print("# CAN module initialization failed at 1Mbps. Error code: ");
-        Serial1.println(canStatus);
-        Serial1.println("# Trying alternate baud rates...");
-        
-        //Try other common baud rates
-        byte baudRates[] = {CAN_500KBPS, CAN_250KBPS, CAN_125KBPS};
-        const char* baudRateNames[] = {"500kbps", "250kbps", "125kbps"};
-        
-        for (int i = 0; i < 3; i++) {
-            delay(100);
-            canStatus = CAN.begin(MCP_ANY, baudRates[i], MCP_8MHZ);
-            if (canStatus == CAN_OK) {
-                Serial1.print("# CAN module initialized at ");
-                Serial1.println(baudRateNames[i]);
-                break;
-            }
-        }
-        
-        if (canStatus != CAN_OK) {
-            Serial1.println("# CAN module initialization failed with all settings");
-        }
+    if (!FAST_START) {
+        delay(100);
     }
+
+    //Initialize CAN with more detailed error reporting
+    debugOut.println(F("# Initializing CAN bus..."));
+    beginCAN();
     
     //Set CAN module to normal operation mode
     CAN.setMode(MCP_NORMAL);
     
-    //Configure masks and filters
-    CAN.init_Mask(0, 0, 0x00000000);  //Mask 0 - allow all IDs
-    CAN.init_Mask(1, 0, 0x00000000);  //Mask 1 - allow all IDs
+    configureCANFilters();
     
-    for (byte i = 0; i < 6; i++) {
-        CAN.init_Filt(i, 0, 0x00000000);  //Filter i - allow all IDs
+    if (SD_LOGGING) {
+        beginLog();
+    }
+    
+    //Start receiving into the frame ring
+    canRing.head = 0;
+    canRing.tail = 0;
+    canRing.overflows = 0;
+    canRing.rejected = 0;
+    if (CAN_USE_INTERRUPT) {
+        //SPI transactions in the main loop mask the ISR so it can't interrupt another SPI transfer
+        SPI.usingInterrupt(digitalPinToInterrupt(RIG.canInt));
+        //Level triggered, so a frame already pending when attaching is still serviced
+        attachInterrupt(digitalPinToInterrupt(RIG.canInt), canISR, LOW);
     }
 
     //Headers will be written before data collection starts
     headersWritten = false;
+    testComplete = false;  //Zeroing counts as running, so abort can cancel the startup test
+    outputFormat = STARTUP_OUTPUT_FORMAT;
+    activeProfile = &RIG.profiles[0];
+    runCycles = 1;
+    currentCycle = 0;
+    currentStep = 0;
+    runRequested = false;
+    abortRequested = false;
+    resetRequested = false;
+    benchSeconds = 0;
+    bench.active = false;
+    commandLength = 0;
+    commandOverflow = false;
+    setPhase(NULL, NULL);
+    phaseStats.phase[0] = '\0';  //A phase cut short by reset isn't summarized
+    phaseReport.pending = false;
+    rawMode = STARTUP_RAW_MODE;
+    rawDecimation = STARTUP_RAW_DECIMATION;
+    startTasks();
+    recordSequence = 0;
+    resetLabels();
+    burst.head = 0;
+    burst.count = 0;
+    burst.sent = 0;
+    burst.headerSent = false;
+    burst.capturing = false;
+    burst.sendAllowed = false;
 
     //Stop motor at startup
     stopMotor();
     
-    Serial1.println("# Adjusting actuator to achieve 0-degree pitch...");
+    //Record start time for elapsed time calculations. With FAST_START the zeroing rows are
+    //streamed, so the test's time base starts before them.
+    if (FAST_START) {
+        resetStats();
+        startTime = millis();
+        writeHeaders();
+    }
+    
+    debugOut.println(F("# Adjusting actuator to achieve 0-degree pitch..."));
     adjustToZeroPitch();
-    Serial1.println("# Pitch is now 0 degrees. Starting test motion...");
     
-    //Record start time for elapsed time calculations
-    startTime = millis();
-    testComplete = false;
+    if (!FAST_START) {
+        resetStats();
+        startTime = millis();
+    }
+    debugOut.print(F("# Startup took "));
+    debugOut.print(millis() - setupStartMs);
+    debugOut.println(F("ms"));
+    
+    //An abort while zeroing cancels the startup test
+    if (abortRequested) {
+        debugOut.println(F("# Startup test cancelled - send 'run' to start a test"));
+        abortRequested = false;
+        testComplete = true;
+        setPhase(NULL, NULL);
+    } else {
+        debugOut.println(F("# Pitch is now 0 degrees. Starting test motion..."));
+        testComplete = false;
+    }
+    debugOut.flush();
 }
 
 void loop() {
-    //If test is complete, enter idle state
+    //Reset requested via serial command, the running test has already been aborted
+    if (resetRequested) {
+        debugOut.println(F("# Resetting system..."));
+        setup();  //Call setup to reset the system
+        return;
+    }
+    
+    //If test is complete, enter idle state until a run command
     if (testComplete) {
-        //Check if reset is requested via serial command
-        if (Serial.available() > 0) {
-            String command = Serial.readStringUntil('\n');
-            if (command == "reset") {
-                Serial1.println("# Resetting system...");
-                setup();  //Call setup to reset the system
-                return;
-            }
+        if (benchSeconds > 0) {
+            runBench();
+            return;
         }
-        delay(100);  //Small delay to prevent busy-waiting
-        return;      //Skip the rest of the loop
+        if (!runRequested) {
+            abortRequested = false;  //A stray abort must never stop the idle runFor() below
+            allowBurstSend(true);  //Send what the last motion left in the burst buffer
+            runFor(100);  //Keep servicing tasks while waiting for a command
+            return;      //Skip the rest of the loop
+        }
+        runRequested = false;
+        testComplete = false;
+        allowBurstSend(false);
     }
     
-    //Begin data streaming
-    unsigned long cycleStartTime = millis();
-    unsigned long lastDataTime = 0;
-    unsigned long movementEndTime;
-    
-    //Write headers before starting data collection
-    if (!headersWritten) {
-        Serial.println("TimeMS,FuelLevel,InternalTemp,ExternalTemp,Pitch,Phase,MovementDirection");
-        headersWritten = true;
-    }
+    writeHeaders();
     
-    //Pitch to Positive 5
-    Serial1.println("# Raising to +5");
-    adjustToPosFivePitch();
-   
-    //Print warning if no CAN messages received
-    if (millis() - lastCanMsgTime > 60000) {  //If no CAN messages for 60 seconds
-        Serial1.println("# WARNING: No CAN messages received in the last 60 seconds.");
-        lastCanMsgTime = millis();  //Reset to avoid repeated warnings
+    if (SD_LOGGING) {
+        startLog();
     }
     
-    stopMotor();
-    
-    Serial1.println("# Starting first stationary period");
-    //Continue collecting data during first stationary period
-    movementEndTime = millis() + 10000;
-    lastDataTime = millis();
-    while (millis() < movementEndTime) {
-        if (millis() - lastDataTime >= DATA_INTERVAL) {
-            streamCSVData("Stationary1", "None");
-            lastDataTime = millis();
+    //Walk the active profile runCycles times: move to each target, then hold it
+    for (currentCycle = 1; currentCycle <= runCycles && !abortRequested; currentCycle++) {
+        debugOut.print(F("# Running profile "));
+        debugOut.print(activeProfile->name);
+        debugOut.print(F(", cycle "));
+        debugOut.print(currentCycle);
+        debugOut.print(F(" of "));
+        debugOut.println(runCycles);
+        
+        for (byte i = 0; i < activeProfile->stepCount && !abortRequested; i++) {
+            PitchStep step;
+            memcpy_P(&step, &activeProfile->steps[i], sizeof(step));
+            currentStep = i + 1;
+            
+            debugOut.print(F("# Step "));
+            debugOut.print(i + 1);
+            debugOut.print(F(": moving to "));
+            printCentideg(debugOut, step.target);
+            debugOut.println();
+            
+            formatAdjustLabel(stepPhaseText, step.target);
+            moveToPitch(step.target, step.tolerance, stepPhaseText);
+            checkCANTimeout();
+            stopMotor();
+            if (abortRequested) {
+                break;
+            }
+            
+            debugOut.print(F("# Starting stationary period "));
+            debugOut.println(i + 1);
+            snprintf(stepPhaseText, sizeof(stepPhaseText), "Stationary%d", i + 1);
+            setPhase(stepPhaseText, "None");
+            dwell(step.dwellMs);
         }
+        currentStep = 0;
     }
     
-    //Pitch to Negative 5
-    Serial1.println("# Lowering to -5");
-    adjustToNegFivePitch();
-   
-    //Print warning if no CAN messages received
-    if (millis() - lastCanMsgTime > 60000) {  //If no CAN messages for 60 seconds
-        Serial1.println("# WARNING: No CAN messages received in the last 60 seconds.");
-        lastCanMsgTime = millis();  //Reset to avoid repeated warnings
+    if (abortRequested) {
+        debugOut.println(F("# Test aborted"));
+        abortRequested = false;  //Let the return to zero run
     }
+    currentCycle = 0;
     
-    stopMotor();
+    //Return to zero pitch position
+    debugOut.println(F("# Returning to zero pitch position"));
+    returnToZeroPitch();
+    abortRequested = false;  //An abort during the return has nothing left to end
     
-    Serial1.println("# Starting second stationary period");
-    //Continue collecting data during final stationary period
-    movementEndTime = millis() + 10000;
-    lastDataTime = millis();
-    while (millis() < movementEndTime) {
-        if (millis() - lastDataTime >= DATA_INTERVAL) {
-            streamCSVData("Stationary2", "None");
-            lastDataTime = millis();
-        }
+    if (ENABLE_INSTRUMENTATION) {
+        printStats("Summary");
     }
-    
-    //Pitch to Positive 10
-    Serial1.println("# Raising to +10");
-    adjustToPosTenPitch();
-   
-    //Print warning if no CAN messages received
-    if (millis() - lastCanMsgTime > 60000) {  //If no CAN messages for 60 seconds
-        Serial1.println("# WARNING: No CAN messages received in the last 60 seconds.");
-        lastCanMsgTime = millis();  //Reset to avoid repeated warnings
+    debugOut.println(F("# Test complete - System waiting for a command"));
+    debugOut.println(F("# Send 'run [profile] [cycles]' to start a test, 'status' or 'reset'"));
+    testComplete = true;  //Set flag to stop further testing until the next run
+    setPhase(NULL, NULL);  //Stop streaming until the next test
+    if (SD_LOGGING) {
+        stopLog();
     }
-    
-    stopMotor();
-    
-    Serial1.println("# Starting third stationary period");
-    //Continue collecting data during final stationary period
-    movementEndTime = millis() + 10000;
-    lastDataTime = millis();
-    while (millis() < movementEndTime) {
-        if (millis() - lastDataTime >= DATA_INTERVAL) {
-            streamCSVData("Stationary3", "None");
-            lastDataTime = millis();
-        }
-    }
-       
-    //Pitch to Negative 10
-    Serial1.println("# Lowering to -10");
-    adjustToNegTenPitch();  
-   
-    //Print warning if no CAN messages received
-    if (millis() - lastCanMsgTime > 60000) {  //If no CAN messages for 60 seconds
-        Serial1.println("# WARNING: No CAN messages received in the last 60 seconds.");
-        lastCanMsgTime = millis();  //Reset to avoid repeated warnings
+    checkCANTimeout();
+}
+
+//CSV header or binary notice, once per session and format
+void writeHeaders() {
+    if (headersWritten) {
+        return;
     }
+    if (outputFormat == OUTPUT_CSV) {
+        dataOut.println(F("TimeMS,FuelLevel,InternalTemp,ExternalTemp,Pitch,Phase,MovementDirection,PitchAgeMS,PitchFresh,CANAgeMS,CANFresh,SerialFuelLevel,SerialAgeMS"));
+    } else {
+        debugOut.println(F("# Streaming binary records"));
+    }
+    headersWritten = true;
+}
+
+//Stream at the current rate and format for benchSeconds with the table held still, then report
+//what the data stream achieved. The rows are ordinary rows in the "Bench" phase.
+void runBench() {
+    unsigned long durationMs = benchSeconds * 1000UL;
+    benchSeconds = 0;
+    testComplete = false;  //Busy until the report is out, and abort ends the run early
+    allowBurstSend(false);
+    writeHeaders();
     
-    stopMotor();
+    memset(&bench, 0, sizeof(bench));
+    bench.latencyMinUs = 0xFFFFFFFF;
+    bench.droppedAtStart = dataOut.droppedRecords;
+    noInterrupts();
+    bench.canOverflowsAtStart = canRing.overflows;
+    interrupts();
+    tasks[TASK_SAMPLE].missed = 0;
+    bench.active = true;
     
-    Serial1.println("# Starting fourth stationary period");
-    //Continue collecting data during final stationary period
-    movementEndTime = millis() + 10000;
-    lastDataTime = millis();
-    while (millis() < movementEndTime) {
-        if (millis() - lastDataTime >= DATA_INTERVAL) {
-            streamCSVData("Stationary4", "None"); 
-            lastDataTime = millis();
-        }
-    }
+    debugOut.println(F("# Bench started"));
+    unsigned long start = millis();
+    setPhase("Bench", "None");
+    runFor(durationMs);
+    setPhase(NULL, NULL);
+    unsigned long elapsedMs = millis() - start;
+    bench.active = false;
     
-    //Return to zero pitch position
-    Serial1.println("# Returning to zero pitch position");
-    returnToZeroPitch();
+    if (abortRequested) {
+        debugOut.println(F("# Bench aborted"));
+        abortRequested = false;
+    }
     
-    Serial1.println("# Test cycle complete - System waiting for reset");
-    Serial1.println("# Send 'reset' command to begin a new test");
-    testComplete = true;  //Set flag to stop further testing until reset
+    BenchReport report;
+    report.durationMs = elapsedMs;
+    report.rateHz = 1000000UL / tasks[TASK_SAMPLE].periodUs;
+    report.baud = dataBaud;
+    report.rows = bench.rows;
+    report.droppedRecords = saturate16(dataOut.droppedRecords - bench.droppedAtStart);
+    report.missedTicks = saturate16(tasks[TASK_SAMPLE].missed);
+    report.maxLatenessUs = saturate16(bench.maxLatenessUs);
+    report.canFrames = bench.canFrames;
+    noInterrupts();
+    unsigned long ringOverflows = canRing.overflows - bench.canOverflowsAtStart;
+    interrupts();
+    report.canLost = saturate16(ringOverflows + bench.canControllerOverflows);
+    if (bench.latencyCount > 0) {
+        report.latencyMinUs = bench.latencyMinUs;
+        report.latencyMeanUs = bench.latencyTotalUs / bench.latencyCount;
+        report.latencyMaxUs = bench.latencyMaxUs;
+    } else {
+        report.latencyMinUs = 0;
+        report.latencyMeanUs = 0;
+        report.latencyMaxUs = 0;
+    }
     
-    //Print warning if no CAN messages received
-    if (millis() - lastCanMsgTime > 60000) {  //If no CAN messages for 60 seconds
-        Serial1.println("# WARNING: No CAN messages received in the last 60 seconds.");
-        lastCanMsgTime = millis();  //Reset to avoid repeated warnings
+    //Let the last rows go out so there is room for the report
+    while (dataOut.availableForWrite() < DATA_QUEUE_SIZE - 1) {
+        runTasks();
+    }
+    if (outputFormat == OUTPUT_BINARY) {
+        writeFrame(FRAME_TYPE_BENCH, (const byte*)&report, sizeof(report));
+    } else {
+        dataOut.beginRecord();
+        printBenchReport(dataOut, report);
+        dataOut.endRecord();
+    }
+    printBenchReport(debugOut, report);
+    testComplete = true;
+}
+
+//Count a row of a bench run, and follow the first fresh row while none is in flight
+//until its last byte has been handed to the UART
+void benchRow(const PitchSample& pitch, bool queued) {
+    bench.rows++;
+    if (!queued || !pitch.fresh || bench.probePending) {
+        return;
+    }
+    bench.probePending = true;
+    bench.probeStartUs = wt901.angle.timeUs;
+    bench.probeSentBytes = dataOut.sentBytes + (DATA_QUEUE_SIZE - 1 - dataOut.availableForWrite());
+}
+
+void checkLatencyProbe() {
+    if ((long)(dataOut.sentBytes - bench.probeSentBytes) < 0) {
+        return;
+    }
+    unsigned long latencyUs = micros() - bench.probeStartUs;
+    bench.probePending = false;
+    bench.latencyCount++;
+    bench.latencyTotalUs += latencyUs;
+    if (latencyUs < bench.latencyMinUs) {
+        bench.latencyMinUs = latencyUs;
     }
+    if (latencyUs > bench.latencyMaxUs) {
+        bench.latencyMaxUs = latencyUs;
+    }
+}
+
+//One "# Bench:" line, parsed by bench.py. telemetry.py prints the same line for a bench frame.
+void printBenchReport(Print& out, const BenchReport& report) {
+    out.print(F("# Bench: ms="));
+    out.print(report.durationMs);
+    out.print(F(" rate="));
+    out.print(report.rateHz);
+    out.print(F(" baud="));
+    out.print(report.baud);
+    out.print(F(" format="));
+    out.print(outputFormat == OUTPUT_CSV ? "csv" : "binary");
+    out.print(F(" rows="));
+    out.print(report.rows);
+    out.print(F(" dropped="));
+    out.print(report.droppedRecords);
+    out.print(F(" missed="));
+    out.print(report.missedTicks);
+    out.print(F(" late_max_us="));
+    out.print(report.maxLatenessUs);
+    out.print(F(" can_frames="));
+    out.print(report.canFrames);
+    out.print(F(" can_lost="));
+    out.print(report.canLost);
+    out.print(F(" latency_min_us="));
+    out.print(report.latencyMinUs);
+    out.print(F(" latency_mean_us="));
+    out.print(report.latencyMeanUs);
+    out.print(F(" latency_max_us="));
+    out.println(report.latencyMaxUs);
+}
+
+uint16_t saturate16(unsigned long value) {
+    return (value > 0xFFFF) ? 0xFFFF : value;
 }
 
-void moveMotorForward() {
-    digitalWrite(MOTOR_IN1, HIGH);
-    digitalWrite(MOTOR_IN2, LOW);
-    analogWrite(MOTOR_ENA, 255);
+void moveMotorForward(byte duty) {
+    if (!isMoving) {
+        startBurst();
+    }
+    digitalWrite(RIG.motorIn1, HIGH);
+    digitalWrite(RIG.motorIn2, LOW);
+    analogWrite(RIG.motorEna, duty);
     isMoving = true;
 }
 
-void moveMotorBackward() {
-    digitalWrite(MOTOR_IN1, LOW);
-    digitalWrite(MOTOR_IN2, HIGH);
-    analogWrite(MOTOR_ENA, 255);
+void moveMotorBackward(byte duty) {
+    if (!isMoving) {
+        startBurst();
+    }
+    digitalWrite(RIG.motorIn1, LOW);
+    digitalWrite(RIG.motorIn2, HIGH);
+    analogWrite(RIG.motorEna, duty);
     isMoving = true;
 }
 
+//Signed drive: positive duty moves the actuator UP (backward), negative DOWN (forward)
+void driveMotor(int duty) {
+    if (duty > 0) {
+        moveMotorBackward(duty);
+    } else if (duty < 0) {
+        moveMotorForward(-duty);
+    } else {
+        stopMotor();
+    }
+}
+
 void stopMotor() {
-    digitalWrite(MOTOR_IN1, LOW);
-    digitalWrite(MOTOR_IN2, LOW);
-    analogWrite(MOTOR_ENA, 0);
+    digitalWrite(RIG.motorIn1, LOW);
+    digitalWrite(RIG.motorIn2, LOW);
+    analogWrite(RIG.motorEna, 0);
+    if (isMoving) {
+        endBurstMotion();
+    }
     isMoving = false;
 }
 
-float readPitch() {
-    if (WT901_SERIAL.available() >= 11) {  //Make sure we have enough bytes for a complete packet
-        byte header = WT901_SERIAL.read();
-        if (header == 0x55) {
-            byte buffer[10];
-            buffer[0] = header;
-            
-            //Read the remaining 9 bytes of the packet
-            WT901_SERIAL.readBytes(&buffer[1], 9);
-            
-            if (buffer[1] == 0x53) {  //Check if it's an angle packet
-                int16_t pitch_raw = (buffer[3] << 8) | buffer[2];
-                return pitch_raw / 32768.0 * 180.0;
-            }
-        }
+//Set the labels streamed by the sample task. NULL phase stops streaming and ends the phase summary.
+void setPhase(const char* phase, const char* direction) {
+    if (phase == NULL) {
+        finishPhase();
     }
-    
-    //If -999, not enough data, or wrong packets. Don't clear buffer.
-    return -999.0;
+    currentPhase = phase;
+    currentDirection = direction;
 }
 
-void adjustToZeroPitch() {
-    float pitch = -999.0;
-    int timeoutCounter = 0;
-    const int maxTimeout = 1000;  //Maximum number of attempts to read valid pitch
-    
-    //Try to get a valid pitch reading in the range of -25 to +25 degrees
-    while ((pitch == -999.0 || pitch < -25.0 || pitch > 25.0) && timeoutCounter < maxTimeout) {
-        pitch = readPitch();
-        if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-            delay(10);  //Short delay before trying again
-            timeoutCounter++;
-        }
-    }
-    
-    if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-        Serial1.println("# Failed to get valid pitch reading. Check inclinometer connection.");
-        return;
+//Change the sampling rate, the next sample is due one new interval from now
+void setSampleInterval(unsigned long intervalUs) {
+    tasks[TASK_SAMPLE].periodUs = intervalUs;
+    tasks[TASK_SAMPLE].nextUs = micros() + intervalUs;
+}
+
+//Schedule every task one period from now
+void startTasks() {
+    unsigned long now = micros();
+    for (byte i = 0; i < TASK_COUNT; i++) {
+        tasks[i].nextUs = now + tasks[i].periodUs;
+        tasks[i].missed = 0;
     }
-    
-    Serial1.print("# Initial pitch: ");
-    Serial1.println(pitch);
-    
-    while (abs(pitch) > 0.1) {
-        if (pitch > 0) {
-            //Positive pitch - need to move actuator DOWN
-            Serial1.println("# Moving actuator DOWN");
-            moveMotorForward();  //Assuming "forward" means DOWN
-        } else {
-            //Negative pitch - need to move actuator UP
-            Serial1.println("# Moving actuator UP");
-            moveMotorBackward();  //Assuming "backward" means UP
-        }
-        
-        delay(200);  //Give time for actuator to move
-        stopMotor();
-        delay(1000);   //Short pause to let system stabilize
+}
+
+//Run each task whose deadline has passed. Called from every wait instead of spinning on millis().
+void runTasks() {
+    for (byte i = 0; i < TASK_COUNT; i++) {
+        Task& task = tasks[i];
+        unsigned long now = micros();
         
-        //Try to get a valid pitch reading after movement
-        timeoutCounter = 0;
-        pitch = -999.0;
+        if ((long)(now - task.nextUs) < 0) {
+            continue;
+        }
         
-        while ((pitch == -999.0 || pitch < -25.0 || pitch > 25.0) && timeoutCounter < maxTimeout) {
-            pitch = readPitch();
-            if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-                delay(10);
-                timeoutCounter++;
-            }
+        if (i == TASK_SAMPLE) {
+            recordLateness(now - task.nextUs);
         }
         
-        if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-            Serial1.println("# Lost valid pitch reading during adjustment. Stopping.");
-            break;
+        //Advance from the deadline, not from now, and skip whole periods if we fell behind
+        task.nextUs += task.periodUs;
+        while ((long)(now - task.nextUs) >= 0) {
+            task.nextUs += task.periodUs;
+            task.missed++;
         }
         
-        Serial1.print("# Current pitch: ");
-        Serial1.println(pitch);
+        task.run();
     }
-    
-    stopMotor();
-    Serial1.println("# Pitch stabilized at near 0 degrees.");
 }
 
-//Return to zero pitch at the end of the test
-void returnToZeroPitch() {
-    float pitch = -999.0;
-    int timeoutCounter = 0;
-    const int maxTimeout = 1000;
-    unsigned long lastDataTime = 0;
-    
-    //Get current pitch
-    while ((pitch == -999.0 || pitch < -25.0 || pitch > 25.0) && timeoutCounter < maxTimeout) {
-        pitch = readPitch();
-        if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-            delay(10);
-            timeoutCounter++;
-        }
+//Keep the tasks running for durationMs
+void runFor(unsigned long durationMs) {
+    unsigned long start = millis();
+    while (millis() - start < durationMs && !abortRequested) {
+        runTasks();
     }
-    
-    if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-        Serial1.println("# Failed to get valid pitch reading during return to zero.");
-        return;
+}
+
+//Stream one row for the current phase
+void sampleTask() {
+    if (currentPhase != NULL) {
+        unsigned long startUs = ENABLE_INSTRUMENTATION ? micros() : 0;
+        streamCSVData(currentPhase, currentDirection);
+        recordTiming(TIMING_STREAM_ROW, startUs);
+        reportDrops();
     }
+}
+
+void outputTask() {
+    unsigned long startUs = ENABLE_INSTRUMENTATION ? micros() : 0;
+    dataOut.drain();
+    debugOut.drain();
+    recordTiming(TIMING_OUTPUT, startUs);
+    if (bench.probePending) {
+        checkLatencyProbe();
+    }
+}
+
+//Tell the host how many records were lost in the output queues, whenever that changes
+void reportDrops() {
+    static unsigned long reportedData = 0;
+    static unsigned long reportedDebug = 0;
     
-    Serial1.print("# Return to zero - starting pitch: ");
-    Serial1.println(pitch);
+    if (dataOut.droppedRecords == reportedData && debugOut.droppedRecords == reportedDebug) {
+        return;
+    }
     
-    //Adjust to zero
-    while (abs(pitch) > 0.1) {
-        if (pitch > 0) {
-            Serial1.println("# Return to zero - moving actuator DOWN");
-            moveMotorForward();
-        } else {
-            Serial1.println("# Return to zero - moving actuator UP");
-            moveMotorBackward();
-        }
-        
-        //Continue logging data during adjustment
-        unsigned long adjustStartTime = millis();
-        lastDataTime = millis();
-        while (millis() < adjustStartTime + 200) {  //200ms adjustment time
-            if (millis() - lastDataTime >= DATA_INTERVAL) {
-                streamCSVData("ReturnToZero", (pitch > 0) ? "Down" : "Up");
-                lastDataTime = millis();
-            }
-        }
-        
-        stopMotor();
-        
-        //Log data during stabilization
-        adjustStartTime = millis();
-        lastDataTime = millis();
-        while (millis() < adjustStartTime + 1000) {  //1000ms stabilization time
-            if (millis() - lastDataTime >= DATA_INTERVAL) {
-                streamCSVData("ReturnToZero", "Stabilizing");
-                lastDataTime = millis();
-            }
-        }
-        
-        //Get new pitch reading
-        timeoutCounter = 0;
-        pitch = -999.0;
-        
-        while ((pitch == -999.0 || pitch < -25.0 || pitch > 25.0) && timeoutCounter < maxTimeout) {
-            pitch = readPitch();
-            if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-                delay(10);
-                timeoutCounter++;
-            }
-        }
-        
-        if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-            Serial1.println("# Lost valid pitch reading during return to zero. Stopping.");
-            break;
-        }
-        
-        Serial1.print("# Return to zero - current pitch: ");
-        Serial1.println(pitch);
+    bool sent;
+    if (outputFormat == OUTPUT_BINARY) {
+        DropReport report;
+        report.dataRecords = dataOut.droppedRecords;
+        report.debugRecords = debugOut.droppedRecords;
+        sent = writeFrame(FRAME_TYPE_DROPS, (const byte*)&report, sizeof(report));
+    } else {
+        dataOut.beginRecord();
+        dataOut.print(F("# Dropped records: data="));
+        dataOut.print(dataOut.droppedRecords);
+        dataOut.print(F(" debug="));
+        dataOut.println(debugOut.droppedRecords);
+        sent = dataOut.endRecord();
     }
     
-    stopMotor();
+    //Counts taken before the report, a dropped report is retried on the next sample
+    if (sent) {
+        reportedData = dataOut.droppedRecords;
+        reportedDebug = debugOut.droppedRecords;
+    }
+}
+
+//Move inclinometer bytes and CAN frames out of their buffers before they overflow
+void drainTask() {
+    pollWT901();
+    pollLS200Serial();
+    readCANData();
+    if (ENABLE_INSTRUMENTATION || bench.active) {
+        checkCANOverflow();
+    }
+}
+
+//Update the pitch controller, and never leave the actuator running without valid pitch feedback
+void controlTask() {
+    if (controller.active) {
+        updatePitchController();
+        return;
+    }
     
-    //Log final data points
-    lastDataTime = millis();
-    for (int i = 0; i < 100; i++) {  //Log 100 more data points at zero position
-        if (millis() - lastDataTime >= DATA_INTERVAL) {
-            streamCSVData("Complete", "Zero");
-            lastDataTime = millis();
-        }
-        delay(10);
+    if (!isMoving) {
+        return;
     }
     
-    Serial1.println("# Return to zero complete - pitch stabilized at zero degrees.");
+    if (!pitchInRange(readPitch())) {
+        stopMotor();
+        debugOut.println(F("# Pitch feedback lost while moving - motor stopped"));
+    }
 }
 
+//Print a status line to Serial1 about once a second while streaming
+void debugTask() {
+    if (!canSpeedSaved) {
+        saveCANSpeed();
+    }
+    if (currentPhase == NULL || !Serial1) {
+        return;
+    }
+    
+    const CANData& canData = readCANData();
+    debugOut.print(F("# Status at "));
+    debugOut.print(millis() - startTime);
+    debugOut.print(F("ms: Phase="));
+    debugOut.print(currentPhase);
+    debugOut.print(F(", Direction="));
+    debugOut.print(currentDirection);
+    debugOut.print(F(", Pitch="));
+    printCentideg(debugOut, readPitch());
+    debugOut.print(F(", Fuel="));
+    printCANValue(debugOut, canData, canData.fuelLevel);
+    debugOut.print(F(", Temp="));
+    printCANValue(debugOut, canData, canData.internalTemp);
+    debugOut.println();
+}
 
-//Raise to positive five degrees
-void adjustToPosFivePitch() {
-    float pitch = -999.0;
-    int timeoutCounter = 0;
-    const int maxTimeout = 1000;  //Maximum number of attempts to read valid pitch
-    unsigned long lastDataTime = 0;
+//Switch the WT901 to WT901_FAST_BAUD with fast angle-only output.
+//Falls back to the default 9600 baud if the sensor doesn't answer at the new rate.
+void configureWT901() {
+    debugOut.println(F("# Configuring WT901..."));
     
-    //Try to get a valid pitch reading in the range of -25 to +25 degrees
-    while ((pitch == -999.0 || pitch < -25.0 || pitch > 25.0) && timeoutCounter < maxTimeout) {
-        pitch = readPitch();
-        if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-            delay(10);  //Short delay before trying again
-            timeoutCounter++;
-        }
+    //Sensor may already be at the fast rate from a previous boot, else talk to it at its default.
+    //Only this function saves the fast baud, so with FAST_START the rest of the setup is skipped.
+    unsigned long packets = probeWT901(WT901_FAST_BAUD);
+    if (packets < WT901_PROBE_MIN_PACKETS) {
+        probeWT901(WT901_DEFAULT_BAUD);
+    } else if (FAST_START) {
+        printWT901Rate(WT901_FAST_BAUD, packets);
+        return;
     }
     
-    if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-        Serial1.println("# Failed to get valid pitch reading. Check inclinometer connection.");
+    writeWT901Register(WT901_REG_UNLOCK, WT901_UNLOCK_KEY);
+    writeWT901Register(WT901_REG_OUTPUT, WT901_OUTPUT_ANGLE);
+    writeWT901Register(WT901_REG_RATE, WT901_RATE_FAST);
+    writeWT901Register(WT901_REG_BAUD, WT901_BAUD_115200);
+    writeWT901Register(WT901_REG_SAVE, 0x0000);
+    
+    packets = probeWT901(WT901_FAST_BAUD);
+    if (packets >= WT901_PROBE_MIN_PACKETS) {
+        printWT901Rate(WT901_FAST_BAUD, packets);
         return;
     }
     
-    Serial1.print("# Initial pitch: ");
-    Serial1.println(pitch);
+    //No acknowledgement at the new baud: stay at the default with a rate that fits it
+    debugOut.println(F("# WT901 did not answer at 115200 baud, falling back to 9600"));
+    probeWT901(WT901_DEFAULT_BAUD);
+    writeWT901Register(WT901_REG_UNLOCK, WT901_UNLOCK_KEY);
+    writeWT901Register(WT901_REG_OUTPUT, WT901_OUTPUT_ANGLE);
+    writeWT901Register(WT901_REG_RATE, WT901_RATE_FALLBACK);
+    writeWT901Register(WT901_REG_SAVE, 0x0000);
     
-    while (pitch < 4.9 || pitch > 5.1) {  //Target is 5 degrees with 0.1 degree tolerance
-        if (pitch > 5.1) {
-            //Too high - need to move actuator DOWN
-            Serial1.println("# Moving actuator DOWN");
-            moveMotorForward();  //Forward=DOWN
-        } else if (pitch < 4.9) {
-            //Too low - need to move actuator UP
-            Serial1.println("# Moving actuator UP");
-            moveMotorBackward();  //Backward=UP
+    packets = probeWT901(WT901_DEFAULT_BAUD);
+    printWT901Rate(WT901_DEFAULT_BAUD, packets);
+}
+
+void printWT901Rate(unsigned long baud, unsigned long packets) {
+    debugOut.print(F("# WT901 at "));
+    debugOut.print(baud);
+    debugOut.print(F(" baud, "));
+    if (wt901.probeMs < WT901_PROBE_MS) {
+        debugOut.print(F("answered in "));  //FAST_START probe, too short for a rate
+        debugOut.print(wt901.probeMs);
+        debugOut.println(F("ms"));
+        return;
+    }
+    debugOut.print(packets * 1000 / WT901_PROBE_MS);
+    debugOut.println(F(" angle packets/s"));
+}
+
+void writeWT901Register(byte reg, uint16_t value) {
+    byte command[5] = {0xFF, 0xAA, reg, (byte)(value & 0xFF), (byte)(value >> 8)};
+    RIG.wt901Serial->write(command, sizeof(command));
+    RIG.wt901Serial->flush();
+    delay(WT901_COMMAND_DELAY_MS);
+}
+
+//Open the WT901 port at baud and count the angle packets that validate within WT901_PROBE_MS.
+//With FAST_START the probe ends as soon as WT901_PROBE_MIN_PACKETS have arrived.
+unsigned long probeWT901(unsigned long baud) {
+    RIG.wt901Serial->end();
+    RIG.wt901Serial->begin(baud);
+    wt901.index = 0;
+    
+    unsigned long startPackets = wt901.anglePackets;
+    unsigned long start = millis();
+    while (millis() - start < WT901_PROBE_MS) {
+        pollWT901();
+        if (FAST_START && wt901.anglePackets - startPackets >= WT901_PROBE_MIN_PACKETS) {
+            break;
         }
+    }
+    wt901.probeMs = millis() - start;
+    return wt901.anglePackets - startPackets;
+}
+
+//Return the latest validated pitch, or PITCH_INVALID if no angle packet arrived within WT901_TIMEOUT_MS
+int16_t readPitch() {
+    unsigned long startUs = ENABLE_INSTRUMENTATION ? micros() : 0;
+    pollWT901();
+    
+    int16_t pitch = wt901.pitchCenti;
+    if (!wt901.angle.valid || millis() - wt901.angle.timeMs > WT901_TIMEOUT_MS) {
+        pitch = PITCH_INVALID;
+    }
+    recordTiming(TIMING_READ_PITCH, startUs);
+    return pitch;
+}
+
+//True for a valid reading inside the +/-25 degree working range
+bool pitchInRange(int16_t pitch) {
+    return pitch != PITCH_INVALID && pitch >= -PITCH_LIMIT && pitch <= PITCH_LIMIT;
+}
+
+//Print centidegrees as degrees with two decimals, the text print(float, 2) gave
+void printCentideg(Print& out, int16_t centi) {
+    if (centi == PITCH_INVALID) {
+        out.print(F("No Data"));
+        return;
+    }
+    unsigned int magnitude = (centi < 0) ? -(long)centi : centi;
+    if (centi < 0) {
+        out.print('-');
+    }
+    out.print(magnitude / 100);
+    out.print('.');
+    if (magnitude % 100 < 10) {
+        out.print('0');
+    }
+    out.print(magnitude % 100);
+}
+
+//Feed all buffered WT901 bytes through the packet parser without blocking
+void pollWT901() {
+    while (RIG.wt901Serial->available() > 0) {
+        byte b = RIG.wt901Serial->read();
         
-        //Continue logging data during adjustment
-        unsigned long adjustStartTime = millis();
-        lastDataTime = millis();
-        while (millis() < adjustStartTime + 200) {  //200ms adjustment time
-            if (millis() - lastDataTime >= DATA_INTERVAL) {
-                streamCSVData("AdjustingToPos5", (pitch > 5.1) ? "Down" : "Up");
-                lastDataTime = millis();
+        //Byte-align on the header before collecting a packet
+        if (wt901.index == 0) {
+            if (b != WT901_HEADER) {
+                continue;
             }
+            wt901.packetStartUs = micros();
         }
         
-        stopMotor();
-        
-        //Wait for stabilization while logging data
-        adjustStartTime = millis();
-        lastDataTime = millis();
-        while (millis() < adjustStartTime + 1000) {  //1000ms stabilization time
-            if (millis() - lastDataTime >= DATA_INTERVAL) {
-                streamCSVData("AdjustingToPos5", "Stabilizing");
-                lastDataTime = millis();
-            }
+        wt901.buffer[wt901.index++] = b;
+        if (wt901.index == WT901_PACKET_SIZE) {
+            processWT901Packet();
         }
+    }
+}
+
+//Validate a complete packet and cache it, or resynchronize on the next header
+void processWT901Packet() {
+    byte sum = 0;
+    for (byte i = 0; i < WT901_PACKET_SIZE - 1; i++) {
+        sum += wt901.buffer[i];
+    }
+    
+    if (sum != wt901.buffer[WT901_PACKET_SIZE - 1]) {
+        wt901.checksumErrors++;
         
-        //Try to get a valid pitch reading after movement
-        timeoutCounter = 0;
-        pitch = -999.0;
-        
-        while ((pitch == -999.0 || pitch < -25.0 || pitch > 25.0) && timeoutCounter < maxTimeout) {
-            pitch = readPitch();
-            if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-                delay(10);
-                timeoutCounter++;
-            }
+        //Keep any later header in the rejected bytes, it may start the real packet
+        byte next = 1;
+        while (next < WT901_PACKET_SIZE && wt901.buffer[next] != WT901_HEADER) {
+            next++;
         }
-        
-        if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-            Serial1.println("# Lost valid pitch reading during adjustment. Stopping.");
+        wt901.index = WT901_PACKET_SIZE - next;
+        memmove(wt901.buffer, &wt901.buffer[next], wt901.index);
+        return;
+    }
+    
+    wt901.index = 0;
+    
+    WT901Packet* packet;
+    switch (wt901.buffer[1]) {
+        case WT901_TYPE_ACCEL:
+            packet = &wt901.accel;
             break;
-        }
-        
-        Serial1.print("# Current pitch: ");
-        Serial1.println(pitch);
+        case WT901_TYPE_GYRO:
+            packet = &wt901.gyro;
+            break;
+        case WT901_TYPE_ANGLE:
+            packet = &wt901.angle;
+            break;
+        default:
+            return;  //Packet types we don't use
     }
     
-    stopMotor();
-    Serial1.println("# Pitch stabilized at near +5 degrees.");
+    for (byte i = 0; i < 4; i++) {
+        packet->values[i] = (int16_t)((wt901.buffer[3 + 2 * i] << 8) | wt901.buffer[2 + 2 * i]);
+    }
+    packet->timeMs = millis();
+    packet->timeUs = wt901.packetStartUs;
+    packet->valid = true;
+    
+    if (packet == &wt901.angle) {
+        wt901.anglePackets++;
+        //raw / 32768 * 180 degrees is raw * 1125 / 2048 centidegrees, rounded
+        wt901.pitchCenti = ((int32_t)wt901.angle.values[0] * 1125 + 1024) >> 11;
+        addSettleSample(pitchSettle, wt901.pitchCenti, packet->timeMs);
+        if (burst.capturing) {
+            captureBurstSample(BURST_FLAG_PITCH, packet->timeMs);
+        }
+    }
 }
 
-
-//Raise to positive 10 degrees
-void adjustToPosTenPitch() {
-    float pitch = -999.0;
-    int timeoutCounter = 0;
+//Read pitch until it is valid and within -25 to +25 degrees. Returns PITCH_INVALID after about 10s without one.
+int16_t waitForValidPitch() {
     const int maxTimeout = 1000;  //Maximum number of attempts to read valid pitch
-    unsigned long lastDataTime = 0;
     
-    //Try to get a valid pitch reading in the range of -25 to +25 degrees
-    while ((pitch == -999.0 || pitch < -25.0 || pitch > 25.0) && timeoutCounter < maxTimeout) {
-        pitch = readPitch();
-        if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-            delay(10);  //Short delay before trying again
-            timeoutCounter++;
+    for (int timeoutCounter = 0; timeoutCounter < maxTimeout && !abortRequested; timeoutCounter++) {
+        int16_t pitch = readPitch();
+        if (pitchInRange(pitch)) {
+            return pitch;
         }
+        runFor(10);  //Short delay before trying again
     }
     
-    if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-        Serial1.println("# Failed to get valid pitch reading. Check inclinometer connection.");
-        return;
+    return PITCH_INVALID;
+}
+
+//Move the table until pitch is within tolerance of target. Rows are streamed under
+//phaseLabel while adjusting; a NULL label adjusts without streaming. timeoutMs only
+//bounds CONTROL_PID moves.
+bool moveToPitch(int16_t target, int16_t tolerance, const char* phaseLabel, ControlMode mode, unsigned long timeoutMs) {
+    int16_t pitch = waitForValidPitch();
+    
+    if (abortRequested) {
+        return false;
     }
+    if (pitch == PITCH_INVALID) {
+        debugOut.println(F("# Failed to get valid pitch reading. Check inclinometer connection."));
+        return false;
+    }
+    
+    debugOut.print(F("# Initial pitch: "));
+    printCentideg(debugOut, pitch);
+    debugOut.println();
     
-    Serial1.print("# Initial pitch: ");
-    Serial1.println(pitch);
+    bool reached;
+    if (mode == CONTROL_PID) {
+        reached = runPitchController(pitch, target, tolerance, phaseLabel, timeoutMs);
+    } else {
+        reached = pulseToPitch(pitch, target, tolerance, phaseLabel);
+    }
+    stopMotor();
     
-    //Fix the logic for positive 10 degrees
-    while (pitch < 9.9 || pitch > 10.1) {  //Target is 10 degrees with 0.1 degree tolerance
-        if (pitch > 10.1) {
+    if (reached) {
+        debugOut.print(F("# Pitch stabilized at near "));
+        printCentideg(debugOut, target);
+        debugOut.println(F(" degrees."));
+    }
+    return reached;
+}
+
+//Full-power pulses, stopping to re-read pitch after each one
+bool pulseToPitch(int16_t pitch, int16_t target, int16_t tolerance, const char* phaseLabel) {
+    while (pitch < target - tolerance || pitch > target + tolerance) {
+        bool down = pitch > target + tolerance;
+        if (down) {
             //Too high - need to move actuator DOWN
-            Serial1.println("# Moving actuator DOWN");
+            debugOut.println(F("# Moving actuator DOWN"));
             moveMotorForward();  //Forward=DOWN
-        } else if (pitch < 9.9) {
+        } else {
             //Too low - need to move actuator UP
-            Serial1.println("# Moving actuator UP");
+            debugOut.println(F("# Moving actuator UP"));
             moveMotorBackward();  //Backward=UP
         }
-
+        
         //Continue logging data during adjustment
-        unsigned long adjustStartTime = millis();
-        lastDataTime = millis();
-        while (millis() < adjustStartTime + 200) {  //200ms adjustment time
-            if (millis() - lastDataTime >= DATA_INTERVAL) {
-                streamCSVData("AdjustingToPos10", (pitch > 10.1) ? "Down" : "Up");
-                lastDataTime = millis();
-            }
+        if (phaseLabel != NULL) {
+            setPhase(phaseLabel, down ? "Down" : "Up");
         }
-        
+        runFor(MOTOR_PULSE_MS);
         stopMotor();
         
         //Wait for stabilization while logging data
-        adjustStartTime = millis();
-        lastDataTime = millis();
-        while (millis() < adjustStartTime + 1000) {  //1000ms stabilization time
-            if (millis() - lastDataTime >= DATA_INTERVAL) {
-                streamCSVData("AdjustingToPos10", "Stabilizing");
-                lastDataTime = millis();
-            }
+        if (phaseLabel != NULL) {
+            setPhase(phaseLabel, "Stabilizing");
         }
-        
-        //Try to get a valid pitch reading after movement
-        timeoutCounter = 0;
-        pitch = -999.0;
-        
-        while ((pitch == -999.0 || pitch < -25.0 || pitch > 25.0) && timeoutCounter < maxTimeout) {
-            pitch = readPitch();
-            if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-                delay(10);
-                timeoutCounter++;
-            }
+        waitForPitchSettle(STABILIZE_MS);
+        if (abortRequested) {
+            return false;
         }
         
-        if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-            Serial1.println("# Lost valid pitch reading during adjustment. Stopping.");
-            break;
+        pitch = waitForValidPitch();
+        if (pitch == PITCH_INVALID) {
+            debugOut.println(F("# Lost valid pitch reading during adjustment. Stopping."));
+            return false;
         }
         
-        Serial1.print("# Current pitch: ");
-        Serial1.println(pitch);
+        debugOut.print(F("# Current pitch: "));
+        printCentideg(debugOut, pitch);
+        debugOut.println();
     }
-    
-    stopMotor();
-    Serial1.println("# Pitch stabilized at near +10 degrees.");
+    return true;
 }
 
-//Adjust to negative five degrees
-void adjustToNegFivePitch() {
-    float pitch = -999.0;
-    int timeoutCounter = 0;
-    const int maxTimeout = 1000;  //Maximum number of attempts to read valid pitch
-    unsigned long lastDataTime = 0;
+//Hand the move to the control task and service tasks until it settles, fails or times out
+bool runPitchController(int16_t pitch, int16_t target, int16_t tolerance, const char* phaseLabel, unsigned long timeoutMs) {
+    controller.target = target;
+    controller.tolerance = tolerance;
+    controller.phaseLabel = phaseLabel;
+    controller.integral = 0;
+    controller.derivative = 0;
+    controller.lastPitch = pitch;
+    controller.lastPacketMs = wt901.angle.timeMs;
+    controller.lastUpdateUs = micros();
+    controller.startMs = millis();
+    controller.inBand = false;
+    controller.approach = (pitch < target) ? 1 : -1;
+    controller.overshoot = 0;
+    controller.failed = false;
+    controller.active = true;
+    resetSettle(pitchSettle);
     
-    //Try to get a valid pitch reading in the range of -25 to +25 degrees
-    while ((pitch == -999.0 || pitch < -25.0 || pitch > 25.0) && timeoutCounter < maxTimeout) {
-        pitch = readPitch();
-        if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-            delay(10);  //Short delay before trying again
-            timeoutCounter++;
+    while (controller.active) {
+        runTasks();
+        
+        if (abortRequested) {
+            controller.active = false;
+            stopMotor();
+            return false;
         }
+        if (millis() - controller.startMs > timeoutMs) {
+            controller.active = false;
+            stopMotor();
+            debugOut.println(F("# Move timed out before settling. Stopping."));
+            return false;
+        }
+    }
+    
+    if (controller.failed) {
+        debugOut.println(F("# Lost valid pitch reading during adjustment. Stopping."));
+        return false;
     }
     
-    if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-        Serial1.println("# Failed to get valid pitch reading. Check inclinometer connection.");
+    debugOut.print(F("# Settled in "));
+    debugOut.print(controller.settlingMs);
+    debugOut.print(F("ms, overshoot "));
+    printCentideg(debugOut, controller.overshoot);
+    debugOut.println(F(" degrees"));
+    return true;
+}
+
+//One PID step: PWM duty from the latest pitch, stop inside the tolerance band
+void updatePitchController() {
+    int16_t pitch = readPitch();
+    if (!pitchInRange(pitch)) {
+        stopMotor();
+        controller.failed = true;
+        controller.active = false;
         return;
     }
     
-    Serial1.print("# Initial pitch: ");
-    Serial1.println(pitch);
-  
-    while (pitch < -5.1 || pitch > -4.9) {  //Target is -5 degrees with 0.1 degree tolerance
-        if (pitch < -5.1) {
-            //Too low - need to move actuator UP
-            Serial1.println("# Moving actuator UP");
-            moveMotorBackward();  //Backward=UP
-        } else if (pitch > -4.9) {
-            //Too high - need to move actuator DOWN
-            Serial1.println("# Moving actuator DOWN");
-            moveMotorForward();  //Forward=DOWN
-        }
-        
-        //Continue logging data during adjustment
-        unsigned long adjustStartTime = millis();
-        lastDataTime = millis();
-        while (millis() < adjustStartTime + 200) {  //200ms adjustment time
-            if (millis() - lastDataTime >= DATA_INTERVAL) {
-                streamCSVData("AdjustingToNeg5", (pitch < -5.1) ? "Up" : "Down");
-                lastDataTime = millis();
-            }
-        }
-        
+    unsigned long nowUs = micros();
+    long dtUs = nowUs - controller.lastUpdateUs;
+    controller.lastUpdateUs = nowUs;
+    
+    //Rate from packet times, the controller runs faster than the inclinometer updates
+    if (wt901.angle.timeMs != controller.lastPacketMs) {
+        long packetDtMs = wt901.angle.timeMs - controller.lastPacketMs;
+        controller.derivative = (pitch - controller.lastPitch) * 1000L / packetDtMs;
+        controller.lastPitch = pitch;
+        controller.lastPacketMs = wt901.angle.timeMs;
+    }
+    
+    int16_t error = controller.target - pitch;
+    int16_t past = -error * controller.approach;
+    if (past > controller.overshoot) {
+        controller.overshoot = past;
+    }
+    
+    //Inside the band: hold still, settled once the platform is still or has stayed there for SETTLE_HOLD_MS
+    if (abs(error) <= controller.tolerance) {
         stopMotor();
-        
-        //Wait for stabilization while logging data
-        adjustStartTime = millis();
-        lastDataTime = millis();
-        while (millis() < adjustStartTime + 1000) {  //1000ms stabilization time
-            if (millis() - lastDataTime >= DATA_INTERVAL) {
-                streamCSVData("AdjustingToNeg5", "Stabilizing");
-                lastDataTime = millis();
-            }
-        }
-        
-        //Try to get a valid pitch reading after movement
-        timeoutCounter = 0;
-        pitch = -999.0;
-        
-        while ((pitch == -999.0 || pitch < -25.0 || pitch > 25.0) && timeoutCounter < maxTimeout) {
-            pitch = readPitch();
-            if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-                delay(10);
-                timeoutCounter++;
-            }
+        controller.integral = 0;
+        if (!controller.inBand) {
+            controller.inBand = true;
+            controller.inBandSinceMs = millis();
+        } else if (millis() - controller.inBandSinceMs >= SETTLE_HOLD_MS ||
+                   isSettled(pitchSettle, PITCH_SETTLE_STDDEV, PITCH_SETTLE_SLOPE)) {
+            controller.settlingMs = controller.inBandSinceMs - controller.startMs;
+            controller.active = false;
         }
-        
-        if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-            Serial1.println("# Lost valid pitch reading during adjustment. Stopping.");
-            break;
+        if (controller.phaseLabel != NULL) {
+            setPhase(controller.phaseLabel, "Stabilizing");
         }
-        
-        Serial1.print("# Current pitch: ");
-        Serial1.println(pitch);
+        return;
     }
+    controller.inBand = false;
     
-    stopMotor();
-    Serial1.println("# Pitch stabilized at near -5 degrees.");
+    long output = error * PID_KP_FIXED + ((controller.integral * PID_KI_FIXED) >> (PID_KI_SHIFT - PID_OUTPUT_SHIFT)) -
+                  controller.derivative * PID_KD_FIXED;
+    
+    //Only integrate while the output isn't saturated, so the integral can't wind up
+    if (labs(output) < ((long)PID_MAX_DUTY << PID_OUTPUT_SHIFT)) {
+        controller.integral += ((long)error * dtUs) >> 10;
+        controller.integral = constrain(controller.integral, -PID_INTEGRAL_LIMIT, PID_INTEGRAL_LIMIT);
+    }
+    
+    int duty = (int)constrain(output >> PID_OUTPUT_SHIFT, -PID_MAX_DUTY, PID_MAX_DUTY);
+    if (abs(duty) < PID_MIN_DUTY) {
+        duty = (error > 0) ? PID_MIN_DUTY : -PID_MIN_DUTY;
+    }
+    driveMotor(duty);
+    
+    if (controller.phaseLabel != NULL) {
+        setPhase(controller.phaseLabel, (duty > 0) ? "Up" : "Down");
+    }
 }
 
-//Adjust to negative ten degrees
-void adjustToNegTenPitch() {
-    float pitch = -999.0;
-    int timeoutCounter = 0;
-    const int maxTimeout = 1000;  //Maximum number of attempts to read valid pitch
-    unsigned long lastDataTime = 0;
+//Empty the window, e.g. when a new wait starts
+void resetSettle(SettleDetector& detector) {
+    detector.count = 0;
+    detector.next = 0;
+}
+
+void addSettleSample(SettleDetector& detector, long value, unsigned long timeMs) {
+    detector.values[detector.next] = value;
+    detector.timesMs[detector.next] = timeMs;
+    detector.next = (detector.next + 1) % SETTLE_WINDOW;
+    if (detector.count < SETTLE_WINDOW) {
+        detector.count++;
+    }
+}
+
+//True once the window is full and both its spread and its trend are within limits.
+//maxStdDev is in the sample units, maxSlope in sample units per second.
+bool isSettled(const SettleDetector& detector, long maxStdDev, long maxSlope) {
+    if (detector.count < SETTLE_WINDOW) {
+        return false;
+    }
     
-    //Try to get a valid pitch reading in the range of -25 to +25 degrees
-    while ((pitch == -999.0 || pitch < -25.0 || pitch > 25.0) && timeoutCounter < maxTimeout) {
-        pitch = readPitch();
-        if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-            delay(10);  //Short delay before trying again
-            timeoutCounter++;
+    //Integer sums of times (ms) and values relative to the oldest sample. The span and offset
+    //limits keep each square and product sum inside a long.
+    unsigned long oldestMs = detector.timesMs[detector.next];
+    long oldest = detector.values[detector.next];
+    long sumT = 0;
+    long sumV = 0;
+    long sumTT = 0;
+    long sumVV = 0;
+    long sumTV = 0;
+    for (byte i = 0; i < SETTLE_WINDOW; i++) {
+        unsigned long t = detector.timesMs[i] - oldestMs;
+        long v = detector.values[i] - oldest;
+        if (t > SETTLE_MAX_SPAN_MS || labs(v) > SETTLE_MAX_OFFSET) {
+            return false;
         }
+        sumT += t;
+        sumV += v;
+        sumTT += (long)(t * t);
+        sumVV += v * v;
+        sumTV += (long)t * v;
     }
     
-    if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-        Serial1.println("# Failed to get valid pitch reading. Check inclinometer connection.");
-        return;
+    //Variance times n^2 against the limit times n^2, no division needed
+    int64_t spread = (int64_t)SETTLE_WINDOW * sumVV - (int64_t)sumV * sumV;
+    int64_t maxSpread = (int64_t)(SETTLE_WINDOW * maxStdDev) * (SETTLE_WINDOW * maxStdDev);
+    if (spread > maxSpread) {
+        return false;
     }
     
-    Serial1.print("# Initial pitch: ");
-    Serial1.println(pitch);
+    //Least-squares slope per ms is trend / timeSpread
+    int64_t timeSpread = (int64_t)SETTLE_WINDOW * sumTT - (int64_t)sumT * sumT;
+    int64_t trend = (int64_t)SETTLE_WINDOW * sumTV - (int64_t)sumT * sumV;
+    if (trend < 0) {
+        trend = -trend;
+    }
+    return timeSpread > 0 && trend * 1000 <= (int64_t)maxSlope * timeSpread;
+}
+
+//Stabilization wait: ends as soon as the platform is still, or after maxMs
+void waitForPitchSettle(unsigned long maxMs) {
+    unsigned long start = millis();
+    resetSettle(pitchSettle);
     
-    while (pitch < -10.1 || pitch > -9.9) {  //Target is -10 degrees with 0.1 degree tolerance
-        if (pitch < -10.1) {
-            //Too low - need to move actuator UP
-            Serial1.println("# Moving actuator UP");
-            moveMotorBackward();  //Backward=UP
-        } else if (pitch > -9.9) {
-            //Too high - need to move actuator DOWN
-            Serial1.println("# Moving actuator DOWN");
-            moveMotorForward();  //Forward=DOWN
-        }
-        
-        //Continue logging data during adjustment
-        unsigned long adjustStartTime = millis();
-        lastDataTime = millis();
-        while (millis() < adjustStartTime + 200) {  //200ms adjustment time
-            if (millis() - lastDataTime >= DATA_INTERVAL) {
-                streamCSVData("AdjustingToNeg10", (pitch < -10.1) ? "Up" : "Down");
-                lastDataTime = millis();
-            }
-        }
-        
-        stopMotor();
-        
-        //Wait for stabilization while logging data
-        adjustStartTime = millis();
-        lastDataTime = millis();
-        while (millis() < adjustStartTime + 1000) {  //1000ms stabilization time
-            if (millis() - lastDataTime >= DATA_INTERVAL) {
-                streamCSVData("AdjustingToNeg10", "Stabilizing");
-                lastDataTime = millis();
-            }
+    while (millis() - start < maxMs && !abortRequested) {
+        runTasks();
+        if (isSettled(pitchSettle, PITCH_SETTLE_STDDEV, PITCH_SETTLE_SLOPE)) {
+            return;
         }
-        
-        //Try to get a valid pitch reading after movement
-        timeoutCounter = 0;
-        pitch = -999.0;
-        
-        while ((pitch == -999.0 || pitch < -25.0 || pitch > 25.0) && timeoutCounter < maxTimeout) {
-            pitch = readPitch();
-            if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-                delay(10);
-                timeoutCounter++;
+    }
+}
+
+//Stationary period of dwellMs, optionally ended early once the fuel level has converged
+void dwell(unsigned long dwellMs) {
+    unsigned long start = millis();
+    resetSettle(fuelSettle);
+    allowBurstSend(true);
+    byte settleNext = fuelSettle.next;
+    
+    while (millis() - start < dwellMs && !abortRequested) {
+        runTasks();
+        //Settling time for the phase summary, checked once per new fuel sample
+        if (PHASE_SUMMARIES && fuelSettle.next != settleNext) {
+            settleNext = fuelSettle.next;
+            if (phaseStats.settleMs == SETTLE_NOT_SEEN && isSettled(fuelSettle, FUEL_SETTLE_STDDEV, FUEL_SETTLE_SLOPE)) {
+                phaseStats.settleMs = millis() - start;
             }
         }
-        
-        if (pitch == -999.0 || pitch < -25.0 || pitch > 25.0) {
-            Serial1.println("# Lost valid pitch reading during adjustment. Stopping.");
+        if (DWELL_ENDS_ON_FUEL_SETTLE && millis() - start >= DWELL_MIN_MS &&
+            isSettled(fuelSettle, FUEL_SETTLE_STDDEV, FUEL_SETTLE_SLOPE)) {
+            debugOut.print(F("# Fuel level settled after "));
+            debugOut.print(millis() - start);
+            debugOut.println(F("ms, ending dwell"));
             break;
         }
-        
-        Serial1.print("# Current pitch: ");
-        Serial1.println(pitch);
+    }
+    allowBurstSend(false);
+}
+
+//Zero the table at startup, nothing is streamed yet
+//With FAST_START the PID controller zeroes whatever CONTROL_MODE is, streaming as it goes, and
+//a table still off zero after FAST_ZERO_BUDGET_MS starts the test from there
+void adjustToZeroPitch() {
+    if (!FAST_START) {
+        moveToPitch(0, ZERO_TOLERANCE, NULL);
+        return;
     }
     
-    stopMotor();
-    Serial1.println("# Pitch stabilized at near -10 degrees.");
+    if (!moveToPitch(0, ZERO_TOLERANCE, "Zeroing", CONTROL_PID, FAST_ZERO_BUDGET_MS) && !abortRequested) {
+        debugOut.print(F("# Zeroing incomplete, starting the test at "));
+        printCentideg(debugOut, readPitch());
+        debugOut.println(F(" degrees"));
+    }
 }
 
-//Read CAN data
-CANData readCANData() {
-    static CANData lastValidData = {"No Data", "No Data", "No Data", false};
-    long unsigned int rxId;
-    unsigned char len = 0;
-    unsigned char rxBuf[8];
+//Return to zero pitch at the end of the test
+void returnToZeroPitch() {
+    moveToPitch(0, ZERO_TOLERANCE, "ReturnToZero");
+    if (abortRequested) {
+        debugOut.println(F("# Return to zero aborted"));
+        return;
+    }
     
-    if (CAN.checkReceive() == CAN_MSGAVAIL) {
-        CAN.readMsgBuf(&rxId, &len, rxBuf);
-        lastCanMsgTime = millis();  //Update the time of last message
-      
-        if (len >= 6) {
-            //Values are 16-bit integers with MSB first
-            uint16_t level = (rxBuf[0] << 8) | rxBuf[1];
-            uint16_t internalTemp = (rxBuf[2] << 8) | rxBuf[3];
-            uint16_t externalTemp = (rxBuf[4] << 8) | rxBuf[5];
-            
-            //Set the values to the structure
-            lastValidData.fuelLevel = String(level);
-            lastValidData.internalTemp = String(internalTemp);
-            
-            //Check for external temp sensor status
-            if (externalTemp == 0xFFFF) {
-                lastValidData.externalTemp = "Disabled";
-                lastValidData.externalSensorValid = false;
-            } else if (externalTemp == 0x8001) {
-                lastValidData.externalTemp = "Open Circuit";
-                lastValidData.externalSensorValid = false;
-            } else if (externalTemp == 0x8002) {
-                lastValidData.externalTemp = "Short Circuit";
-                lastValidData.externalSensorValid = false;
-            } else {
-                lastValidData.externalTemp = String(externalTemp);
-                lastValidData.externalSensorValid = true;
-            }
+    //Log final data points
+    setPhase("Complete", "Zero");
+    runFor(100 * DATA_INTERVAL);  //Log 100 more data points at zero position
+    
+    debugOut.println(F("# Return to zero complete - pitch stabilized at zero degrees."));
+}
+
+//Make the named profile the one loop() runs next
+bool selectProfile(const char* name) {
+    for (byte i = 0; i < RIG.profileCount; i++) {
+        if (strcmp(RIG.profiles[i].name, name) == 0) {
+            activeProfile = &RIG.profiles[i];
+            return true;
         }
     }
+    return false;
+}
+
+//Build the adjusting phase label for a target, e.g. AdjustingToPos5, AdjustingToNeg2.5
+void formatAdjustLabel(char* text, int16_t target) {
+    long centi = labs(target);
     
-    return lastValidData;
+    if (centi == 0) {
+        strcpy(text, "AdjustingToZero");
+    } else if (centi % 100 == 0) {
+        snprintf(text, MAX_LABEL_LENGTH + 1, "AdjustingTo%s%ld", target < 0 ? "Neg" : "Pos", centi / 100);
+    } else if (centi % 10 == 0) {
+        snprintf(text, MAX_LABEL_LENGTH + 1, "AdjustingTo%s%ld.%ld", target < 0 ? "Neg" : "Pos", centi / 100, (centi % 100) / 10);
+    } else {
+        snprintf(text, MAX_LABEL_LENGTH + 1, "AdjustingTo%s%ld.%02ld", target < 0 ? "Neg" : "Pos", centi / 100, centi % 100);
+    }
 }
 
-//Stream data in CSV format to Serial Monitor (in this use case, see serial_capture.py)
-void streamCSVData(const char* phase, const char* direction) {
-    float pitch = readPitch();
-    CANData canData = readCANData();
-    unsigned long elapsedTime = millis() - startTime;
+//Print warning if no CAN messages received for 60 seconds
+void checkCANTimeout() {
+    if (millis() - lastCanMsgTime > 60000) {
+        debugOut.println(F("# WARNING: No CAN messages received in the last 60 seconds."));
+        lastCanMsgTime = millis();  //Reset to avoid repeated warnings
+    }
+}
+
+//Program the masks and filters. Standard IDs sit in the upper 16 bits in MCP_STDEXT mode,
+//the lower 16 bits would match the first two data bytes and are left unmasked.
+void configureCANFilters() {
+    if (!CAN_FILTER_IDS) {
+        CAN.init_Mask(0, 0, 0x00000000);  //Mask 0 - allow all IDs
+        CAN.init_Mask(1, 0, 0x00000000);  //Mask 1 - allow all IDs
+        for (byte i = 0; i < 6; i++) {
+            CAN.init_Filt(i, 0, 0x00000000);  //Filter i - allow all IDs
+        }
+        return;
+    }
     
-    //Only proceed if pitch is in valid range (-25 to +25 degrees)
-    if (pitch != -999.0 && pitch >= -25.0 && pitch <= 25.0) {
-        //Formatted for CSV
-        Serial.print(elapsedTime);
-        Serial.print(",");
-        Serial.print(canData.fuelLevel);
-        Serial.print(",");
-        Serial.print(canData.internalTemp);
-        Serial.print(",");
-        Serial.print(canData.externalTemp);
-        Serial.print(",");
-        Serial.print(pitch, 2);
-        Serial.print(",");
-        Serial.print(phase);
-        Serial.print(",");
-        Serial.println(direction);
-        
-        if (Serial1) {
-            //Every 100 data points (approx. 1 second), print a debug status
-            if (elapsedTime % 1000 < 10) {
-                Serial1.print("# Status at ");
-                Serial1.print(elapsedTime);
-                Serial1.print("ms: Phase=");
-                Serial1.print(phase);
-                Serial1.print(", Direction=");
-                Serial1.print(direction);
-                Serial1.print(", Pitch=");
-                Serial1.print(pitch);
-                Serial1.print(", Fuel=");
-                Serial1.print(canData.fuelLevel);
-                Serial1.print(", Temp=");
-                Serial1.println(canData.internalTemp);
-            }
+    byte ext = RIG.canExtended ? 1 : 0;
+    unsigned long mask = RIG.canExtended ? 0x1FFFFFFF : 0x07FF0000;
+    CAN.init_Mask(0, ext, mask);  //Mask 0 - RXB0, filters 0 and 1
+    CAN.init_Mask(1, ext, mask);  //Mask 1 - RXB1, filters 2 to 5
+    
+    //Unused filters repeat the last ID so no filter is left open
+    for (byte i = 0; i < 6; i++) {
+        unsigned long id = RIG.canIds[(i < RIG.canIdCount) ? i : RIG.canIdCount - 1];
+        CAN.init_Filt(i, ext, RIG.canExtended ? id : id << 16);
+    }
+    
+    debugOut.print(F("# CAN filters accept "));
+    debugOut.print(RIG.canIdCount);
+    debugOut.println(F(" LS200 ID(s)"));
+}
+
+const char* canSpeedName(byte speed) {
+    switch (speed) {
+        case CAN_1000KBPS:
+            return "1Mbps";
+        case CAN_500KBPS:
+            return "500kbps";
+        case CAN_250KBPS:
+            return "250kbps";
+        case CAN_125KBPS:
+            return "125kbps";
+        default:
+            return "other bit rate";
+    }
+}
+
+//Start the MCP2515 at the rig's bit rate, then its fallbacks in turn, keeping the first that
+//receives a frame. begin() succeeds at any bit rate, so only a frame proves one. With FAST_START a
+//rate saved by saveCANSpeed() goes first, is erased if it hears nothing, and there is no pause
+//between attempts. If no rate hears a frame (LS200 powered off), the rig's bit rate is used.
+byte beginCAN() {
+    byte speeds[2 + RIG.canFallbackCount];
+    byte count = 0;
+    byte status = CAN_FAILINIT;
+    bool savedFirst = false;
+    
+    if (FAST_START && EEPROM.read(EEPROM_CAN_SPEED_ADDR) == EEPROM_CAN_SPEED_MAGIC) {
+        byte saved = EEPROM.read(EEPROM_CAN_SPEED_ADDR + 1);
+        if (isRigCANSpeed(saved)) {
+            speeds[count++] = saved;
+            savedFirst = true;
+        }
+    }
+    if (count == 0 || speeds[0] != RIG.canSpeed) {
+        speeds[count++] = RIG.canSpeed;
+    }
+    for (byte i = 0; i < RIG.canFallbackCount; i++) {
+        if (RIG.canFallbacks[i] != speeds[0]) {
+            speeds[count++] = RIG.canFallbacks[i];
         }
     }
+    
+    for (byte i = 0; i < count; i++) {
+        if (i > 0 && !FAST_START) {
+            delay(100);
+        }
+        status = CAN.begin(CAN_RX_MODE, speeds[i], MCP_8MHZ);
+        if (status != CAN_OK) {
+            debugOut.print(F("# CAN module initialization failed at "));
+            debugOut.print(canSpeedName(speeds[i]));
+            debugOut.print(F(". Error code: "));
+            debugOut.println(status);
+            continue;
+        }
+        if (probeCANSpeed()) {
+            canSpeed = speeds[i];
+            canSpeedSaved = !FAST_START;
+            debugOut.print(F("# CAN module initialized successfully at "));
+            debugOut.println(canSpeedName(canSpeed));
+            return status;
+        }
+        debugOut.print(F("# No CAN frames at "));
+        debugOut.println(canSpeedName(speeds[i]));
+        if (i == 0 && savedFirst) {
+            EEPROM.update(EEPROM_CAN_SPEED_ADDR, 0xFF);  //Stale, probe from the rig's rate next boot
+            debugOut.println(F("# Saved CAN bit rate cleared"));
+        }
+    }
+    
+    //Nothing on the bus yet, wait for the LS200 at the rig's own rate
+    status = CAN.begin(CAN_RX_MODE, RIG.canSpeed, MCP_8MHZ);
+    if (status != CAN_OK) {
+        debugOut.println(F("# CAN module initialization failed with all settings"));
+        canSpeedSaved = true;  //Nothing worth keeping
+        return status;
+    }
+    canSpeed = RIG.canSpeed;
+    canSpeedSaved = !FAST_START;
+    debugOut.print(F("# No CAN frames at any bit rate, listening at "));
+    debugOut.println(canSpeedName(canSpeed));
+    return status;
+}
+
+//Listen without acknowledging, so a wrong bit rate can't disturb the bus, until a frame arrives.
+//The frame only proves the rate and is discarded; setup() then switches to normal mode.
+bool probeCANSpeed() {
+    CAN.setMode(MCP_LISTENONLY);
+    unsigned long start = millis();
+    while (millis() - start < CAN_PROBE_MS) {
+        if (CAN.checkReceive() == CAN_MSGAVAIL) {
+            unsigned long id;
+            byte len;
+            byte data[8];
+            CAN.readMsgBuf(&id, &len, data);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool isRigCANSpeed(byte speed) {
+    if (speed == RIG.canSpeed) {
+        return true;
+    }
+    for (byte i = 0; i < RIG.canFallbackCount; i++) {
+        if (RIG.canFallbacks[i] == speed) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//Keep canSpeed for the next start once LS200 frames have arrived at it. EEPROM.update() only
+//writes bytes that change, so the cell isn't worn by every boot.
+void saveCANSpeed() {
+    if (!readCANData().hasData) {
+        return;
+    }
+    EEPROM.update(EEPROM_CAN_SPEED_ADDR, EEPROM_CAN_SPEED_MAGIC);
+    EEPROM.update(EEPROM_CAN_SPEED_ADDR + 1, canSpeed);
+    canSpeedSaved = true;
+}
+
+//Software check behind the hardware filters, also covers CAN_FILTER_IDS = false
+bool isLS200Frame(unsigned long id) {
+    bool extended = (id & 0x80000000) != 0;
+    if (extended != RIG.canExtended) {
+        return false;
+    }
+    
+    id &= ~CAN_ID_FLAGS;
+    for (byte i = 0; i < RIG.canIdCount; i++) {
+        if (RIG.canIds[i] == id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//MCP2515 INT handler, moves received frames into the ring
+void canISR() {
+    drainCANController();
+}
+
+//Read every frame waiting in the MCP2515 RX buffers into the ring
+void drainCANController() {
+    static CANFrame discarded;
+    
+    while (CAN.checkReceive() == CAN_MSGAVAIL) {
+        byte head = canRing.head;
+        byte next = (head + 1) & (CAN_RING_SIZE - 1);
+        bool full = (next == canRing.tail);
+        
+        //A full ring still needs the frame read out, otherwise INT stays asserted
+        CANFrame& frame = full ? discarded : canRing.frames[head];
+        frame.timeUs = micros();
+        CAN.readMsgBuf(&frame.id, &frame.len, frame.data);
+        
+        if (full) {
+            canRing.overflows++;
+        } else {
+            __asm__ __volatile__("" ::: "memory");  //Frame contents must be stored before publishing it
+            canRing.head = next;
+        }
+    }
+}
+
+//Read CAN data, consuming every frame received since the last call
+const CANData& readCANData() {
+    static CANData lastValidData = {0, 0, 0, EXT_TEMP_DISABLED, false, 0, 0, false};
+    unsigned long startUs = ENABLE_INSTRUMENTATION ? micros() : 0;
+    
+    if (!CAN_USE_INTERRUPT) {
+        drainCANController();
+    }
+    
+    while (canRing.tail != canRing.head) {
+        const CANFrame& frame = canRing.frames[canRing.tail];
+        
+        if (!isLS200Frame(frame.id)) {
+            canRing.rejected++;
+        } else if (frame.len >= 6) {
+            lastCanMsgTime = millis();  //Update the time of last message
+            bench.canFrames++;
+            
+            //Values are 16-bit integers with MSB first
+            lastValidData.fuelLevel = (frame.data[0] << 8) | frame.data[1];
+            lastValidData.internalTemp = (frame.data[2] << 8) | frame.data[3];
+            lastValidData.externalTemp = (frame.data[4] << 8) | frame.data[5];
+            lastValidData.timeUs = frame.timeUs;
+            lastValidData.hasData = true;
+            setExternalStatus(lastValidData);
+            fuelReadingReceived(lastValidData, FUEL_SOURCE_CAN);
+        }
+        
+        //Release the slot only after it has been read
+        __asm__ __volatile__("" ::: "memory");
+        canRing.tail = (canRing.tail + 1) & (CAN_RING_SIZE - 1);
+    }
+    
+    recordTiming(TIMING_READ_CAN, startUs);
+    return lastValidData;
+}
+
+//Check for external temp sensor status
+void setExternalStatus(CANData& data) {
+    if (data.externalTemp == 0xFFFF) {
+        data.externalStatus = EXT_TEMP_DISABLED;
+    } else if (data.externalTemp == 0x8001) {
+        data.externalStatus = EXT_TEMP_OPEN_CIRCUIT;
+    } else if (data.externalTemp == 0x8002) {
+        data.externalStatus = EXT_TEMP_SHORT_CIRCUIT;
+    } else {
+        data.externalStatus = EXT_TEMP_OK;
+    }
+}
+
+//A new LS200 reading arrived on path. Only the path behind the fuel columns feeds the fuel
+//settle window and bursts, with FUEL_SOURCE_NEWEST every reading is the latest when it arrives.
+void fuelReadingReceived(const CANData& data, FuelSource path) {
+    static unsigned long lastFuelSettleMs = 0;
+    
+    if (RIG.fuelSource != FUEL_SOURCE_NEWEST && RIG.fuelSource != path) {
+        return;
+    }
+    
+    if (millis() - lastFuelSettleMs >= FUEL_SETTLE_INTERVAL_MS) {
+        lastFuelSettleMs = millis();
+        addSettleSample(fuelSettle, data.fuelLevel, lastFuelSettleMs);
+    }
+    
+    if (burst.capturing) {
+        burst.fuelLevel = data.fuelLevel;
+        burst.canValid = true;
+        captureBurstSample(BURST_FLAG_CAN, data.timeUs / 1000);
+    }
+}
+
+//Feed all buffered LS200 serial bytes through the line parser without blocking
+void pollLS200Serial() {
+    if (!RIG.hasFuelSerial) {
+        return;
+    }
+    
+    while (RIG.fuelSerial->available() > 0) {
+        char c = RIG.fuelSerial->read();
+        
+        if (c != '\n' && c != '\r') {
+            if (ls200Serial.length == 0 && !ls200Serial.overflow) {
+                ls200Serial.lineStartUs = micros();
+            }
+            if (ls200Serial.length < LS200_LINE_SIZE - 1) {
+                ls200Serial.line[ls200Serial.length++] = c;
+            } else {
+                ls200Serial.overflow = true;
+            }
+            continue;
+        }
+        
+        //End of line, CR LF gives an empty line that is skipped
+        if (ls200Serial.overflow) {
+            ls200Serial.errors++;
+        } else if (ls200Serial.length > 0) {
+            ls200Serial.line[ls200Serial.length] = '\0';
+            if (parseLS200Line(ls200Serial.line, ls200Serial.data)) {
+                ls200Serial.data.timeUs = ls200Serial.lineStartUs;
+                ls200Serial.data.hasData = true;
+                ls200Serial.lines++;
+                fuelReadingReceived(ls200Serial.data, FUEL_SOURCE_SERIAL);
+            } else {
+                ls200Serial.errors++;
+            }
+        }
+        ls200Serial.length = 0;
+        ls200Serial.overflow = false;
+    }
+}
+
+//Three comma separated decimal values, each up to 65535. data is only changed if the whole line is valid.
+bool parseLS200Line(const char* line, CANData& data) {
+    uint16_t values[3];
+    
+    for (byte i = 0; i < 3; i++) {
+        unsigned long value = 0;
+        const char* start = line;
+        while (*line >= '0' && *line <= '9') {
+            value = value * 10 + (*line++ - '0');
+            if (value > 0xFFFF) {
+                return false;
+            }
+        }
+        if (line == start || *line != (i < 2 ? ',' : '\0')) {
+            return false;
+        }
+        values[i] = value;
+        line++;
+    }
+    
+    data.fuelLevel = values[0];
+    data.internalTemp = values[1];
+    data.externalTemp = values[2];
+    setExternalStatus(data);
+    return true;
+}
+
+//The reading behind the fuel columns of a row, see FuelSource
+const CANData& selectFuelReading(const CANData& canData, const CANData& serialData) {
+    if (RIG.fuelSource == FUEL_SOURCE_CAN || (RIG.fuelSource == FUEL_SOURCE_NEWEST && !serialData.hasData)) {
+        return canData;
+    }
+    if (RIG.fuelSource == FUEL_SOURCE_SERIAL || !canData.hasData) {
+        return serialData;
+    }
+    return ((long)(serialData.timeUs - canData.timeUs) > 0) ? serialData : canData;
+}
+
+//Print a raw CAN value, or "No Data" if nothing has been received yet
+void printCANValue(Print& out, const CANData& canData, uint16_t value) {
+    if (canData.hasData) {
+        out.print(value);
+    } else {
+        out.print(F("No Data"));
+    }
+}
+
+//Print the external temperature or the sensor status in its place
+void printExternalTemp(Print& out, const CANData& canData) {
+    if (!canData.hasData) {
+        out.print(F("No Data"));
+        return;
+    }
+    
+    switch (canData.externalStatus) {
+        case EXT_TEMP_DISABLED:
+            out.print(F("Disabled"));
+            break;
+        case EXT_TEMP_OPEN_CIRCUIT:
+            out.print(F("Open Circuit"));
+            break;
+        case EXT_TEMP_SHORT_CIRCUIT:
+            out.print(F("Short Circuit"));
+            break;
+        default:
+            out.print(canData.externalTemp);
+            break;
+    }
+}
+
+//Stream data in CSV format to Serial Monitor (in this use case, see serial_capture.py)
+//Both sources are stamped when they arrive, so each row says how old its pitch and CAN values
+//are and postprocess.py --align can put them back on a common time base. The fuel columns come
+//from RIG.fuelSource, the last two always hold the LS200 serial reading to cross-check them.
+void streamCSVData(const char* phase, const char* direction) {
+    static unsigned long lastAnglePackets = 0;
+    static unsigned long lastCanUs = 0;
+    
+    pollWT901();
+    pollLS200Serial();
+    CANData canData = selectFuelReading(readCANData(), ls200Serial.data);
+    unsigned long nowUs = micros();
+    unsigned long elapsedTime = millis() - startTime;
+    
+    PitchSample pitch;
+    pitch.pitchCenti = wt901.pitchCenti;
+    pitch.valid = wt901.angle.valid;
+    pitch.ageMs = (nowUs - wt901.angle.timeUs) / 1000;
+    pitch.fresh = (wt901.anglePackets != lastAnglePackets);
+    lastAnglePackets = wt901.anglePackets;
+    
+    //Without sample-and-hold, only rows with a new, in range (-25 to +25 degrees) pitch are sent
+    if (!SAMPLE_AND_HOLD && (!pitch.fresh || !pitchInRange(pitch.pitchCenti))) {
+        return;
+    }
+    
+    canData.ageMs = (nowUs - canData.timeUs) / 1000;
+    canData.fresh = canData.hasData && canData.timeUs != lastCanUs;
+    lastCanUs = canData.timeUs;
+    ls200Serial.data.ageMs = (nowUs - ls200Serial.data.timeUs) / 1000;
+    
+    if (SD_LOGGING) {
+        logSample(elapsedTime, pitch, canData, phase, direction);
+    }
+    
+    if (PHASE_SUMMARIES) {
+        summarizeRow(phase, elapsedTime, pitch, canData);
+    }
+    
+    if (!streamRawRow()) {
+        return;
+    }
+    
+    if (outputFormat == OUTPUT_BINARY) {
+        bool queued = streamBinaryData(elapsedTime, pitch, canData, phase, direction);
+        if (bench.active) {
+            benchRow(pitch, queued);
+        }
+        return;
+    }
+    
+    //Formatted for CSV, queued as one record so a row is never sent half
+    dataOut.beginRecord();
+    dataOut.print(elapsedTime);
+    dataOut.print(F(","));
+    printCANValue(dataOut, canData, canData.fuelLevel);
+    dataOut.print(F(","));
+    printCANValue(dataOut, canData, canData.internalTemp);
+    dataOut.print(F(","));
+    printExternalTemp(dataOut, canData);
+    dataOut.print(F(","));
+    if (pitch.valid) {
+        printCentideg(dataOut, pitch.pitchCenti);
+    } else {
+        dataOut.print(F("No Data"));
+    }
+    dataOut.print(F(","));
+    dataOut.print(phase);
+    dataOut.print(F(","));
+    dataOut.print(direction);
+    dataOut.print(F(","));
+    if (pitch.valid) {
+        dataOut.print(pitch.ageMs);
+    } else {
+        dataOut.print(F("No Data"));
+    }
+    dataOut.print(F(","));
+    dataOut.print(pitch.fresh ? 1 : 0);
+    dataOut.print(F(","));
+    if (canData.hasData) {
+        dataOut.print(canData.ageMs);
+    } else {
+        dataOut.print(F("No Data"));
+    }
+    dataOut.print(F(","));
+    dataOut.print(canData.fresh ? 1 : 0);
+    dataOut.print(F(","));
+    printCANValue(dataOut, ls200Serial.data, ls200Serial.data.fuelLevel);
+    dataOut.print(F(","));
+    if (ls200Serial.data.hasData) {
+        dataOut.println(ls200Serial.data.ageMs);
+    } else {
+        dataOut.println(F("No Data"));
+    }
+    bool queued = dataOut.endRecord();
+    if (bench.active) {
+        benchRow(pitch, queued);
+    }
+}
+
+//CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF), matches binascii.crc_hqx on the host
+uint16_t crc16Update(uint16_t crc, byte data) {
+    crc ^= (uint16_t)data << 8;
+    for (byte i = 0; i < 8; i++) {
+        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+//Queue one framed record for Serial, false if the output queue had no room for it
+bool writeFrame(byte type, const byte* payload, byte length) {
+    byte frame[4 + MAX_FRAME_PAYLOAD + 2];
+    uint16_t crc = 0xFFFF;
+    
+    if (length > MAX_FRAME_PAYLOAD) {
+        return false;
+    }
+    
+    frame[0] = FRAME_SYNC1;
+    frame[1] = FRAME_SYNC2;
+    frame[2] = type;
+    frame[3] = length;
+    memcpy(&frame[4], payload, length);
+    
+    for (int i = 2; i < 4 + length; i++) {
+        crc = crc16Update(crc, frame[i]);
+    }
+    frame[4 + length] = crc & 0xFF;
+    frame[5 + length] = crc >> 8;
+    
+    dataOut.beginRecord();
+    dataOut.write(frame, 6 + length);
+    return dataOut.endRecord();
+}
+
+//Return the id of a label, sending a label record through send() first if the text changed
+byte labelId(LabelSlot& slot, const char* text, bool (*send)(byte, const byte*, byte)) {
+    if (slot.text[0] != '\0' && strncmp(slot.text, text, MAX_LABEL_LENGTH) == 0) {
+        return slot.id;
+    }
+    
+    strncpy(slot.text, text, MAX_LABEL_LENGTH);
+    slot.text[MAX_LABEL_LENGTH] = '\0';
+    slot.id = nextLabelId++;
+    
+    byte payload[1 + MAX_LABEL_LENGTH];
+    byte length = strlen(slot.text);
+    payload[0] = slot.id;
+    memcpy(&payload[1], slot.text, length);
+    if (!send(FRAME_TYPE_LABEL, payload, 1 + length)) {
+        slot.text[0] = '\0';  //Dropped, send it again with the next record
+    }
+    
+    return slot.id;
+}
+
+//Forget the labels already sent so they are sent again before the next record
+void resetLabels() {
+    phaseLabel.text[0] = '\0';
+    directionLabel.text[0] = '\0';
+    summaryLabel.text[0] = '\0';
+}
+
+//Stream one sample as a binary record
+bool streamBinaryData(unsigned long elapsedTime, const PitchSample& pitch, const CANData& canData, const char* phase, const char* direction) {
+    //Resend labels periodically so a decoder attached mid-test can resolve them
+    if ((recordSequence & 0xFF) == 0) {
+        resetLabels();
+    }
+    
+    SampleRecord record;
+    fillSampleRecord(record, elapsedTime, pitch, canData);
+    record.sequence = recordSequence++;
+    record.phaseId = labelId(phaseLabel, phase, writeFrame);
+    record.directionId = labelId(directionLabel, direction, writeFrame);
+    
+    return writeFrame(FRAME_TYPE_SAMPLE, (const byte*)&record, sizeof(record));
+}
+
+//Sample fields shared by the binary stream and the SD log, everything but the sequence and labels
+void fillSampleRecord(SampleRecord& record, unsigned long elapsedTime, const PitchSample& pitch, const CANData& canData) {
+    record.timeMs = elapsedTime;
+    record.fuelLevel = canData.fuelLevel;
+    record.internalTemp = canData.internalTemp;
+    record.externalTemp = canData.externalTemp;
+    record.pitchCenti = pitch.pitchCenti;
+    record.pitchAgeMs = saturate16(pitch.ageMs);
+    record.canAgeMs = saturate16(canData.ageMs);
+    record.serialFuelLevel = ls200Serial.data.fuelLevel;
+    record.serialAgeMs = saturate16(ls200Serial.data.ageMs);
+    record.flags = 0;
+    if (canData.hasData) {
+        record.flags |= SAMPLE_FLAG_CAN_DATA;
+    }
+    if (canData.externalStatus == EXT_TEMP_OK) {
+        record.flags |= SAMPLE_FLAG_EXT_TEMP_VALID;
+    }
+    if (pitch.valid) {
+        record.flags |= SAMPLE_FLAG_PITCH_VALID;
+    }
+    if (pitch.fresh) {
+        record.flags |= SAMPLE_FLAG_PITCH_FRESH;
+    }
+    if (canData.fresh) {
+        record.flags |= SAMPLE_FLAG_CAN_FRESH;
+    }
+    if (ls200Serial.data.hasData) {
+        record.flags |= SAMPLE_FLAG_SERIAL_DATA;
+    }
+}
+
+//Initialize the card once, the MCP2515 must already be deselected
+void beginLog() {
+    if (!SD_LOGGING || logger.ready) {
+        return;
+    }
+    
+    logger.active = false;
+    logger.ready = SD.begin(RIG.sdCs);
+    if (logger.ready) {
+        debugOut.println(F("# SD card ready for logging"));
+    } else {
+        debugOut.println(F("# SD card initialization failed, logging disabled"));
+    }
+}
+
+//Open the next free FTnnn.BIN and write the header sector for the active profile
+void startLog() {
+    char name[13];
+    
+    if (!SD_LOGGING || !logger.ready) {
+        return;
+    }
+    
+    for (int i = 0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "FT%03d.BIN", i);
+        if (!SD.exists(name)) {
+            break;
+        }
+    }
+    
+    //Not FILE_WRITE, which appends every write and would keep stopLog() from updating the header
+    logger.file = SD.open(name, O_READ | O_WRITE | O_CREAT);
+    if (!logger.file) {
+        debugOut.print(F("# Could not create "));
+        debugOut.println(name);
+        return;
+    }
+    
+    //Header first, built in the sector buffer and completed with the sector and index counts by stopLog()
+    LogHeader* header = (LogHeader*)logger.sector;
+    memset(logger.sector, 0, sizeof(logger.sector));
+    header->magic = LOG_MAGIC;
+    header->version = LOG_VERSION;
+    header->sectorSize = LOG_SECTOR_SIZE;
+    header->recordSize = LOG_RECORD_SIZE;
+    header->sampleIntervalUs = tasks[TASK_SAMPLE].periodUs;
+    strncpy(header->profileName, activeProfile->name, sizeof(header->profileName) - 1);
+    header->stepCount = (activeProfile->stepCount < LOG_MAX_STEPS) ? activeProfile->stepCount : LOG_MAX_STEPS;
+    memcpy_P(header->steps, activeProfile->steps, header->stepCount * sizeof(PitchStep));
+    
+    if (logger.file.write(logger.sector, LOG_SECTOR_SIZE) != LOG_SECTOR_SIZE) {
+        debugOut.println(F("# SD write failed, logging stopped"));
+        logger.file.close();
+        return;
+    }
+    
+    logger.slot = 0;
+    logger.sectorCount = 0;
+    logger.sequence = 0;
+    logger.indexCount = 0;
+    logger.phaseLabel.text[0] = '\0';
+    logger.directionLabel.text[0] = '\0';
+    logger.active = true;
+    
+    debugOut.print(F("# Logging to "));
+    debugOut.println(name);
+}
+
+//Append one sample, starting a new indexed sector when the phase changes
+void logSample(unsigned long elapsedTime, const PitchSample& pitch, const CANData& canData, const char* phase, const char* direction) {
+    if (!SD_LOGGING || !logger.active) {
+        return;
+    }
+    
+    if (logger.phaseLabel.text[0] == '\0' || strncmp(logger.phaseLabel.text, phase, MAX_LABEL_LENGTH) != 0) {
+        startIndexedSector(elapsedTime);
+    }
+    
+    SampleRecord record;
+    fillSampleRecord(record, elapsedTime, pitch, canData);
+    record.sequence = logger.sequence++;
+    record.phaseId = labelId(logger.phaseLabel, phase, logRecord);
+    record.directionId = labelId(logger.directionLabel, direction, logRecord);
+    
+    logRecord(FRAME_TYPE_SAMPLE, (const byte*)&record, sizeof(record));
+}
+
+//Put one record in the next slot, writing the sector out once it is full
+bool logRecord(byte type, const byte* payload, byte length) {
+    if (!SD_LOGGING || !logger.active || length > LOG_RECORD_SIZE - sizeof(LogRecordHeader)) {
+        return false;
+    }
+    
+    if (logger.slot == 0) {
+        memset(logger.sector, 0, sizeof(logger.sector));
+        LogSectorHeader header;
+        header.magic = LOG_SECTOR_MAGIC;
+        header.sector = logger.sectorCount + 1;
+        header.firstTimeMs = millis() - startTime;
+        header.recordCount = 0;
+        memcpy(logger.sector, &header, sizeof(header));
+        logger.slot = 1;
+    }
+    
+    byte* slot = &logger.sector[logger.slot * LOG_RECORD_SIZE];
+    LogRecordHeader record;
+    record.type = type;
+    record.length = length;
+    memcpy(slot, &record, sizeof(record));
+    memcpy(slot + sizeof(record), payload, length);
+    logger.slot++;
+    
+    if (logger.slot > LOG_RECORDS_PER_SECTOR) {
+        return writeLogSector();
+    }
+    return true;
+}
+
+//Close the current sector and index the next one as the start of a phase
+void startIndexedSector(unsigned long elapsedTime) {
+    if (!SD_LOGGING || (logger.slot > 0 && !writeLogSector())) {
+        return;
+    }
+    
+    if (logger.indexCount < LOG_INDEX_SLOTS) {
+        logger.index[logger.indexCount].sector = logger.sectorCount + 1;
+        logger.index[logger.indexCount].timeMs = elapsedTime;
+        logger.indexCount++;
+    }
+    
+    //Labels are logged again at the start of the sector, so it can be read on its own
+    logger.phaseLabel.text[0] = '\0';
+    logger.directionLabel.text[0] = '\0';
+}
+
+//Write the current sector, partially filled or not. Stops logging if the card fails.
+bool writeLogSector() {
+    if (!SD_LOGGING) {
+        return false;
+    }
+    LogSectorHeader* header = (LogSectorHeader*)logger.sector;
+    header->recordCount = logger.slot - 1;
+    logger.slot = 0;
+    
+    if (logger.file.write(logger.sector, LOG_SECTOR_SIZE) != LOG_SECTOR_SIZE) {
+        debugOut.println(F("# SD write failed, logging stopped"));
+        logger.file.close();
+        logger.active = false;
+        return false;
+    }
+    
+    logger.sectorCount++;
+    if (logger.sectorCount % LOG_SYNC_SECTORS == 0) {
+        logger.file.flush();
+    }
+    return true;
+}
+
+//Write the last sector and the index, complete the header and close the file
+void stopLog() {
+    if (!SD_LOGGING || !logger.active) {
+        return;
+    }
+    
+    if (logger.slot > 0 && !writeLogSector()) {
+        return;
+    }
+    
+    //Index entries packed into whole sectors after the data
+    uint32_t indexSector = 1 + logger.sectorCount;
+    uint16_t entriesPerSector = LOG_SECTOR_SIZE / sizeof(LogIndexEntry);
+    for (byte i = 0; i < logger.indexCount; i += entriesPerSector) {
+        byte count = (logger.indexCount - i < entriesPerSector) ? logger.indexCount - i : entriesPerSector;
+        memset(logger.sector, 0, sizeof(logger.sector));
+        memcpy(logger.sector, &logger.index[i], count * sizeof(LogIndexEntry));
+        logger.file.write(logger.sector, LOG_SECTOR_SIZE);
+    }
+    
+    //Only the counts change in the header
+    LogHeader* header = (LogHeader*)logger.sector;
+    logger.file.seek(0);
+    logger.file.read(logger.sector, sizeof(LogHeader));
+    header->dataSectors = logger.sectorCount;
+    header->indexSector = (logger.indexCount > 0) ? indexSector : 0;
+    header->indexCount = logger.indexCount;
+    logger.file.seek(0);
+    logger.file.write(logger.sector, sizeof(LogHeader));
+    logger.file.close();
+    logger.active = false;
+    
+    debugOut.print(F("# Log closed, "));
+    debugOut.print(logger.sectorCount);
+    debugOut.println(F(" data sectors"));
+}
+
+//Collect command bytes from Serial without blocking, dispatching each complete line
+void commandTask() {
+    while (Serial.available() > 0) {
+        char c = Serial.read();
+        
+        if (c != '\n' && c != '\r') {
+            if (commandLength < COMMAND_LINE_SIZE - 1) {
+                commandLine[commandLength++] = c;
+            } else {
+                commandOverflow = true;
+            }
+            continue;
+        }
+        
+        //End of line, CR LF gives an empty second line which is ignored
+        commandLine[commandLength] = '\0';
+        if (commandOverflow) {
+            debugOut.println(F("# Command too long, ignored"));
+        } else if (commandLength > 0) {
+            handleCommand(commandLine);
+        }
+        commandLength = 0;
+        commandOverflow = false;
+    }
+}
+
+void handleCommand(char* line) {
+    char* command = strtok(line, " \t");
+    char* arg1 = strtok(NULL, " \t");
+    char* arg2 = strtok(NULL, " \t");
+    
+    if (command == NULL) {
+        return;
+    }
+    
+    if (strcmp(command, "run") == 0) {
+        runCommand(arg1, arg2);
+    } else if (strcmp(command, "abort") == 0) {
+        if (runRequested) {
+            debugOut.println(F("# Run cancelled"));
+            runRequested = false;
+        } else if (benchSeconds > 0) {
+            debugOut.println(F("# Bench cancelled"));
+            benchSeconds = 0;
+        } else if (testComplete) {
+            debugOut.println(F("# No test running"));
+        } else {
+            debugOut.println(F("# Aborting test"));
+            abortRequested = true;
+        }
+    } else if (strcmp(command, "status") == 0) {
+        printStatus();
+    } else if (strcmp(command, "set") == 0) {
+        setCommand(arg1, arg2);
+    } else if (strcmp(command, "bench") == 0) {
+        benchCommand(arg1);
+    } else if (strcmp(command, "reset") == 0) {
+        abortRequested = true;  //End any running test first, loop() then calls setup()
+        resetRequested = true;
+    } else {
+        debugOut.print(F("# Unknown command: "));
+        debugOut.println(command);
+        debugOut.println(F("# Commands: run [profile] [cycles], abort, status, set rate <Hz>, set format csv|binary, set baud <rate>, set raw full|off|<N>, bench [seconds], reset"));
+    }
+}
+
+//run [profile] [cycles], queued for loop() once the current test is over
+void runCommand(char* profileName, char* cycles) {
+    if (!testComplete || runRequested || benchSeconds > 0) {
+        debugOut.println(F("# Test already running, send 'abort' first"));
+        return;
+    }
+    
+    const TestProfile* previous = activeProfile;
+    if (profileName != NULL && !selectProfile(profileName)) {
+        debugOut.print(F("# Unknown profile: "));
+        debugOut.print(profileName);
+        debugOut.print(F(". Profiles:"));
+        for (byte i = 0; i < RIG.profileCount; i++) {
+            debugOut.print(F(" "));
+            debugOut.print(RIG.profiles[i].name);
+        }
+        debugOut.println();
+        return;
+    }
+    
+    long count = (cycles != NULL) ? atol(cycles) : 1;
+    if (count < 1 || count > (long)MAX_CYCLES) {
+        debugOut.print(F("# Cycles must be 1 to "));
+        debugOut.println(MAX_CYCLES);
+        activeProfile = previous;
+        return;
+    }
+    
+    runCycles = count;
+    runRequested = true;
+    debugOut.print(F("# Starting "));
+    debugOut.print(runCycles);
+    debugOut.print(F(" cycle(s) of profile "));
+    debugOut.println(activeProfile->name);
+}
+
+//set rate <Hz>, set format csv|binary, set baud <rate>, set raw full|off|<N>
+void setCommand(char* setting, char* value) {
+    if (setting == NULL || value == NULL) {
+        debugOut.println(F("# Usage: set rate <Hz> | set format csv|binary | set baud <rate> | set raw full|off|<N>"));
+        return;
+    }
+    
+    if (strcmp(setting, "rate") == 0) {
+        long hz = atol(value);
+        if (hz < 1 || hz > (long)MAX_SAMPLE_RATE_HZ) {
+            debugOut.print(F("# Rate must be 1 to "));
+            debugOut.print(MAX_SAMPLE_RATE_HZ);
+            debugOut.println(F(" Hz"));
+            return;
+        }
+        setSampleInterval(1000000UL / hz);
+        debugOut.print(F("# Sample rate set to "));
+        debugOut.print(hz);
+        debugOut.println(F(" Hz"));
+        return;
+    }
+    
+    if (strcmp(setting, "format") == 0) {
+        //The stream can't change format in the middle of a test
+        if (!testComplete || runRequested || benchSeconds > 0) {
+            debugOut.println(F("# Format can only be changed while idle"));
+            return;
+        }
+        if (strcmp(value, "csv") == 0) {
+            outputFormat = OUTPUT_CSV;
+        } else if (strcmp(value, "binary") == 0) {
+            outputFormat = OUTPUT_BINARY;
+        } else {
+            debugOut.println(F("# Format must be csv or binary"));
+            return;
+        }
+        headersWritten = false;  //Header or notice for the new format before the next run
+        resetLabels();
+        debugOut.print(F("# Output format set to "));
+        debugOut.println(value);
+        return;
+    }
+    
+    if (strcmp(setting, "baud") == 0) {
+        if (!testComplete || runRequested || benchSeconds > 0) {
+            debugOut.println(F("# Baud can only be changed while idle"));
+            return;
+        }
+        long baud = atol(value);
+        if (baud < (long)MIN_DATA_BAUD || baud > (long)MAX_DATA_BAUD) {
+            debugOut.print(F("# Baud must be "));
+            debugOut.print(MIN_DATA_BAUD);
+            debugOut.print(F(" to "));
+            debugOut.println(MAX_DATA_BAUD);
+            return;
+        }
+        //Everything queued goes out at the old rate first
+        dataOut.flush();
+        Serial.flush();
+        Serial.begin(baud);
+        dataBaud = baud;
+        debugOut.print(F("# Data baud set to "));
+        debugOut.println(baud);
+        return;
+    }
+    
+    if (strcmp(setting, "raw") == 0) {
+        if (strcmp(value, "full") == 0) {
+            rawMode = RAW_FULL;
+        } else if (strcmp(value, "off") == 0) {
+            rawMode = RAW_OFF;
+        } else {
+            long every = atol(value);
+            if (every < 2 || every > (long)MAX_RAW_DECIMATION) {
+                debugOut.print(F("# Raw must be full, off or 2 to "));
+                debugOut.println(MAX_RAW_DECIMATION);
+                return;
+            }
+            rawMode = RAW_DECIMATED;
+            rawDecimation = every;
+        }
+        debugOut.print(F("# Raw rows set to "));
+        printRawMode(debugOut);
+        debugOut.println();
+        return;
+    }
+    
+    debugOut.print(F("# Unknown setting: "));
+    debugOut.println(setting);
+}
+
+//bench [seconds], queued for loop() like run
+void benchCommand(char* seconds) {
+    if (!testComplete || runRequested || benchSeconds > 0) {
+        debugOut.println(F("# Test already running, send 'abort' first"));
+        return;
+    }
+    
+    long count = (seconds != NULL) ? atol(seconds) : DEFAULT_BENCH_SECONDS;
+    if (count < 1 || count > (long)MAX_BENCH_SECONDS) {
+        debugOut.print(F("# Bench seconds must be 1 to "));
+        debugOut.println(MAX_BENCH_SECONDS);
+        return;
+    }
+    
+    benchSeconds = count;
+    debugOut.print(F("# Starting "));
+    debugOut.print(benchSeconds);
+    debugOut.println(F("s benchmark"));
+}
+
+//One line of state for the operator
+void printStatus() {
+    debugOut.print(F("# Status: "));
+    if (bench.active) {
+        debugOut.print(F("benchmark"));
+    } else if (testComplete) {
+        debugOut.print(F("idle"));
+    } else {
+        debugOut.print(F("running cycle "));
+        debugOut.print(currentCycle);
+        debugOut.print(F("/"));
+        debugOut.print(runCycles);
+        debugOut.print(F(" step "));
+        debugOut.print(currentStep);
+        debugOut.print(F("/"));
+        debugOut.print(activeProfile->stepCount);
+    }
+    debugOut.print(F(", profile "));
+    debugOut.print(activeProfile->name);
+    debugOut.print(F(", phase "));
+    debugOut.print(currentPhase != NULL ? currentPhase : "None");
+    debugOut.print(F(", pitch "));
+    printCentideg(debugOut, readPitch());
+    debugOut.print(F(", rate "));
+    debugOut.print(1000000UL / tasks[TASK_SAMPLE].periodUs);
+    debugOut.print(F("Hz, format "));
+    debugOut.print(outputFormat == OUTPUT_CSV ? F("csv") : F("binary"));
+    debugOut.print(F(", baud "));
+    debugOut.print(dataBaud);
+    debugOut.print(F(", raw "));
+    printRawMode(debugOut);
+    debugOut.print(F(", dropped data="));
+    debugOut.print(dataOut.droppedRecords);
+    debugOut.print(F(" debug="));
+    debugOut.print(debugOut.droppedRecords);
+    if (RIG.hasFuelSerial) {
+        debugOut.print(F(", LS200 serial lines="));
+        debugOut.print(ls200Serial.lines);
+        debugOut.print(F(" errors="));
+        debugOut.print(ls200Serial.errors);
+    }
+    debugOut.println();
+}
+
+//Print the instrumentation stats about every STATS_PERIOD_US while streaming
+void statsTask() {
+    if (!ENABLE_INSTRUMENTATION || currentPhase == NULL) {
+        return;
+    }
+    printStats("Stats");
+}
+
+//Start collecting from zero, at the start of each test
+void resetStats() {
+    if (!ENABLE_INSTRUMENTATION) {
+        return;
+    }
+    
+    memset(&stats, 0, sizeof(stats));
+    for (byte i = 0; i < TIMING_COUNT; i++) {
+        stats.timings[i].minUs = 0xFFFFFFFF;
+    }
+    tasks[TASK_SAMPLE].missed = 0;
+    noInterrupts();  //Written by canISR
+    stats.canRingOverflowsAtStart = canRing.overflows;
+    interrupts();
+    paintStack();
+}
+
+//Add one call that started at startUs
+void recordTiming(TimingId id, unsigned long startUs) {
+    if (!ENABLE_INSTRUMENTATION) {
+        return;
+    }
+    
+    unsigned long us = micros() - startUs;
+    TimingStat& timing = stats.timings[id];
+    timing.count++;
+    timing.totalUs += us;
+    if (us < timing.minUs) {
+        timing.minUs = us;
+    }
+    if (us > timing.maxUs) {
+        timing.maxUs = us;
+    }
+}
+
+//Add one sample tick that ran lateUs after its deadline
+void recordLateness(unsigned long lateUs) {
+    if (bench.active && lateUs > bench.maxLatenessUs) {
+        bench.maxLatenessUs = lateUs;
+    }
+    if (!ENABLE_INSTRUMENTATION) {
+        return;
+    }
+    
+    byte bin = 0;
+    while (bin < LATENESS_BIN_COUNT - 1 && lateUs >= LATENESS_BIN_US[bin]) {
+        bin++;
+    }
+    stats.lateness[bin]++;
+    if (lateUs > stats.maxLatenessUs) {
+        stats.maxLatenessUs = lateUs;
+    }
+}
+
+//Count and clear MCP2515 RX overflows, frames the controller lost before they could be read
+void checkCANOverflow() {
+    byte flags = CAN.getError() & (MCP_EFLG_RX0OVR | MCP_EFLG_RX1OVR);
+    if (flags == 0) {
+        return;
+    }
+    
+    byte events = ((flags & MCP_EFLG_RX0OVR) ? 1 : 0) + ((flags & MCP_EFLG_RX1OVR) ? 1 : 0);
+    stats.canControllerOverflows += events;
+    bench.canControllerOverflows += events;
+    
+    //Overflow flags are only cleared by the MCU
+    SPI.beginTransaction(SPISettings(MCP2515_SPI_CLOCK, MSBFIRST, SPI_MODE0));
+    digitalWrite(RIG.canCs, LOW);
+    SPI.transfer(MCP2515_BIT_MODIFY);
+    SPI.transfer(MCP2515_REG_EFLG);
+    SPI.transfer(flags);  //Mask
+    SPI.transfer(0x00);
+    digitalWrite(RIG.canCs, HIGH);
+    SPI.endTransaction();
+}
+
+//Print the stats collected since the start of the test on Serial1
+void printStats(const char* title) {
+    debugOut.print(F("# "));
+    debugOut.print(title);
+    debugOut.print(F(" timing us min/mean/max:"));
+    for (byte i = 0; i < TIMING_COUNT; i++) {
+        const TimingStat& timing = stats.timings[i];
+        debugOut.print(F(" "));
+        debugOut.print(TIMING_NAMES[i]);
+        debugOut.print(F("="));
+        if (timing.count == 0) {
+            debugOut.print(F("-"));
+            continue;
+        }
+        debugOut.print(timing.minUs);
+        debugOut.print(F("/"));
+        debugOut.print(timing.totalUs / timing.count);
+        debugOut.print(F("/"));
+        debugOut.print(timing.maxUs);
+    }
+    debugOut.println();
+    
+    debugOut.print(F("# "));
+    debugOut.print(title);
+    debugOut.print(F(" sample tick lateness us:"));
+    for (byte i = 0; i < LATENESS_BIN_COUNT; i++) {
+        if (i < LATENESS_BIN_COUNT - 1) {
+            debugOut.print(F(" <"));
+            debugOut.print(LATENESS_BIN_US[i]);
+        } else {
+            debugOut.print(F(" >="));
+            debugOut.print(LATENESS_BIN_US[i - 1]);
+        }
+        debugOut.print(F(":"));
+        debugOut.print(stats.lateness[i]);
+    }
+    debugOut.print(F(" max="));
+    debugOut.print(stats.maxLatenessUs);
+    debugOut.print(F(" missed="));
+    debugOut.println(tasks[TASK_SAMPLE].missed);
+    
+    debugOut.print(F("# "));
+    debugOut.print(title);
+    noInterrupts();
+    unsigned long ringOverflows = canRing.overflows - stats.canRingOverflowsAtStart;
+    interrupts();
+    debugOut.print(F(" CAN frames dropped: ring="));
+    debugOut.print(ringOverflows);
+    debugOut.print(F(" controller="));
+    debugOut.print(stats.canControllerOverflows);
+    debugOut.print(F(", SRAM free="));
+    debugOut.print(freeSram());
+    debugOut.print(F(" low="));
+    debugOut.println(sramLowWatermark());
+}
+
+//Top of the heap, or its start while nothing has been allocated
+char* heapEnd() {
+    return __brkval ? __brkval : &__heap_start;
+}
+
+//SRAM between the heap and the stack right now
+unsigned int freeSram() {
+    char top;
+    return &top - heapEnd();
+}
+
+//Fill the free SRAM below this frame, so later growth of the stack (ISRs included) can be seen
+void paintStack() {
+    char top;
+    char* end = (char*)((uintptr_t)&top - STACK_PAINT_MARGIN);  //As an address, &top is no array
+    for (char* p = heapEnd(); p < end; p++) {
+        *p = STACK_PAINT;
+    }
+}
+
+//Smallest free SRAM since paintStack(): painted bytes the stack never reached
+unsigned int sramLowWatermark() {
+    char top;
+    char* p = heapEnd();
+    while (p < &top && (byte)*p == STACK_PAINT) {
+        p++;
+    }
+    return p - heapEnd();
+}
+
+//Motor started: begin capturing, continuing the buffered burst if it hasn't been sent yet
+void startBurst() {
+    if (!BURST_CAPTURE || !headersWritten || testComplete) {
+        return;  //Only while a test is running, not when zeroing at startup
+    }
+    
+    if (!burst.capturing) {
+        //Once a burst has started going out, what is still unsent carries into a new burst
+        if (burst.headerSent) {
+            burst.head = (burst.head + burst.sent) % BURST_RING_SIZE;
+            burst.count -= burst.sent;
+            burst.sent = 0;
+        }
+        if (burst.headerSent || burst.count == 0) {
+            burst.id++;
+            burst.overflows = 0;
+            burst.headerSent = false;
+        }
+        if (burst.count == 0) {
+            burst.head = 0;
+            burst.baseMs = millis() - startTime;
+        }
+    }
+    
+    const CANData& canData = readCANData();
+    burst.fuelLevel = canData.fuelLevel;
+    burst.canValid = canData.hasData;
+    burst.pitchCenti = wt901.pitchCenti;
+    burst.capturing = true;
+}
+
+//Motor stopped: keep capturing the transient for BURST_WINDOW_MS
+void endBurstMotion() {
+    burst.windowEndMs = millis() + BURST_WINDOW_MS;
+}
+
+//Add a sample for a new reading from source, stamped with its receive time (millis)
+void captureBurstSample(byte source, unsigned long timeMs) {
+    if (!isMoving && (long)(millis() - burst.windowEndMs) >= 0) {
+        burst.capturing = false;
+        return;
+    }
+    
+    if (source == BURST_FLAG_PITCH) {
+        burst.pitchCenti = wt901.pitchCenti;
+    }
+    
+    unsigned long offsetMs = timeMs - startTime - burst.baseMs;
+    if ((long)offsetMs < 0) {
+        offsetMs = 0;  //Received just before the motor started
+    }
+    if (offsetMs > 0xFFFF) {
+        rebaseBurst(offsetMs);
+        offsetMs = timeMs - startTime - burst.baseMs;
+    }
+    
+    //Full: overwrite the oldest sample, nothing has been sent while capturing
+    if (burst.count == BURST_RING_SIZE) {
+        burst.head = (burst.head + 1) % BURST_RING_SIZE;
+        burst.count--;
+        burst.overflows++;
+    }
+    
+    BurstSample& sample = burst.samples[(burst.head + burst.count++) % BURST_RING_SIZE];
+    sample.offsetMs = offsetMs;
+    sample.pitchCenti = burst.pitchCenti;
+    sample.fuelLevel = burst.fuelLevel;
+    sample.flags = source;
+    if (burst.canValid) {
+        sample.flags |= BURST_FLAG_CAN_VALID;
+    }
+}
+
+//Move baseMs up to the oldest sample so offsetMs fits the 16-bit offsets again. Samples more than
+//0xFFFF ms older than offsetMs are dropped as lost.
+void rebaseBurst(unsigned long offsetMs) {
+    while (burst.count > 0 && offsetMs - burst.samples[burst.head].offsetMs > 0xFFFF) {
+        burst.head = (burst.head + 1) % BURST_RING_SIZE;
+        burst.count--;
+        burst.overflows++;
+    }
+    unsigned int shift = (burst.count > 0) ? burst.samples[burst.head].offsetMs : 0;
+    for (uint16_t i = 0; i < burst.count; i++) {
+        burst.samples[(burst.head + i) % BURST_RING_SIZE].offsetMs -= shift;
+    }
+    burst.baseMs += (burst.count > 0) ? shift : offsetMs;
+}
+
+//"# Burst:" line or header frame, so a burst that lost its start can't pass for a whole one
+bool sendBurstHeader() {
+    BurstHeaderRecord header;
+    header.burstId = burst.id;
+    header.startMs = burst.baseMs + burst.samples[burst.head].offsetMs;
+    header.samples = burst.count;
+    header.lost = burst.overflows;
+    
+    bool sent;
+    if (outputFormat == OUTPUT_BINARY) {
+        sent = writeFrame(FRAME_TYPE_BURST_HEADER, (const byte*)&header, sizeof(header));
+    } else {
+        dataOut.beginRecord();
+        dataOut.print(F("# Burst: id="));
+        dataOut.print(header.burstId);
+        dataOut.print(F(" start_ms="));
+        dataOut.print(header.startMs);
+        dataOut.print(F(" samples="));
+        dataOut.print(header.samples);
+        dataOut.print(F(" lost="));
+        dataOut.println(header.lost);
+        sent = dataOut.endRecord();
+    }
+    if (sent && SD_LOGGING) {
+        logRecord(FRAME_TYPE_BURST_HEADER, (const byte*)&header, sizeof(header));
+    }
+    return sent;
+}
+
+//Stationary periods and the idle state send the buffer, motion phases hold it back
+void allowBurstSend(bool allowed) {
+    burst.sendAllowed = allowed;
+}
+
+//Send one buffered sample, if the data queue has room so it isn't dropped
+void burstTask() {
+    if (!BURST_CAPTURE || !burst.sendAllowed || burst.sent == burst.count) {
+        return;
+    }
+    
+    //Capture ends with the first reading after the window, check here too in case none arrives
+    if (burst.capturing) {
+        if (isMoving || (long)(millis() - burst.windowEndMs) < 0) {
+            return;
+        }
+        burst.capturing = false;
+    }
+    
+    if (dataOut.availableForWrite() < BURST_FLUSH_MIN_ROOM) {
+        return;
+    }
+    
+    if (!burst.headerSent) {
+        burst.headerSent = sendBurstHeader();
+        return;
+    }
+    
+    const BurstSample& sample = burst.samples[(burst.head + burst.sent) % BURST_RING_SIZE];
+    BurstRecord record;
+    record.burstId = burst.id;
+    record.timeMs = burst.baseMs + sample.offsetMs;
+    record.pitchCenti = sample.pitchCenti;
+    record.fuelLevel = sample.fuelLevel;
+    record.flags = sample.flags;
+    
+    bool sent;
+    if (outputFormat == OUTPUT_BINARY) {
+        sent = writeFrame(FRAME_TYPE_BURST, (const byte*)&record, sizeof(record));
+    } else {
+        //B,BurstId,TimeMS,Source,Pitch,FuelLevel - capture_serial.py moves these to a separate file
+        dataOut.beginRecord();
+        dataOut.print(F("B,"));
+        dataOut.print(record.burstId);
+        dataOut.print(F(","));
+        dataOut.print(record.timeMs);
+        dataOut.print(F(","));
+        dataOut.print((record.flags & BURST_FLAG_PITCH) ? F("Pitch") : F("CAN"));
+        dataOut.print(F(","));
+        printCentideg(dataOut, record.pitchCenti);
+        dataOut.print(F(","));
+        if (record.flags & BURST_FLAG_CAN_VALID) {
+            dataOut.println(record.fuelLevel);
+        } else {
+            dataOut.println(F("No Data"));
+        }
+        sent = dataOut.endRecord();
+    }
+    
+    if (sent) {
+        burst.sent++;
+        if (SD_LOGGING) {
+            logRecord(FRAME_TYPE_BURST, (const byte*)&record, sizeof(record));
+        }
+    }
+}
+
+//Whether this row goes out on Serial. Bench runs always stream every row.
+bool streamRawRow() {
+    static unsigned long rows = 0;
+    
+    if (rawMode == RAW_FULL || bench.active) {
+        return true;
+    }
+    if (rawMode == RAW_OFF) {
+        return false;
+    }
+    return (rows++ % rawDecimation) == 0;
+}
+
+void printRawMode(Print& out) {
+    if (rawMode == RAW_FULL) {
+        out.print(F("full"));
+    } else if (rawMode == RAW_OFF) {
+        out.print(F("off"));
+    } else {
+        out.print(F("1 in "));
+        out.print(rawDecimation);
+    }
+}
+
+//Add one row to the phase summary, a new phase label ends the previous phase
+void summarizeRow(const char* phase, unsigned long elapsedTime, const PitchSample& pitch, const CANData& canData) {
+    if (strncmp(phaseStats.phase, phase, MAX_LABEL_LENGTH) != 0) {
+        finishPhase();
+        strncpy(phaseStats.phase, phase, MAX_LABEL_LENGTH);
+        phaseStats.phase[MAX_LABEL_LENGTH] = '\0';
+        phaseStats.startMs = elapsedTime;
+        phaseStats.rows = 0;
+        phaseStats.settleMs = SETTLE_NOT_SEEN;
+        memset(phaseStats.values, 0, sizeof(phaseStats.values));
+    }
+    
+    phaseStats.lastMs = elapsedTime;
+    phaseStats.rows++;
+    if (canData.hasData) {
+        addStatsValue(phaseStats.values[SUMMARY_FUEL_LEVEL], canData.fuelLevel);
+        addStatsValue(phaseStats.values[SUMMARY_INTERNAL_TEMP], canData.internalTemp);
+        if (canData.externalStatus == EXT_TEMP_OK) {
+            addStatsValue(phaseStats.values[SUMMARY_EXTERNAL_TEMP], canData.externalTemp);
+        }
+    }
+    if (pitch.valid) {
+        addStatsValue(phaseStats.values[SUMMARY_PITCH], pitch.pitchCenti);
+    }
+}
+
+//Values are 16 bit, so an offset from the first value is at most 65535 either way and its square
+//fits an unsigned long
+void addStatsValue(RunningStats& stats, long value) {
+    if (stats.count == 0) {
+        stats.offset = value;
+        stats.min = value;
+        stats.max = value;
+    }
+    
+    long delta = value - stats.offset;
+    unsigned long magnitude = labs(delta);
+    stats.count++;
+    stats.sum += delta;
+    stats.sumSquares += magnitude * magnitude;
+    if (value < stats.min) {
+        stats.min = value;
+    }
+    if (value > stats.max) {
+        stats.max = value;
+    }
+}
+
+//Queue the summary of the phase being reduced, if one is open
+void finishPhase() {
+    if (!PHASE_SUMMARIES || phaseStats.phase[0] == '\0') {
+        return;
+    }
+    
+    //The queue didn't have room for all of the previous summary yet, send the rest now
+    while (phaseReport.pending) {
+        sendNextPhaseLine(true);
+    }
+    
+    strcpy(phaseReport.phase, phaseStats.phase);
+    phaseReport.summary.startMs = phaseStats.startMs;
+    phaseReport.summary.durationMs = phaseStats.lastMs - phaseStats.startMs;
+    phaseReport.summary.rows = phaseStats.rows;
+    phaseReport.summary.settleMs = phaseStats.settleMs;
+    for (byte i = 0; i < SUMMARY_VALUE_COUNT; i++) {
+        phaseReport.values[i].value = i;
+        fillPhaseValue(phaseReport.values[i], phaseStats.values[i]);
+    }
+    phaseReport.nextLine = 0;
+    phaseReport.pending = true;
+    phaseStats.phase[0] = '\0';
+}
+
+//Mean and standard deviation in hundredths. Done once per phase, so float is fine for the square root.
+void fillPhaseValue(PhaseValueRecord& record, const RunningStats& stats) {
+    record.count = stats.count;
+    record.min = stats.min;
+    record.max = stats.max;
+    if (stats.count == 0) {
+        record.mean = 0;
+        record.stdDev = 0;
+        return;
+    }
+    
+    //Rounded half away from zero
+    int64_t sum = stats.sum * 100;
+    int64_t half = stats.count / 2;
+    record.mean = stats.offset * 100 + (sum >= 0 ? sum + half : sum - half) / (int64_t)stats.count;
+    
+    //Sum of squared deviations, count * sumSquares - sum * sum over count, exact in integers: with
+    //sum = q * count + r it is sumSquares - sum * q - sum * r / count, without the product that
+    //would overflow over a long phase. Only the last fraction and the divide are float.
+    int64_t count = stats.count;
+    int64_t q = stats.sum / count;
+    int64_t tail = stats.sum * (stats.sum % count);
+    int64_t deviations = (int64_t)stats.sumSquares - stats.sum * q - tail / count;
+    float variance = ((float)deviations - (float)(tail % count) / count) / count;
+    record.stdDev = (variance > 0) ? (uint32_t)(sqrt(variance) * 100 + 0.5) : 0;
+}
+
+//Send a line of the last phase's summary, if the data queue has room so it isn't dropped
+void summaryTask() {
+    if (!PHASE_SUMMARIES || !phaseReport.pending || dataOut.availableForWrite() < SUMMARY_MIN_ROOM) {
+        return;
+    }
+    sendNextPhaseLine(false);
+}
+
+//Send the next line of the pending summary, skipping values no row held. A line the queue
+//drops is tried again, unless force.
+void sendNextPhaseLine(bool force) {
+    if (!sendPhaseLine(phaseReport.nextLine) && !force) {
+        return;
+    }
+    
+    phaseReport.nextLine++;
+    while (phaseReport.nextLine <= SUMMARY_VALUE_COUNT && phaseReport.values[phaseReport.nextLine - 1].count == 0) {
+        phaseReport.nextLine++;
+    }
+    phaseReport.pending = (phaseReport.nextLine <= SUMMARY_VALUE_COUNT);
+}
+
+//Line 0 is the summary, then one line per SummaryValue. The decoder prints binary records as the same lines.
+bool sendPhaseLine(byte line) {
+    if (outputFormat == OUTPUT_BINARY) {
+        byte id = labelId(summaryLabel, phaseReport.phase, writeFrame);
+        if (line == 0) {
+            phaseReport.summary.phaseId = id;
+            return writeFrame(FRAME_TYPE_PHASE, (const byte*)&phaseReport.summary, sizeof(phaseReport.summary));
+        }
+        phaseReport.values[line - 1].phaseId = id;
+        return writeFrame(FRAME_TYPE_PHASE_VALUE, (const byte*)&phaseReport.values[line - 1], sizeof(PhaseValueRecord));
+    }
+    
+    dataOut.beginRecord();
+    if (line == 0) {
+        const PhaseSummaryRecord& summary = phaseReport.summary;
+        dataOut.print(F("# Phase summary: phase="));
+        dataOut.print(phaseReport.phase);
+        dataOut.print(F(" start_ms="));
+        dataOut.print(summary.startMs);
+        dataOut.print(F(" ms="));
+        dataOut.print(summary.durationMs);
+        dataOut.print(F(" rows="));
+        dataOut.print(summary.rows);
+        dataOut.print(F(" settle_ms="));
+        if (summary.settleMs == SETTLE_NOT_SEEN) {
+            dataOut.println('-');
+        } else {
+            dataOut.println(summary.settleMs);
+        }
+    } else {
+        const PhaseValueRecord& record = phaseReport.values[line - 1];
+        byte decimals = (record.value == SUMMARY_PITCH) ? 2 : 0;  //As the CSV column
+        dataOut.print(F("# Phase value: phase="));
+        dataOut.print(phaseReport.phase);
+        dataOut.print(F(" value="));
+        dataOut.print(SUMMARY_VALUE_NAMES[record.value]);
+        dataOut.print(F(" n="));
+        dataOut.print(record.count);
+        dataOut.print(F(" mean="));
+        printFixed(dataOut, record.mean, decimals + 2);
+        dataOut.print(F(" min="));
+        printFixed(dataOut, record.min, decimals);
+        dataOut.print(F(" max="));
+        printFixed(dataOut, record.max, decimals);
+        dataOut.print(F(" sd="));
+        printFixed(dataOut, record.stdDev, decimals + 2);
+        dataOut.println();
+    }
+    return dataOut.endRecord();
+}
+
+//Print value with decimals digits after the point, value counting in units of the last digit
+void printFixed(Print& out, long value, byte decimals) {
+    unsigned long magnitude = (value < 0) ? -(unsigned long)value : value;
+    unsigned long scale = 1;
+    for (byte i = 0; i < decimals; i++) {
+        scale *= 10;
+    }
+    
+    if (value < 0) {
+        out.print('-');
+    }
+    out.print(magnitude / scale);
+    if (decimals == 0) {
+        return;
+    }
+    out.print('.');
+    unsigned long fraction = magnitude % scale;
+    for (unsigned long digit = scale / 10; digit > 1 && fraction < digit; digit /= 10) {
+        out.print('0');
+    }
+    out.print(fraction);
+}
+
+TxQueue::TxQueue(HardwareSerial& port, byte* buffer, uint16_t size)
+    : droppedRecords(0), sentBytes(0), port(port), buffer(buffer), size(size),
+      head(0), tail(0), recordStart(0), inRecord(false), discarding(false) {
+}
+
+size_t TxQueue::write(uint8_t b) {
+    bool lineEnd = !inRecord && b == '\n';
+    
+    if (!discarding) {
+        uint16_t next = (head + 1) % size;
+        if (next == tail) {
+            drain();  //Make room if the UART can take some now
+        }
+        if (next == tail) {
+            //Full: take back what was queued of this record and drop the rest
+            head = recordStart;
+            discarding = true;
+        } else {
+            buffer[head] = b;
+            head = next;
+        }
+    }
+    
+    if (lineEnd) {
+        endOfRecord();
+    }
+    return 1;
+}
+
+size_t TxQueue::write(const uint8_t* data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        write(data[i]);
+    }
+    return length;
+}
+
+void TxQueue::beginRecord() {
+    recordStart = head;
+    inRecord = true;
+}
+
+bool TxQueue::endRecord() {
+    bool kept = !discarding;
+    inRecord = false;
+    endOfRecord();
+    return kept;
+}
+
+void TxQueue::endOfRecord() {
+    if (discarding) {
+        discarding = false;
+        droppedRecords++;
+    }
+    recordStart = head;
+}
+
+void TxQueue::drain() {
+    int room = port.availableForWrite();
+    while (room > 0 && tail != head) {
+        port.write(buffer[tail]);
+        tail = (tail + 1) % size;
+        sentBytes++;
+        room--;
+    }
+}
+
+int TxQueue::availableForWrite() {
+    return (tail + size - head - 1) % size;
+}
+
+void TxQueue::flush() {
+    while (tail != head) {
+        drain();
+    }
 }
@@ -0,0 +1,257 @@
+"""
+Capture several fuel tables at once from one process.
+
+Each rig is given as NAME=PORT, with ",binary" for a rig streaming OUTPUT_BINARY records:
+
+python aggregate.py rig1=COM10 rig2=COM11 rig3=COM12,binary
+python aggregate.py rig1=/dev/ttyACM0 rig2=/dev/ttyACM1 --merged
+
+Every port gets a SerialReader thread from capture_serial.py, all feeding one queue. A single
+writer then decodes, tags and writes the lines, so the process doesn't scale with threads
+doing disk and console work. By default each rig gets its own <prefix>_<rig>.csv in the same
+format capture_serial.py writes. With --merged, all rigs go to one <prefix>.csv with a leading
+Rig column. Burst lines always go to a per-rig _burst.csv file. A combined status table is
+printed every STATUS_INTERVAL_S, and with --status it is also written as JSON for a dashboard.
+"""
+import argparse
+import json
+import queue
+import time
+from datetime import datetime
+
+import serial
+
+from capture_serial import SerialReader, split_lines
+from telemetry import BURST_PREFIX, CSV_HEADER, BinaryDecoder, BurstWriter
+
+BAUD = 115200
+FLUSH_INTERVAL_MS = 500  # Write buffered lines to disk this often
+STATUS_INTERVAL_S = 5  # Print the combined status this often
+ECHO_COMMENTS = True  # Print every rig's '#' lines, prefixed with the rig name
+PREFIX = f"rigs_{datetime.now().strftime('%Y%m%d_%H%M%S')}"
+MERGED_HEADER = "Rig," + CSV_HEADER
+
+
+class RigQueue:
+    """Tags what a SerialReader queues with its rig, so every rig shares one queue."""
+
+    def __init__(self, rig, shared):
+        self.rig = rig
+        self.shared = shared
+
+    def put(self, data):
+        self.shared.put((self.rig, data))
+
+
+class Rig:
+    """One table: its port, decoder, output files and the counters behind the status table."""
+
+    def __init__(self, name, port, binary, chunks):
+        self.name = name
+        self.port = port
+        self.binary = binary
+        self.ser = serial.Serial(port, BAUD, timeout=1)
+        self.reader = SerialReader(self.ser, RigQueue(self, chunks))
+        self.decoder = BinaryDecoder()
+        self.pending = bytearray()
+        self.file = None
+        self.bursts = None
+        self.open = True
+
+        self.lines = 0
+        self.last_lines = 0
+        self.last_bytes = 0
+        self.time_ms = None
+        self.phase = ""
+        self.pitch = ""
+        self.dropped = 0
+
+    def decode(self, data):
+        return self.decoder.feed(data) if self.binary else split_lines(self.pending, data)
+
+    def track(self, line):
+        """Keep the latest time, phase and pitch of a data line, or the drop count of a report."""
+        if line.startswith('# Dropped records: data='):
+            self.dropped = int(line.split('=')[1].split()[0])
+            return
+        fields = line.split(',')
+        if len(fields) > 5 and fields[0].isdigit():
+            self.time_ms = int(fields[0])
+            self.pitch = fields[4]
+            self.phase = fields[5]
+            self.lines += 1
+
+    def status(self, elapsed):
+        rate = (self.lines - self.last_lines) / elapsed
+        kbytes = (self.reader.bytes_read - self.last_bytes) / elapsed / 1000
+        self.last_lines = self.lines
+        self.last_bytes = self.reader.bytes_read
+        return {
+            'rig': self.name,
+            'port': self.port,
+            'open': self.open,
+            'rows_per_s': round(rate, 1),
+            'kb_per_s': round(kbytes, 2),
+            'rows': self.lines,
+            'time_s': None if self.time_ms is None else self.time_ms / 1000,
+            'phase': self.phase,
+            'pitch': self.pitch,
+            'dropped': self.dropped,
+            'lost': self.decoder.lost_records,
+            'crc_errors': self.decoder.crc_errors,
+            'error': None if self.reader.error is None else str(self.reader.error),
+        }
+
+
+def parse_rig(text):
+    name, _, port = text.partition('=')
+    port, _, options = port.partition(',')
+    if not name or not port or ',' in name:
+        raise argparse.ArgumentTypeError(f"expected NAME=PORT[,binary], got '{text}'")
+    if options not in ('', 'binary', 'csv'):
+        raise argparse.ArgumentTypeError(f"unknown option '{options}' for rig {name}")
+    return name, port, options == 'binary'
+
+
+def print_status(statuses):
+    print(f"[rigs] {datetime.now().strftime('%H:%M:%S')}")
+    for s in statuses:
+        state = "" if s['open'] else f"  CLOSED {s['error'] or ''}"
+        time_s = "-" if s['time_s'] is None else f"{s['time_s']:.1f}"
+        print(f"  {s['rig']:<8} {s['port']:<14} {s['rows_per_s']:>6} rows/s {s['kb_per_s']:>6} kB/s "
+              f"{s['rows']:>9} rows  t={time_s:>8} s  {s['phase']:<18} pitch {s['pitch']:>7}  "
+              f"dropped {s['dropped']} lost {s['lost']}{state}")
+
+
+def write_status(statuses, path):
+    with open(path, 'w') as file:
+        json.dump({'time': datetime.now().isoformat(timespec='seconds'), 'rigs': statuses}, file, indent=1)
+
+
+def open_outputs(rigs, prefix, merged):
+    """Per-rig files, or one merged file. Returns the merged file or None."""
+    merged_file = None
+    if merged:
+        merged_file = open(f"{prefix}.csv", 'w')
+        merged_file.write(MERGED_HEADER + '\n')
+    for rig in rigs:
+        filename = f"{prefix}_{rig.name}.csv"
+        rig.bursts = BurstWriter(filename)
+        if not merged:
+            rig.file = open(filename, 'w')
+            if rig.binary:
+                rig.file.write(CSV_HEADER + '\n')
+    return merged_file
+
+
+def write_line(rig, line, merged_file):
+    if line.startswith(BURST_PREFIX):
+        rig.bursts.write(line)
+        return
+    rig.track(line)
+
+    if line.startswith('#'):
+        if ECHO_COMMENTS:
+            print(f"[{rig.name}] {line}")
+        if merged_file is not None:
+            merged_file.write(f"# {rig.name}: {line[1:].strip()}\n")
+            return
+    elif merged_file is not None:
+        if not line.startswith('TimeMS'):  # The merged file has one header for every rig
+            merged_file.write(f"{rig.name},{line}\n")
+        return
+    rig.file.write(line + '\n')
+
+
+def aggregate(rigs, chunks, merged_file, status_path):
+    start = time.monotonic()
+    last_flush = last_status = start
+
+    for rig in rigs:
+        rig.reader.start()
+    while any(rig.open for rig in rigs):
+        try:
+            rig, data = chunks.get(timeout=FLUSH_INTERVAL_MS / 1000)
+        except queue.Empty:
+            rig, data = None, b''
+
+        if rig is not None and data is None:
+            rig.open = False  # Port closed or failed, the other rigs carry on
+            print(f"[{rig.name}] reader stopped: {rig.reader.error or 'port closed'}")
+        elif rig is not None:
+            for line in rig.decode(data):
+                write_line(rig, line, merged_file)
+
+        now = time.monotonic()
+        if now - last_flush >= FLUSH_INTERVAL_MS / 1000:
+            for r in rigs:
+                if r.file is not None:
+                    r.file.flush()
+                r.bursts.flush()
+            if merged_file is not None:
+                merged_file.flush()
+            last_flush = now
+        if now - last_status >= STATUS_INTERVAL_S:
+            statuses = [r.status(now - last_status) for r in rigs]
+            print_status(statuses)
+            if status_path:
+                write_status(statuses, status_path)
+            last_status = now
+
+    statuses = [r.status(max(time.monotonic() - last_status, 1e-3)) for r in rigs]
+    print_status(statuses)
+    if status_path:
+        write_status(statuses, status_path)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Capture several fuel tables at once")
+    parser.add_argument('rigs', nargs='+', type=parse_rig, metavar='NAME=PORT[,binary]')
+    parser.add_argument('--merged', action='store_true', help="One CSV with a Rig column instead of one per rig")
+    parser.add_argument('--prefix', default=PREFIX, help="Output file name prefix")
+    parser.add_argument('--status', metavar='FILE', help="Also write the combined status as JSON to FILE")
+    args = parser.parse_args()
+
+    names = [name for name, _, _ in args.rigs]
+    if len(set(names)) != len(names):
+        parser.error("rig names must be unique")
+
+    chunks = queue.Queue()
+    rigs = []
+    merged_file = None
+    try:
+        for name, port, binary in args.rigs:
+            rigs.append(Rig(name, port, binary, chunks))
+        time.sleep(2)  # Allow the connections to establish
+        merged_file = open_outputs(rigs, args.prefix, args.merged)
+
+        print(f"Capturing {len(rigs)} rigs to {args.prefix}{'.csv' if args.merged else '_<rig>.csv'}")
+        print("Press Ctrl+C to stop")
+        aggregate(rigs, chunks, merged_file, args.status)
+    except KeyboardInterrupt:
+        print("\nCapture stopped")
+    except serial.SerialException as e:
+        print(f"Serial port error: {e}")
+    finally:
+        # A later port failing to open or Ctrl+C during the sleep leaves readers that never started
+        started = [rig for rig in rigs if rig.reader.ident is not None]
+        for rig in started:
+            rig.reader.stop()
+        for rig in rigs:
+            if rig in started:
+                rig.reader.join(timeout=2)
+            rig.ser.close()
+            if rig.file is not None:
+                rig.file.close()
+            if rig.bursts is not None:
+                rig.bursts.close()
+            summary = f"[{rig.name}] {rig.reader.bytes_read} bytes, {rig.lines} rows"
+            if rig.binary:
+                summary += f", {rig.decoder.lost_records} lost, {rig.decoder.crc_errors} CRC errors"
+            print(summary)
+        if merged_file is not None:
+            merged_file.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,181 @@
+"""
+Benchmark the sampling pipeline over a grid of baud rates, output formats and sample rates.
+
+For each combination the sketch's bench command streams rows with the table held still and
+ends with a "# Bench:" line: rows built, rows dropped from the Serial queue, missed sample
+ticks, CAN frames read and lost, and the latency from an angle packet's first byte arriving
+on Serial2 to the last byte of its row going to the UART. This script also measures each run
+from the host side: rows received, the achieved rate and gaps in TimeMS. The results are
+printed as a table and saved to RESULTS_FILE.
+
+Close capture_serial.py first, the port can only be open once. Opening it resets the board,
+so the startup test is aborted before the sweep starts.
+
+python bench.py --port /dev/ttyACM0 --rates 100,200,500 --bauds 115200,250000 --seconds 10
+"""
+import argparse
+import csv
+import time
+
+import serial
+
+from capture_serial import split_lines
+from telemetry import BENCH_PREFIX, BinaryDecoder
+
+PORT = 'COM10'  # Change to your Arduino's port
+BOOT_BAUD = 115200  # DATA_BAUD in the sketch
+RATES = (50, 100, 200, 500)
+FORMATS = ('csv', 'binary')
+BAUDS = (115200,)
+BENCH_SECONDS = 10
+QUIET_S = 2.0  # The stream is idle once nothing has arrived for this long
+REPORT_TIMEOUT_S = 5  # Wait this long past the end of a run for its "# Bench:" line
+GAP_FACTOR = 1.5  # A row interval of this many sample periods or more is a gap
+RESULTS_FILE = 'bench_results.csv'
+
+RESULT_FIELDS = ['baud', 'format', 'rate', 'rows', 'host_rows', 'host_rate', 'gaps', 'max_gap_ms',
+                 'dropped', 'missed', 'late_max_us', 'can_frames', 'can_lost',
+                 'latency_min_us', 'latency_mean_us', 'latency_max_us', 'crc_errors']
+
+
+def send(ser, line):
+    ser.write((line + '\n').encode())
+    ser.flush()
+    time.sleep(0.1)  # Let the command be parsed before the next one
+
+
+def wait_quiet(ser):
+    """Discard input until the stream has been silent for QUIET_S."""
+    last_data = time.monotonic()
+    while time.monotonic() - last_data < QUIET_S:
+        if ser.read(ser.in_waiting or 1):
+            last_data = time.monotonic()
+
+
+def parse_bench_line(line):
+    """Fields of a "# Bench:" line as a dict, numbers as ints."""
+    fields = {}
+    for item in line[len(BENCH_PREFIX):].split():
+        name, _, value = item.partition('=')
+        fields[name] = int(value) if value.isdigit() else value
+    return fields
+
+
+def analyse_rows(lines, rate):
+    """Host-side view of a run: rows received, achieved rate and gaps in TimeMS."""
+    times = []
+    for line in lines:
+        fields = line.split(',')
+        if len(fields) > 5 and fields[0].isdigit() and fields[5] == 'Bench':
+            times.append(int(fields[0]))
+
+    period_ms = 1000 / rate
+    intervals = [b - a for a, b in zip(times, times[1:])]
+    span_s = (times[-1] - times[0]) / 1000 if len(times) > 1 else 0
+    return {
+        'host_rows': len(times),
+        'host_rate': round((len(times) - 1) / span_s, 1) if span_s else 0,
+        'gaps': sum(1 for interval in intervals if interval >= GAP_FACTOR * period_ms),
+        'max_gap_ms': max(intervals, default=0),
+    }
+
+
+def run_bench(ser, binary, seconds):
+    """Run one bench, returning the data lines and the report line (None if it never came)."""
+    decoder = BinaryDecoder()
+    pending = bytearray()
+    lines = []
+    ser.reset_input_buffer()
+    send(ser, f"bench {seconds}")
+
+    deadline = time.monotonic() + seconds + REPORT_TIMEOUT_S
+    while time.monotonic() < deadline:
+        data = ser.read(ser.in_waiting or 1)
+        for line in (decoder.feed(data) if binary else split_lines(pending, data)):
+            if line.startswith(BENCH_PREFIX):
+                return lines, line, decoder.crc_errors
+            lines.append(line)
+    return lines, None, decoder.crc_errors
+
+
+def bench_one(ser, baud, fmt, rate, seconds):
+    send(ser, f"set format {fmt}")
+    send(ser, f"set rate {rate}")
+    lines, report, crc_errors = run_bench(ser, fmt == 'binary', seconds)
+
+    result = {'baud': baud, 'format': fmt, 'rate': rate, 'crc_errors': crc_errors}
+    result.update(analyse_rows(lines, rate))
+    if report is None:
+        print(f"No bench report at {baud} baud, {fmt}, {rate} Hz")
+    else:
+        device = parse_bench_line(report)
+        result.update({name: device.get(name, '') for name in RESULT_FIELDS if name not in result})
+    return result
+
+
+def print_table(results):
+    header = (f"{'baud':>7} {'format':>6} {'rate':>4} | {'rows':>6} {'host':>6} {'rows/s':>7} | "
+              f"{'gaps':>5} {'gap ms':>6} | {'drop':>5} {'miss':>5} {'late us':>7} | "
+              f"{'CAN':>6} {'lost':>5} | {'lat min':>7} {'mean':>7} {'max ms':>7}")
+    print(header)
+    print('-' * len(header))
+    for r in results:
+        latency = [f"{r[name] / 1000:7.2f}" if r.get(name, '') != '' else f"{'-':>7}"
+                   for name in ('latency_min_us', 'latency_mean_us', 'latency_max_us')]
+        print(f"{r['baud']:>7} {r['format']:>6} {r['rate']:>4} | {r.get('rows', '-'):>6} {r['host_rows']:>6} "
+              f"{r['host_rate']:>7} | {r['gaps']:>5} {r['max_gap_ms']:>6} | {r.get('dropped', '-'):>5} "
+              f"{r.get('missed', '-'):>5} {r.get('late_max_us', '-'):>7} | {r.get('can_frames', '-'):>6} "
+              f"{r.get('can_lost', '-'):>5} | {' '.join(latency)}")
+
+
+def number_list(text):
+    return [int(value) for value in text.split(',')]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Sweep baud rate, output format and sample rate with the bench command")
+    parser.add_argument('--port', default=PORT)
+    parser.add_argument('--bauds', type=number_list, default=list(BAUDS), help="Comma separated, e.g. 115200,250000")
+    parser.add_argument('--formats', type=lambda text: text.split(','), default=list(FORMATS), help="csv, binary or csv,binary")
+    parser.add_argument('--rates', type=number_list, default=list(RATES), help="Sample rates in Hz, e.g. 100,200")
+    parser.add_argument('--seconds', type=int, default=BENCH_SECONDS, help="Length of each run")
+    parser.add_argument('--output', default=RESULTS_FILE)
+    args = parser.parse_args()
+
+    ser = serial.Serial(args.port, BOOT_BAUD, timeout=0.1)
+    baud = BOOT_BAUD
+    results = []
+    try:
+        time.sleep(2)  # Opening the port resets the board
+        send(ser, "abort")  # Cancel the startup test, the table returns to zero
+        print("Waiting for the board to go idle...")
+        wait_quiet(ser)
+
+        for new_baud in args.bauds:
+            if new_baud != baud:
+                send(ser, f"set baud {new_baud}")
+                ser.baudrate = baud = new_baud
+                wait_quiet(ser)
+            for fmt in args.formats:
+                for rate in args.rates:
+                    print(f"Bench at {baud} baud, {fmt}, {rate} Hz for {args.seconds} s")
+                    results.append(bench_one(ser, baud, fmt, rate, args.seconds))
+    except KeyboardInterrupt:
+        print("\nBenchmark stopped")
+    finally:
+        if baud != BOOT_BAUD:
+            send(ser, f"set baud {BOOT_BAUD}")  # Leave the board as capture_serial.py expects it
+        ser.close()
+
+    if results:
+        print()
+        print_table(results)
+        with open(args.output, 'w', newline='') as file:
+            writer = csv.DictWriter(file, fieldnames=RESULT_FIELDS)
+            writer.writeheader()
+            writer.writerows(results)
+        print(f"Results saved to {args.output}")
+
+
+if __name__ == "__main__":
+    main()
@@ -1,29 +1,211 @@
+import queue
 import serial
+import socket
+import threading
 import time
 from datetime import datetime
 
+from telemetry import BURST_PREFIX, CSV_HEADER, BinaryDecoder, BurstWriter, IndexedCaptureWriter
+
 # Configure these settings
 PORT = 'COM10'  # Change to your Arduino's port
 BAUD = 115200
-FILENAME = f"test_data_{datetime.now().strftime('%Y%m%d_%H%M%S')}.csv"
+BINARY_MODE = False  # Set True when the firmware streams OUTPUT_BINARY records
+INDEXED_MODE = False  # Write an indexed .ftc capture (see telemetry.py) instead of CSV
+FILENAME = f"test_data_{datetime.now().strftime('%Y%m%d_%H%M%S')}.{'ftc' if INDEXED_MODE else 'csv'}"
+
+FLUSH_INTERVAL_MS = 500  # Write buffered lines to disk this often
+ECHO = True  # Echo captured lines to the console
+ECHO_INTERVAL_S = 0.5  # Echo at most one data line this often, 0 echoes every line; '#' lines always echo
+STATS_INTERVAL_S = 10  # Report throughput and backlog this often, 0 disables
+LIVE_PORT = None  # Also send captured lines to plotter.py --udp on this port, e.g. 5005
+LIVE_DATAGRAM_SIZE = 8192  # Lines are batched into datagrams of up to this many bytes
+
+
+class SerialReader(threading.Thread):
+    """
+    Pulls raw bytes off the port as soon as they arrive and queues them, so a
+    slow disk or console never leaves data sitting in the OS serial buffer.
+    """
+
+    def __init__(self, ser, chunks):
+        super().__init__(daemon=True)
+        self.ser = ser
+        self.chunks = chunks
+        self.stop_event = threading.Event()
+        self.bytes_read = 0
+        self.error = None
+
+    def run(self):
+        try:
+            while not self.stop_event.is_set():
+                data = self.ser.read(self.ser.in_waiting or 1)
+                if data:
+                    self.bytes_read += len(data)
+                    self.chunks.put(data)
+        except serial.SerialException as e:
+            self.error = e
+        finally:
+            self.chunks.put(None)  # Tell the writer no more data is coming
+
+    def stop(self):
+        self.stop_event.set()
+
+
+class LiveFeed:
+    """
+    Sends captured lines over UDP to a live plotter on this machine. Fire and
+    forget: nothing listening, or a full socket buffer, never holds up the capture.
+    """
+
+    def __init__(self, port):
+        self.address = ('127.0.0.1', port)
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.setblocking(False)
+        self.batch = bytearray()
+
+    def send(self, line):
+        data = (line + '\n').encode()
+        if len(self.batch) + len(data) > LIVE_DATAGRAM_SIZE:
+            self.flush()
+        self.batch += data
+
+    def flush(self):
+        if self.batch:
+            try:
+                self.sock.sendto(self.batch, self.address)
+            except OSError:
+                pass  # Plotter not running or not keeping up
+            self.batch.clear()
+
+    def close(self):
+        self.sock.close()
+
+
+class CaptureStats:
+    """Throughput and backlog of the capture, reported every STATS_INTERVAL_S."""
+
+    def __init__(self):
+        self.start = time.monotonic()
+        self.last_report = self.start
+        self.last_bytes = 0
+        self.last_lines = 0
+        self.lines = 0
+        self.max_backlog = 0
 
-# Open serial connection
-ser = serial.Serial(PORT, BAUD, timeout=1)
-time.sleep(2)  # Allow connection to establish
+    def update(self, backlog):
+        self.max_backlog = max(self.max_backlog, backlog)
 
-print(f"Starting data capture to {FILENAME}")
-print("Press Ctrl+C to stop")
+    def report(self, bytes_read, backlog, now):
+        elapsed = now - self.last_report
+        print(f"[capture] {(bytes_read - self.last_bytes) / elapsed / 1000:.1f} kB/s, "
+              f"{(self.lines - self.last_lines) / elapsed:.0f} lines/s, "
+              f"backlog {backlog} chunks (max {self.max_backlog}), {self.lines} lines total")
+        self.last_report = now
+        self.last_bytes = bytes_read
+        self.last_lines = self.lines
 
-try:
-    with open(FILENAME, 'w') as file:
+
+def split_lines(pending, data):
+    """Yield the complete text lines in pending + data, keeping a partial last line in pending."""
+    pending.extend(data)
+    *complete, rest = pending.split(b'\n')
+    pending[:] = rest
+    for raw in complete:
+        line = raw.decode('utf-8', errors='replace').strip()
+        if line:
+            yield line
+
+
+def capture(ser, file, decoder, bursts):
+    chunks = queue.Queue()
+    reader = SerialReader(ser, chunks)
+    stats = CaptureStats()
+    pending = bytearray()
+    last_flush = time.monotonic()
+    last_echo = float("-inf")  # Echo the first line straight away
+    live = LiveFeed(LIVE_PORT) if LIVE_PORT else None
+
+    if BINARY_MODE:
+        file.write(CSV_HEADER + '\n')
+
+    reader.start()
+    try:
         while True:
-            if ser.in_waiting:
-                line = ser.readline().decode('utf-8').strip()
-                print(line)  # Echo to console
+            try:
+                data = chunks.get(timeout=FLUSH_INTERVAL_MS / 1000)
+            except queue.Empty:
+                data = b''
+            if data is None:
+                break
+
+            lines = decoder.feed(data) if BINARY_MODE else split_lines(pending, data)
+            for line in lines:
+                if line.startswith(BURST_PREFIX):
+                    bursts.write(line)
+                    continue
                 file.write(line + '\n')
-                file.flush()  # Make sure data is written immediately
-except KeyboardInterrupt:
-    print("\nCapture stopped")
-finally:
-    ser.close()
-    print(f"Data saved to {FILENAME}")
+                stats.lines += 1
+                if live:
+                    live.send(line)
+
+                now = time.monotonic()
+                if ECHO and (line.startswith('#') or now - last_echo >= ECHO_INTERVAL_S):
+                    print(line)
+                    last_echo = now
+
+            if live:
+                live.flush()
+
+            backlog = chunks.qsize()
+            stats.update(backlog)
+            now = time.monotonic()
+            if now - last_flush >= FLUSH_INTERVAL_MS / 1000:
+                file.flush()
+                bursts.flush()
+                last_flush = now
+            if STATS_INTERVAL_S and now - stats.last_report >= STATS_INTERVAL_S:
+                stats.report(reader.bytes_read, backlog, now)
+    finally:
+        reader.stop()
+        reader.join(timeout=2)
+        file.flush()
+        bursts.flush()
+        if live:
+            live.close()
+
+        if reader.error is not None:
+            print(f"Serial port error: {reader.error}")
+        elapsed = time.monotonic() - stats.start
+        print(f"Captured {reader.bytes_read} bytes, {stats.lines} lines in {elapsed:.0f} s "
+              f"(max backlog {stats.max_backlog} chunks)")
+
+
+def main():
+    # Open serial connection
+    ser = serial.Serial(PORT, BAUD, timeout=1)
+    time.sleep(2)  # Allow connection to establish
+
+    print(f"Starting data capture to {FILENAME}")
+    print("Press Ctrl+C to stop")
+
+    decoder = BinaryDecoder()
+    bursts = BurstWriter(FILENAME)
+    try:
+        with IndexedCaptureWriter(FILENAME) if INDEXED_MODE else open(FILENAME, 'w') as file:
+            capture(ser, file, decoder, bursts)
+    except KeyboardInterrupt:
+        print("\nCapture stopped")
+    finally:
+        ser.close()
+        bursts.close()
+        if BINARY_MODE:
+            print(f"Decoded {decoder.records} records, {decoder.lost_records} lost "
+                  f"({decoder.device_dropped} dropped on the device), {decoder.crc_errors} CRC errors")
+        print(f"Data saved to {FILENAME}")
+        if bursts.samples:
+            print(f"{bursts.samples} burst samples saved to {bursts.filename}")
+
+
+if __name__ == "__main__":
+    main()
@@ -1,11 +1,292 @@
+import argparse
 import csv
 import os
-import sys
+import socket
+import time
+from collections import deque
 import matplotlib.pyplot as plt
 import numpy as np
 from matplotlib.ticker import AutoMinorLocator
 
-def plot_combined_data(input_file):
+from telemetry import CSV_HEADER, IndexedCapture, capture_floats, is_indexed_capture
+
+PLOT_BUCKETS = 2000  # Time buckets per series, each plotted as its min and max sample
+CHUNK_ROWS = 100000  # Rows parsed before they are folded into the buckets
+
+LIVE_WINDOW_S = 60  # Seconds of data shown by the live plot
+LIVE_FPS = 10  # Live plot frames per second
+LIVE_UDP_PORT = 5005  # Port capture_serial.py sends lines to when LIVE_PORT is set
+
+SERIES = ('pitch', 'fuel_level', 'internal_temp', 'external_temp')
+SERIES_COLUMNS = {'pitch': 'Pitch', 'fuel_level': 'FuelLevel', 'internal_temp': 'InternalTemp',
+                  'external_temp': 'ExternalTemp'}
+
+class MinMaxDecimator:
+    """
+    Keeps the smallest and largest sample of a series in each of a fixed number of
+    time buckets. Chunks are added as they are read, so memory doesn't grow with the
+    length of the capture, and peaks survive however many samples share a pixel.
+    """
+    
+    def __init__(self, start, end, buckets):
+        self.start = start
+        self.width = (end - start) / buckets if end > start else 1.0
+        self.buckets = buckets
+        self.min_values = np.full(buckets, np.inf)
+        self.max_values = np.full(buckets, -np.inf)
+        self.min_times = np.zeros(buckets)
+        self.max_times = np.zeros(buckets)
+    
+    def add(self, times, values):
+        valid = ~np.isnan(values)
+        times = times[valid]
+        values = values[valid]
+        if len(values) == 0:
+            return
+        
+        buckets = np.clip(((times - self.start) / self.width).astype(int), 0, self.buckets - 1)
+        
+        # Sort by bucket then value: the first and last sample of each bucket are its min and max
+        order = np.lexsort((values, buckets))
+        buckets = buckets[order]
+        times = times[order]
+        values = values[order]
+        boundary = buckets[1:] != buckets[:-1]
+        first = np.concatenate(([True], boundary))
+        last = np.concatenate((boundary, [True]))
+        
+        index = buckets[first]
+        lower = values[first] < self.min_values[index]
+        self.min_values[index[lower]] = values[first][lower]
+        self.min_times[index[lower]] = times[first][lower]
+        
+        index = buckets[last]
+        higher = values[last] > self.max_values[index]
+        self.max_values[index[higher]] = values[last][higher]
+        self.max_times[index[higher]] = times[last][higher]
+    
+    def result(self):
+        """Times and values to plot: min and max of every bucket that has samples, in time order."""
+        used = np.isfinite(self.min_values)
+        min_first = self.min_times[used] <= self.max_times[used]
+        times = np.where(min_first, self.min_times[used], self.max_times[used])
+        values = np.where(min_first, self.min_values[used], self.max_values[used])
+        later_times = np.where(min_first, self.max_times[used], self.min_times[used])
+        later_values = np.where(min_first, self.max_values[used], self.min_values[used])
+        return (np.column_stack((times, later_times)).ravel(),
+                np.column_stack((values, later_values)).ravel())
+
+def to_float(text, sentinels=("No Data", "Disabled", "Open Circuit", "Short Circuit")):
+    """Parse a CSV value, NaN for the firmware's sentinel strings or anything unparseable."""
+    if text in sentinels:
+        return np.nan
+    try:
+        return float(text)
+    except ValueError:
+        return np.nan
+
+def read_columns(header):
+    """Column indices of the fields the plot uses."""
+    return {
+        'time': header.index('TimeMS') if 'TimeMS' in header else 0,
+        'fuel_level': header.index('FuelLevel') if 'FuelLevel' in header else 1,
+        'internal_temp': header.index('InternalTemp') if 'InternalTemp' in header else 2,
+        'external_temp': header.index('ExternalTemp') if 'ExternalTemp' in header else 3,
+        'pitch': header.index('Pitch') if 'Pitch' in header else 4,
+        'phase': header.index('Phase') if 'Phase' in header else 5,
+    }
+
+def selected_rows(reader, columns, start, end, phases):
+    """Yield (time in seconds, row) for the data rows inside the time and phase window."""
+    width = max(columns.values())
+    for row in reader:
+        if len(row) <= width:
+            continue
+        try:
+            time_sec = float(row[columns['time']]) / 1000.0
+        except ValueError:
+            continue  # Comment or repeated header
+        if start is not None and time_sec < start:
+            continue
+        if end is not None and time_sec > end:
+            continue  # Not break: a board reset restarts TimeMS within one file
+        if phases and row[columns['phase']] not in phases:
+            continue
+        yield time_sec, row
+
+def segment_slices(times, previous):
+    """
+    Split a chunk of selected times at each TimeMS restart after a board reset.
+    Yields (starts a new segment, slice); previous is the last time before the chunk, or None.
+    """
+    if len(times) == 0:
+        return
+    bounds = [0, *(np.flatnonzero(np.diff(times) < 0) + 1), len(times)]
+    for i in range(len(bounds) - 1):
+        new = i > 0 or previous is None or times[0] < previous
+        yield new, slice(bounds[i], bounds[i + 1])
+
+def find_time_ranges(input_file, start, end, phases):
+    """[first, last] selected time of each segment between resets, from a quick pass over the time and phase columns."""
+    ranges = []
+    with open(input_file, 'r', newline='') as infile:
+        reader = csv.reader(infile)
+        columns = read_columns(next(reader))
+        for time_sec, row in selected_rows(reader, columns, start, end, phases):
+            if ranges and time_sec >= ranges[-1][1]:
+                ranges[-1][1] = time_sec
+            else:
+                ranges.append([time_sec, time_sec])  # First row, or TimeMS restarted
+    return ranges
+
+def csv_chunks(input_file, start, end, phases, transitions):
+    """
+    Yield (times, values per series) arrays of up to CHUNK_ROWS selected rows of a CSV capture,
+    adding (time, pitch, phase) to transitions at each phase change.
+    """
+    with open(input_file, 'r', newline='') as infile:
+        reader = csv.reader(infile)
+        columns = read_columns(next(reader))
+        
+        chunk = {name: [] for name in SERIES}
+        chunk_times = []
+        last_phase = None
+        last_pitch = np.nan
+        
+        for time_sec, row in selected_rows(reader, columns, start, end, phases):
+            chunk_times.append(time_sec)
+            for name in SERIES:
+                chunk[name].append(to_float(row[columns[name]]))
+            
+            # Mark phase changes at the exact row, whatever the decimation keeps
+            pitch = chunk['pitch'][-1]
+            if not np.isnan(pitch):
+                last_pitch = pitch
+            phase = row[columns['phase']]
+            if phase != last_phase:
+                transitions.append((time_sec, last_pitch, phase))
+                last_phase = phase
+            
+            if len(chunk_times) >= CHUNK_ROWS:
+                yield np.array(chunk_times), {name: np.array(chunk[name]) for name in SERIES}
+                for name in SERIES:
+                    chunk[name].clear()
+                chunk_times.clear()
+        
+        yield np.array(chunk_times), {name: np.array(chunk[name]) for name in SERIES}
+
+def in_window(times, start, end):
+    """Mask of the times inside the start and end seconds."""
+    keep = np.ones(len(times), dtype=bool)
+    if start is not None:
+        keep &= times >= start
+    if end is not None:
+        keep &= times <= end
+    return keep
+
+def indexed_time_ranges(capture, windows, start, end):
+    """As find_time_ranges for an indexed capture, from the TimeMS arrays of the windows only."""
+    ranges = []
+    previous = None
+    for entry in capture.row_chunks(windows):
+        times = capture.chunk_columns(entry)['TimeMS'] / 1000.0
+        times = times[in_window(times, start, end)]
+        for new, part in segment_slices(times, previous):
+            if new:
+                ranges.append([times[part][0], times[part][-1]])
+            else:
+                ranges[-1][1] = times[part][-1]
+        if len(times):
+            previous = times[-1]
+    return ranges
+
+def indexed_chunks(capture, windows, start, end, transitions):
+    """As csv_chunks, from the row chunks of an indexed capture's windows, a chunk at a time."""
+    last_phase = None
+    last_pitch = np.nan
+    for entry in capture.row_chunks(windows):
+        columns = capture.chunk_columns(entry)
+        times = columns['TimeMS'] / 1000.0
+        keep = in_window(times, start, end)
+        if not keep.any():
+            continue
+        values = {name: capture_floats(columns[SERIES_COLUMNS[name]], SERIES_COLUMNS[name])[keep] for name in SERIES}
+        times = times[keep]
+        
+        phase = capture.labels.get(entry[2], "Unknown")
+        if phase != last_phase:
+            if not np.isnan(values['pitch'][0]):
+                last_pitch = values['pitch'][0]
+            transitions.append((times[0], last_pitch, phase))
+            last_phase = phase
+        valid = values['pitch'][~np.isnan(values['pitch'])]
+        if len(valid):
+            last_pitch = valid[-1]
+        yield times, values
+
+def create_axes(animated=False):
+    """
+    Figure with pitch on the primary y-axis, fuel level on a second and both
+    temperatures on a third, offset axis. Returns the figure, the axes and an
+    empty line per series for the caller to fill with set_data().
+    """
+    # Create figure and primary axis for pitch
+    fig, ax1 = plt.subplots(figsize=(14, 8))
+    
+    # Plot pitch on primary y-axis
+    color = 'tab:blue'
+    ax1.set_xlabel('Time (seconds)', fontsize=12)
+    ax1.set_ylabel('Pitch (degrees)', color=color, fontsize=12)
+    lines = {}
+    lines['pitch'], = ax1.plot([], [], color=color, linewidth=2, label='Pitch', animated=animated)
+    ax1.tick_params(axis='y', labelcolor=color)
+    ax1.grid(True, linestyle='--', alpha=0.7)
+    
+    # Create secondary y-axis for fuel level
+    ax2 = ax1.twinx()
+    color = 'tab:red'
+    ax2.set_ylabel('Fuel Level', color=color, fontsize=12)
+    lines['fuel_level'], = ax2.plot([], [], color=color, linestyle='--', linewidth=2, label='Fuel Level',
+                                    animated=animated)
+    ax2.tick_params(axis='y', labelcolor=color)
+    
+    # Create third y-axis for temperatures
+    ax3 = ax1.twinx()
+    # Offset the third axis
+    ax3.spines["right"].set_position(("axes", 1.1))
+    color = 'tab:green'
+    ax3.set_ylabel('Temperature', color=color, fontsize=12)
+    lines['internal_temp'], = ax3.plot([], [], color=color, linestyle='-.', linewidth=2, label='Internal Temp',
+                                       animated=animated)
+    lines['external_temp'], = ax3.plot([], [], color='tab:purple', linestyle=':', linewidth=2, label='External Temp',
+                                       animated=animated)
+    ax3.tick_params(axis='y', labelcolor=color)
+    
+    # Add minor grid lines
+    ax1.xaxis.set_minor_locator(AutoMinorLocator())
+    ax1.yaxis.set_minor_locator(AutoMinorLocator())
+    ax1.grid(which='minor', linestyle=':', alpha=0.4)
+    
+    # Add title
+    plt.title('Pitch, Fuel Level, and Temperature vs Time', fontsize=16, fontweight='bold')
+    return fig, (ax1, ax2, ax3), lines
+
+def add_legend(axes):
+    """Combined legend for all three axes, below the plot."""
+    handles = []
+    labels = []
+    for ax in axes:
+        ax_handles, ax_labels = ax.get_legend_handles_labels()
+        handles += ax_handles
+        labels += ax_labels
+    
+    axes[0].legend(handles, labels, 
+                   loc='upper center', bbox_to_anchor=(0.5, -0.12), ncol=4, fontsize=10,
+                   frameon=True, facecolor='white', edgecolor='black')
+    plt.tight_layout()
+    plt.subplots_adjust(bottom=0.2)  # Make room for the legend
+
+def plot_combined_data(input_file, start=None, end=None, phases=None, buckets=PLOT_BUCKETS, show=True):
     """
     Create a combined plot with multiple y-axes:
     - Primary Y-axis: Pitch (degrees)
@@ -13,14 +294,15 @@ def plot_combined_data(input_file):
     - X-axis: Time (seconds)
     
     This shows how pitch changes affect fuel level and temperatures.
+    The capture is read in chunks and each series is decimated to the min and max
+    of each time bucket, so long captures plot quickly in bounded memory.
+    start and end (seconds) and phases (list of names) limit the plot to a window.
+    An indexed .ftc capture is memory mapped and only the chunks of phases are read.
+    TimeMS restarts after a board reset, so each segment between resets is decimated
+    on its own and drawn over the same time axis, with a gap between segments.
     """
-    # Initialize lists to store data
-    times = []
-    pitches = []
-    fuel_levels = []
-    internal_temps = []
-    external_temps = []
-    phases = []
+    # Phase changes found while reading: (time, pitch, phase)
+    transitions = []
     
     # Phase markers for the plot
     phase_markers = {
@@ -31,131 +313,55 @@ def plot_combined_data(input_file):
         'Complete': {'marker': 'x', 'color': 'red'}
     }
     
+    capture = None
     try:
-        with open(input_file, 'r', newline='') as infile:
-            reader = csv.reader(infile)
-            
-            # Process header row
-            header = next(reader)
-            
-            # Find the column indices
-            time_index = header.index('TimeMS') if 'TimeMS' in header else 0
-            fuel_level_index = header.index('FuelLevel') if 'FuelLevel' in header else 1
-            internal_temp_index = header.index('InternalTemp') if 'InternalTemp' in header else 2
-            external_temp_index = header.index('ExternalTemp') if 'ExternalTemp' in header else 3
-            pitch_index = header.index('Pitch') if 'Pitch' in header else 4
-            phase_index = header.index('Phase') if 'Phase' in header else 5
-            
-            # Process data rows
-            for row in reader:
-                if len(row) > max(time_index, pitch_index, phase_index, fuel_level_index, internal_temp_index, external_temp_index):
-                    # Convert time from milliseconds to seconds
-                    try:
-                        time_ms = float(row[time_index])
-                        time_sec = time_ms / 1000.0
-                        times.append(time_sec)
-                    except ValueError:
-                        continue
-                    
-                    # Get pitch value
-                    try:
-                        pitch = float(row[pitch_index])
-                        pitches.append(pitch)
-                    except ValueError:
-                        pitches.append(np.nan)
-                    
-                    # Get fuel level
-                    try:
-                        if row[fuel_level_index] != "No Data":
-                            fuel_level = float(row[fuel_level_index])
-                            fuel_levels.append(fuel_level)
-                        else:
-                            fuel_levels.append(np.nan)
-                    except ValueError:
-                        fuel_levels.append(np.nan)
-                    
-                    # Get internal temperature
-                    try:
-                        if row[internal_temp_index] != "No Data":
-                            internal_temp = float(row[internal_temp_index])
-                            internal_temps.append(internal_temp)
-                        else:
-                            internal_temps.append(np.nan)
-                    except ValueError:
-                        internal_temps.append(np.nan)
-                    
-                    # Get external temperature
-                    try:
-                        if row[external_temp_index] != "No Data" and row[external_temp_index] != "Disabled" and \
-                           row[external_temp_index] != "Open Circuit" and row[external_temp_index] != "Short Circuit":
-                            external_temp = float(row[external_temp_index])
-                            external_temps.append(external_temp)
-                        else:
-                            external_temps.append(np.nan)
-                    except ValueError:
-                        external_temps.append(np.nan)
-                    
-                    # Get phase
-                    phase = row[phase_index] if phase_index < len(row) else "Unknown"
-                    phases.append(phase)
-        
-        # Create figure and primary axis for pitch
-        fig, ax1 = plt.subplots(figsize=(14, 8))
-        
-        # Plot pitch on primary y-axis
-        color = 'tab:blue'
-        ax1.set_xlabel('Time (seconds)', fontsize=12)
-        ax1.set_ylabel('Pitch (degrees)', color=color, fontsize=12)
-        ax1.plot(times, pitches, color=color, linewidth=2, label='Pitch')
-        ax1.tick_params(axis='y', labelcolor=color)
-        ax1.grid(True, linestyle='--', alpha=0.7)
-        
-        # Add phase markers
+        if is_indexed_capture(input_file):
+            capture = IndexedCapture(input_file)
+            windows = capture.select(phases)
+            ranges = indexed_time_ranges(capture, windows, start, end)
+            chunks = indexed_chunks(capture, windows, start, end, transitions)
+        else:
+            ranges = find_time_ranges(input_file, start, end, phases)
+            chunks = csv_chunks(input_file, start, end, phases, transitions)
+        if not ranges:
+            print("No data rows in the selected window")
+            return None
+        
+        segments = [{name: MinMaxDecimator(first, last, buckets) for name in SERIES} for first, last in ranges]
+        segment = -1
+        previous = None
+        for times, values in chunks:
+            for new, part in segment_slices(times, previous):
+                segment += new
+                for name in SERIES:
+                    segments[segment][name].add(times[part], values[name][part])
+            if len(times):
+                previous = times[-1]
+        
+        fig, axes, lines = create_axes()
+        for name in SERIES:
+            # A NaN after each segment keeps the line from joining across a reset
+            results = [series[name].result() for series in segments]
+            lines[name].set_data(np.concatenate([np.append(times, np.nan) for times, _ in results]),
+                                 np.concatenate([np.append(values, np.nan) for _, values in results]))
+        for ax in axes:
+            ax.relim()
+            ax.autoscale_view()
+        
+        # Add phase markers where each phase starts, labelled once per phase name
         unique_phases = []
-        for i in range(len(times)):
-            if i % 100 == 0:  # Add marker every 100 points to avoid overcrowding
-                phase = phases[i]
-                if phase not in unique_phases:
-                    unique_phases.append(phase)
-                    marker_config = phase_markers.get(phase, {'marker': 'o', 'color': 'black'})
-                    ax1.scatter(times[i], pitches[i], 
-                               color=marker_config['color'], 
-                               marker=marker_config['marker'], 
-                               s=100, label=phase)
-        
-        # Create secondary y-axis for fuel level
-        ax2 = ax1.twinx()
-        color = 'tab:red'
-        ax2.set_ylabel('Fuel Level', color=color, fontsize=12)
-        ax2.plot(times, fuel_levels, color=color, linestyle='--', linewidth=2, label='Fuel Level')
-        ax2.tick_params(axis='y', labelcolor=color)
-        
-        # Create third y-axis for temperatures
-        ax3 = ax1.twinx()
-        # Offset the third axis
-        ax3.spines["right"].set_position(("axes", 1.1))
-        color = 'tab:green'
-        ax3.set_ylabel('Temperature', color=color, fontsize=12)
-        ax3.plot(times, internal_temps, color=color, linestyle='-.', linewidth=2, label='Internal Temp')
-        ax3.plot(times, external_temps, color='tab:purple', linestyle=':', linewidth=2, label='External Temp')
-        ax3.tick_params(axis='y', labelcolor=color)
-        
-        # Add minor grid lines
-        ax1.xaxis.set_minor_locator(AutoMinorLocator())
-        ax1.yaxis.set_minor_locator(AutoMinorLocator())
-        ax1.grid(which='minor', linestyle=':', alpha=0.4)
-        
-        # Add title
-        plt.title('Pitch, Fuel Level, and Temperature vs Time', fontsize=16, fontweight='bold')
-        
-        # Create combined legend
-        lines1, labels1 = ax1.get_legend_handles_labels()
-        lines2, labels2 = ax2.get_legend_handles_labels()
-        lines3, labels3 = ax3.get_legend_handles_labels()
-        
-        ax1.legend(lines1 + lines2 + lines3, labels1 + labels2 + labels3, 
-                   loc='upper center', bbox_to_anchor=(0.5, -0.12), ncol=4, fontsize=10,
-                   frameon=True, facecolor='white', edgecolor='black')
+        for time_sec, pitch, phase in transitions:
+            marker_config = phase_markers.get(phase, {'marker': 'o', 'color': 'black'})
+            label = None
+            if phase not in unique_phases:
+                unique_phases.append(phase)
+                label = phase
+            axes[0].scatter(time_sec, pitch, 
+                            color=marker_config['color'], 
+                            marker=marker_config['marker'], 
+                            s=100, label=label)
+        
+        add_legend(axes)
         
         # Create output filename based on input filename
         base_name = os.path.splitext(input_file)[0]
@@ -163,12 +369,11 @@ def plot_combined_data(input_file):
         pdf_output = f"{base_name}_combined_plot.pdf"
         
         # Save figure
-        plt.tight_layout()
-        plt.subplots_adjust(bottom=0.2)  # Make room for the legend
         plt.savefig(output_file, dpi=300, bbox_inches='tight')
         plt.savefig(pdf_output, bbox_inches='tight')
         
-        plt.show()
+        if show:
+            plt.show()
         
         print(f"Plots saved to:")
         print(f"  PNG: {output_file}")
@@ -180,11 +385,186 @@ def plot_combined_data(input_file):
         import traceback
         traceback.print_exc()
         return None
+    finally:
+        if capture is not None:
+            capture.close()
+
+class FileSource:
+    """New lines appended to a capture file, like tail -f."""
+    
+    def __init__(self, filename):
+        self.file = open(filename, 'r', newline='')
+        self.header = self.file.readline().strip() or CSV_HEADER
+        self.file.seek(0, os.SEEK_END)  # Only show data captured from now on
+        self.partial = ''
+    
+    def read_lines(self):
+        lines = []
+        while True:
+            text = self.file.readline()
+            if not text:
+                return lines
+            text = self.partial + text
+            if not text.endswith('\n'):
+                self.partial = text  # The capture is part way through writing this line
+                return lines
+            self.partial = ''
+            lines.append(text.strip())
+    
+    def close(self):
+        self.file.close()
+
+class UdpSource:
+    """Lines sent by capture_serial.py with LIVE_PORT set, one or more per datagram."""
+    
+    def __init__(self, port):
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.bind(('127.0.0.1', port))
+        self.sock.setblocking(False)
+        self.header = CSV_HEADER
+    
+    def read_lines(self):
+        lines = []
+        while True:
+            try:
+                data = self.sock.recv(65536)
+            except BlockingIOError:
+                return lines
+            lines += data.decode('utf-8', errors='replace').splitlines()
+    
+    def close(self):
+        self.sock.close()
+
+class RollingWindow:
+    """The last window seconds of each series, appended row by row."""
+    
+    def __init__(self, window):
+        self.window = window
+        self.times = deque()
+        self.values = {name: deque() for name in SERIES}
+        self.phase = ''
+    
+    def add(self, time_sec, row, columns):
+        if self.times and time_sec < self.times[-1]:
+            self.clear()  # Board reset, TimeMS started again
+        self.times.append(time_sec)
+        for name in SERIES:
+            self.values[name].append(to_float(row[columns[name]]))
+        self.phase = row[columns['phase']]
+        
+        while self.times[0] < time_sec - self.window:
+            self.times.popleft()
+            for name in SERIES:
+                self.values[name].popleft()
+    
+    def clear(self):
+        self.times.clear()
+        for values in self.values.values():
+            values.clear()
+
+def expand_limits(ax, values, margin=0.1):
+    """Grow ax's y-limits to fit values with some headroom. True if they changed."""
+    values = values[~np.isnan(values)]
+    if len(values) == 0:
+        return False
+    low, high = ax.get_ylim()
+    data_low, data_high = values.min(), values.max()
+    if low <= data_low and data_high <= high:
+        return False
+    span = max(data_high - data_low, 1.0)
+    ax.set_ylim(min(low, data_low - span * margin), max(high, data_high + span * margin))
+    return True
+
+def live_plot(source, window=LIVE_WINDOW_S, fps=LIVE_FPS):
+    """
+    Plot the last window seconds of a running capture at a fixed frame rate.
+    Only the lines are redrawn each frame (blitting); the axes are redrawn only
+    when a series outgrows its y-limits. Time is shown relative to the newest row,
+    so the x-axis doesn't move.
+    """
+    columns = read_columns(source.header.split(','))
+    data = RollingWindow(window)
+    
+    fig, axes, lines = create_axes(animated=True)
+    axes[0].set_xlim(-window, 0)
+    axes[0].set_xlabel('Time (seconds before latest row)', fontsize=12)
+    status = axes[0].text(0.01, 0.98, '', transform=axes[0].transAxes, va='top', animated=True)
+    series_axes = {'pitch': axes[0], 'fuel_level': axes[1], 'internal_temp': axes[2], 'external_temp': axes[2]}
+    for ax in axes:
+        ax.set_ylim(0, 1)  # Grown to fit as data arrives
+    add_legend(axes)
+    
+    plt.show(block=False)
+    plt.pause(0.1)
+    background = fig.canvas.copy_from_bbox(fig.bbox)
+    frame_time = 1.0 / fps
+    
+    try:
+        while plt.fignum_exists(fig.number):
+            frame_start = time.monotonic()
+            
+            for row in csv.reader(source.read_lines()):
+                if row and row[0] == 'TimeMS':
+                    columns = read_columns(row)
+                    continue
+                if len(row) <= max(columns.values()):
+                    continue
+                try:
+                    time_sec = float(row[columns['time']]) / 1000.0
+                except ValueError:
+                    continue  # Comment or status line
+                data.add(time_sec, row, columns)
+            
+            redraw = False
+            if data.times:
+                times = np.array(data.times) - data.times[-1]
+                for name in SERIES:
+                    values = np.array(data.values[name])
+                    lines[name].set_data(times, values)
+                    redraw |= expand_limits(series_axes[name], values)
+                status.set_text(f"t = {data.times[-1]:.1f} s   {data.phase}")
+            
+            if redraw:
+                fig.canvas.draw()
+                background = fig.canvas.copy_from_bbox(fig.bbox)
+            else:
+                fig.canvas.restore_region(background)
+            for artist in list(lines.values()) + [status]:
+                artist.axes.draw_artist(artist)
+            fig.canvas.blit(fig.bbox)
+            fig.canvas.flush_events()
+            
+            time.sleep(max(0.0, frame_time - (time.monotonic() - frame_start)))
+    except KeyboardInterrupt:
+        pass
+    finally:
+        source.close()
 
 def main():
+    parser = argparse.ArgumentParser(description="Plot pitch, fuel level and temperatures from a capture")
+    parser.add_argument('input_file', nargs='?', help="CSV capture, indexed .ftc capture or processed CSV")
+    parser.add_argument('--start', type=float, help="Plot from this time, seconds")
+    parser.add_argument('--end', type=float, help="Plot up to this time, seconds")
+    parser.add_argument('--phase', help="Plot only these phases, comma separated (e.g. Stationary1,Stationary2)")
+    parser.add_argument('--buckets', type=int, default=PLOT_BUCKETS,
+                        help=f"Time buckets per series (default {PLOT_BUCKETS})")
+    parser.add_argument('--no-show', action='store_true', help="Save the plot files without opening a window")
+    parser.add_argument('--live', action='store_true', help="Follow a capture that is still being written")
+    parser.add_argument('--udp', type=int, nargs='?', const=LIVE_UDP_PORT,
+                        help=f"Live plot lines sent by capture_serial.py to this port (default {LIVE_UDP_PORT})")
+    parser.add_argument('--window', type=float, default=LIVE_WINDOW_S,
+                        help=f"Seconds shown by the live plot (default {LIVE_WINDOW_S})")
+    parser.add_argument('--fps', type=float, default=LIVE_FPS,
+                        help=f"Live plot frame rate (default {LIVE_FPS})")
+    args = parser.parse_args()
+    
+    if args.udp is not None:
+        live_plot(UdpSource(args.udp), args.window, args.fps)
+        return
+    
     # Check if file was provided as command line argument
-    if len(sys.argv) > 1:
-        input_file = sys.argv[1]
+    if args.input_file:
+        input_file = args.input_file
     else:
         # Ask user for input file
         input_file = input("Enter path to CSV file: ").strip('"')
@@ -194,8 +574,17 @@ def main():
         print(f"Error: File '{input_file}' not found.")
         return
     
+    if args.live and is_indexed_capture(input_file):
+        print("An indexed capture can't be followed live, use --udp for a live plot")
+        return
+    if args.live:
+        live_plot(FileSource(input_file), args.window, args.fps)
+        return
+    
     # Plot the data
-    plot_combined_data(input_file)
+    phases = args.phase.split(',') if args.phase else None
+    plot_combined_data(input_file, start=args.start, end=args.end, phases=phases,
+                       buckets=args.buckets, show=not args.no_show)
 
 if __name__ == "__main__":
     main()
\ No newline at end of file
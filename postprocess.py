@@ -1,11 +1,22 @@
+import argparse
 import csv
 import os
-import sys
+from collections import deque
 from datetime import datetime
 
-def process_csv_file(input_file):
+try:
+    import pandas as pd
+except ImportError:  # Only the vectorized path needs it
+    pd = None
+
+from telemetry import (BURST_PREFIX, CAPTURE_NO_DATA, CSV_HEADER, EXTERNAL_TEMP_STATUS, PHASE_SUMMARY_PREFIX,
+                       PHASE_VALUES, BinaryDecoder, BurstWriter, IndexedCapture, capture_floats, capture_lines,
+                       is_indexed_capture, parse_phase_line, read_log, read_log_header)
+
+def process_csv_file(input_file, phases=None):
     """
     Process the CSV file to reformat fuel level and temperature data.
+    phases limits the output to the rows of those phases.
     Converts:
         - Fuel level
         - Internal temp
@@ -19,13 +30,14 @@ def process_csv_file(input_file):
     rows_processed = 0
     
     try:
-        with open(input_file, 'r', newline='') as infile, open(output_file, 'w', newline='') as outfile:
+        with capture_lines(input_file, phases) as infile, open(output_file, 'w', newline='') as outfile:
             reader = csv.reader(infile)
             writer = csv.writer(outfile)
             
             # Process header row
             header = next(reader)
             writer.writerow(header)
+            serial_fuel = header.index('SerialFuelLevel') if 'SerialFuelLevel' in header else None
             
             # Process data rows
             for row in reader:
@@ -53,6 +65,10 @@ def process_csv_file(input_file):
                             row[3] = f"{external_temp / 100:.2f}"
                     except (ValueError, IndexError):
                         pass
+                    
+                    # Process the fuel level read on the LS200 serial path
+                    if serial_fuel is not None and serial_fuel < len(row) and row[serial_fuel].isdigit():
+                        row[serial_fuel] = f"{int(row[serial_fuel]) / 100:.2f}"
                 
                 writer.writerow(row)
                 rows_processed += 1
@@ -66,10 +82,423 @@ def process_csv_file(input_file):
         print(f"Error processing file: {e}")
         return None
 
+# Column types for the vectorized path. Sensor columns are read as text so the
+# sentinel strings can be split out into status columns.
+CAPTURE_DTYPES = {
+    'TimeMS': 'int64',
+    'FuelLevel': str,
+    'InternalTemp': str,
+    'ExternalTemp': str,
+    'Pitch': str,
+    'Phase': 'category',
+    'MovementDirection': 'category',
+    'PitchAgeMS': str,
+    'PitchFresh': 'Int8',
+    'CANAgeMS': str,
+    'CANFresh': 'Int8',
+    'SerialFuelLevel': str,
+    'SerialAgeMS': str,
+}
+
+# Numeric columns read as text first, since a board reset repeats the header line mid-file
+RESET_TEXT_COLUMNS = ['TimeMS', 'PitchFresh', 'CANFresh']
+
+# Raw LS200 columns in hundredths, scaled the same as the row-by-row path
+SCALED_COLUMNS = ['FuelLevel', 'InternalTemp', 'ExternalTemp', 'SerialFuelLevel']
+
+# Columns that can hold "No Data", "Disabled", "Open Circuit" or "Short Circuit"
+SENTINEL_COLUMNS = ['FuelLevel', 'InternalTemp', 'ExternalTemp', 'Pitch', 'PitchAgeMS', 'CANAgeMS',
+                    'SerialFuelLevel', 'SerialAgeMS']
+
+# Sentinel columns that hold whole milliseconds
+AGE_COLUMNS = ['PitchAgeMS', 'CANAgeMS', 'SerialAgeMS']
+
+def split_sentinels(raw):
+    """
+    Convert a text column to float64, with NaN in place of the sentinel strings.
+    Returns the values and a categorical status column: "OK" or the sentinel text.
+    """
+    values = pd.to_numeric(raw, errors='coerce')
+    status = raw.where(values.isna(), 'OK').astype('category')
+    return values, status
+
+def load_indexed_frame(input_file, phases=None):
+    """
+    The same columns as the vectorized CSV path, straight from the arrays of an indexed
+    capture. Only the chunks of phases are read.
+    """
+    with IndexedCapture(input_file) as capture:
+        columns = capture.columns(None if phases is None else capture.select(phases))
+
+    data = pd.DataFrame()
+    for name in CSV_HEADER.split(','):
+        raw = columns[name]
+        if name not in SENTINEL_COLUMNS:
+            categorical = name in ('Phase', 'MovementDirection')
+            data[name] = pd.Series(raw).astype('category' if categorical else CAPTURE_DTYPES[name])
+            continue
+        values = pd.Series(capture_floats(raw, name))
+        status = pd.Series('OK', index=values.index).mask(raw == CAPTURE_NO_DATA, "No Data")
+        if name == 'ExternalTemp':
+            for code, text in EXTERNAL_TEMP_STATUS.items():
+                status = status.mask(raw == code, text)
+        if name in SCALED_COLUMNS:
+            values = values / 100
+        data[name] = values.astype('Int64') if name in AGE_COLUMNS else values
+        data[f"{name}Status"] = status.astype('category')
+    return data
+
+def process_csv_vectorized(input_file, parquet=False, phases=None):
+    """
+    Vectorized version of process_csv_file for long captures. Loads every column
+    in one pass, scales fuel level and temperatures as array operations and maps
+    the sentinel strings to NaN, with a <Column>Status column saying why.
+    Writes CSV, or Parquet (needs pyarrow or fastparquet) with parquet=True.
+    """
+    if pd is None:
+        print("The vectorized path needs pandas (pip install pandas)")
+        return None
+
+    base_name = os.path.splitext(input_file)[0]
+    extension = 'parquet' if parquet else 'csv'
+    output_file = f"{base_name}_processed_{datetime.now().strftime('%Y%m%d_%H%M%S')}.{extension}"
+
+    try:
+        if is_indexed_capture(input_file):
+            data = load_indexed_frame(input_file, phases)
+        else:
+            # Comment lines such as drop reports are skipped
+            dtypes = dict(CAPTURE_DTYPES, **{column: str for column in RESET_TEXT_COLUMNS})
+            data = pd.read_csv(input_file, comment='#', dtype=dtypes,
+                               keep_default_na=False, engine='c')
+            # Drop the header lines repeated after a reset before converting
+            data = data[data['TimeMS'].str.isdigit()]
+            for column in RESET_TEXT_COLUMNS:
+                if column in data:
+                    data[column] = pd.to_numeric(data[column]).astype(CAPTURE_DTYPES[column])
+            for column in ('Phase', 'MovementDirection'):
+                if column in data:
+                    data[column] = data[column].cat.remove_unused_categories()
+            if phases is not None:
+                data = data[data['Phase'].isin(phases)]
+
+            for column in SENTINEL_COLUMNS:
+                if column not in data:
+                    continue
+                values, status = split_sentinels(data[column])
+                if column in SCALED_COLUMNS:
+                    values = values / 100
+                data[column] = values.astype('Int64') if column in AGE_COLUMNS else values
+                data[f"{column}Status"] = status
+
+        if parquet:
+            data.to_parquet(output_file, index=False)
+        else:
+            data.to_csv(output_file, index=False, float_format='%.2f')
+
+        print(f"Processing complete!")
+        print(f"Processed {len(data)} rows")
+        print(f"Output saved to: {output_file}")
+        return output_file
+
+    except Exception as e:
+        print(f"Error processing file: {e}")
+        return None
+
+def convert_log_file(input_file):
+    """
+    Convert an SD card log (FTnnn.BIN) to a CSV file with the same columns the
+    firmware streams, so it can be processed like a serial capture.
+    """
+    output_file = f"{os.path.splitext(input_file)[0]}.csv"
+    decoder = BinaryDecoder()
+    bursts = BurstWriter(output_file)
+
+    try:
+        with open(input_file, 'rb') as infile, open(output_file, 'w', newline='') as outfile:
+            header = read_log_header(infile)
+            print(f"Log of profile '{header['profile']}', {len(header['steps'])} steps, "
+                  f"sampled every {header['sample_interval_us'] / 1000:g} ms")
+            if not header['data_sectors']:
+                print("Log was not closed, reading until the last complete sector")
+
+            outfile.write(CSV_HEADER + '\n')
+            for line in read_log(infile, header, decoder):
+                if line.startswith(BURST_PREFIX):
+                    bursts.write(line)
+                else:
+                    outfile.write(line + '\n')
+
+        print(f"Decoded {decoder.records} records, {decoder.lost_records} lost")
+        if bursts.samples:
+            print(f"{bursts.samples} burst samples saved to {bursts.filename}")
+        return output_file
+
+    except (OSError, ValueError) as e:
+        print(f"Error reading log file: {e}")
+        return None
+
+    finally:
+        bursts.close()
+
+def extract_phases(input_file):
+    """
+    Collect the firmware's per-phase summary lines into <name>_phases.csv, one row per
+    phase. These are all there is of a capture streamed with "set raw off". Fuel level and
+    temperatures are scaled as in the processed rows.
+    """
+    output_file = f"{os.path.splitext(input_file)[0]}_phases.csv"
+    header = ['Phase', 'StartMS', 'DurationMS', 'Rows', 'SettleMS']
+    for value in PHASE_VALUES:
+        header += [f"{value}N", f"{value}Mean", f"{value}Min", f"{value}Max", f"{value}SD"]
+
+    phases = []
+    try:
+        with capture_lines(input_file) as infile:
+            for line in infile:
+                fields = parse_phase_line(line.strip())
+                if fields is None:
+                    continue
+                if line.startswith(PHASE_SUMMARY_PREFIX):
+                    settle = fields.get('settle_ms', '-')
+                    phases.append({'Phase': fields.get('phase'), 'StartMS': fields.get('start_ms'),
+                                   'DurationMS': fields.get('ms'), 'Rows': fields.get('rows'),
+                                   'SettleMS': '' if settle == '-' else settle})
+                elif phases and fields.get('phase') == phases[-1]['Phase'] and fields.get('value') in PHASE_VALUES:
+                    value = fields['value']
+                    scale = 100 if value in SCALED_COLUMNS else 1
+                    row = phases[-1]
+                    row[f"{value}N"] = fields.get('n')
+                    for name, key in (('Mean', 'mean'), ('Min', 'min'), ('Max', 'max'), ('SD', 'sd')):
+                        row[f"{value}{name}"] = f"{float(fields[key]) / scale:.4f}" if key in fields else ''
+
+        if not phases:
+            print("No phase summaries in the capture")
+            return None
+        with open(output_file, 'w', newline='') as outfile:
+            writer = csv.DictWriter(outfile, fieldnames=header, restval='')
+            writer.writeheader()
+            writer.writerows(phases)
+        print(f"{len(phases)} phase summaries saved to {output_file}")
+        return output_file
+
+    except (OSError, ValueError) as e:
+        print(f"Error reading phase summaries: {e}")
+        return None
+
+# Alignment stage (--align): each row pairs the latest pitch with the latest CAN values,
+# read up to a row interval or more apart. PitchAgeMS and CANAgeMS give each reading's
+# arrival time, and both sources are interpolated from those times onto a uniform grid.
+ALIGN_INTERVAL_MS = 10  # Default grid spacing, the firmware's default row interval
+ALIGN_MAX_GAP_MS = 250  # Readings further apart than this are not interpolated between
+ALIGN_HEADER = ['TimeMS', 'FuelLevel', 'InternalTemp', 'ExternalTemp', 'Pitch', 'Phase',
+                'MovementDirection', 'RowSkewMS']
+
+class SourceTrack:
+    """
+    Readings of one source in arrival time order, kept only as long as they are
+    needed to interpolate at the next grid time, so memory doesn't grow with the capture.
+    """
+
+    def __init__(self):
+        self.readings = deque()
+        self.count = 0
+
+    def add(self, time_ms, values):
+        # Ages are whole milliseconds, a reading can't arrive before the previous one
+        if self.readings and time_ms <= self.readings[-1][0]:
+            return
+        self.readings.append((time_ms, values))
+        self.count += 1
+
+    def reaches(self, time_ms):
+        return bool(self.readings) and self.readings[-1][0] >= time_ms
+
+    def sample(self, time_ms):
+        """Values interpolated at time_ms, or None outside the readings or across a gap."""
+        while len(self.readings) >= 2 and self.readings[1][0] <= time_ms:
+            self.readings.popleft()
+        if not self.readings or self.readings[0][0] > time_ms:
+            return None
+        t0, v0 = self.readings[0]
+        if t0 == time_ms:
+            return v0
+        if len(self.readings) < 2:
+            return None
+        t1, v1 = self.readings[1]
+        if t1 - t0 > ALIGN_MAX_GAP_MS:
+            return None
+        fraction = (time_ms - t0) / (t1 - t0)
+        return tuple(interpolate(a, b, fraction) for a, b in zip(v0, v1))
+
+def interpolate(a, b, fraction):
+    """Linear for numbers, nearest reading for status text such as "Open Circuit"."""
+    if isinstance(a, float) and isinstance(b, float):
+        return a + (b - a) * fraction
+    return a if fraction < 0.5 else b
+
+def reading_value(text, scale=1):
+    """Sensor text as a scaled float, or the status text unchanged."""
+    try:
+        return float(text) / scale
+    except ValueError:
+        return text
+
+def format_value(value):
+    if value is None:
+        return "No Data"
+    return f"{value:.2f}" if isinstance(value, float) else value
+
+class AlignedWriter:
+    """
+    Streaming merge of the pitch and CAN readings onto a grid of interval_ms. A grid
+    time is written once both sources have a reading at or after it, or once the rows
+    are ALIGN_MAX_GAP_MS past it and a source that hasn't caught up has a gap there.
+    """
+
+    def __init__(self, writer, interval_ms):
+        self.writer = writer
+        self.interval_ms = interval_ms
+        self.samples = 0
+        self.pitch_readings = 0
+        self.can_readings = 0
+        self.skew_count = 0
+        self.skew_total = 0
+        self.skew_squares = 0
+        self.skew_min = None
+        self.skew_max = None
+        self.reset()
+
+    def reset(self):
+        self.pitch = SourceTrack()
+        self.can = SourceTrack()
+        self.rows = deque()  # (TimeMS, phase, direction, skew) of the rows around the grid time
+        self.next_ms = None
+
+    def add_row(self, time_ms, phase, direction, skew):
+        if self.next_ms is None:
+            self.next_ms = -(-time_ms // self.interval_ms) * self.interval_ms
+        self.rows.append((time_ms, phase, direction, skew))
+        if skew is not None:
+            self.skew_count += 1
+            self.skew_total += skew
+            self.skew_squares += skew * skew
+            self.skew_min = skew if self.skew_min is None else min(self.skew_min, skew)
+            self.skew_max = skew if self.skew_max is None else max(self.skew_max, skew)
+        self.emit(final=False)
+
+    def emit(self, final):
+        while self.rows and self.next_ms <= self.rows[-1][0]:
+            t = self.next_ms
+            settled = final or self.rows[-1][0] >= t + ALIGN_MAX_GAP_MS
+            if not settled and not (self.pitch.reaches(t) and self.can.reaches(t)):
+                return
+
+            while len(self.rows) >= 2 and self.rows[1][0] <= t:
+                self.rows.popleft()
+            row_ms, phase, direction, skew = self.rows[0]
+            self.next_ms += self.interval_ms
+
+            # Streaming paused between tests, carry on from the next row
+            if len(self.rows) >= 2 and self.rows[1][0] - row_ms > ALIGN_MAX_GAP_MS:
+                self.next_ms = -(-self.rows[1][0] // self.interval_ms) * self.interval_ms
+                continue
+
+            pitch = self.pitch.sample(t)
+            can = self.can.sample(t) or (None, None, None)
+            self.writer.writerow([t, *(format_value(v) for v in can),
+                                  format_value(pitch[0] if pitch else None),
+                                  phase, direction, "" if skew is None else skew])
+            self.samples += 1
+
+    def finish(self):
+        self.emit(final=True)
+        self.pitch_readings += self.pitch.count
+        self.can_readings += self.can.count
+        self.reset()
+
+def align_capture(input_file, interval_ms=ALIGN_INTERVAL_MS, phases=None):
+    """
+    Resample a capture's pitch and CAN readings onto a uniform time base, one pass
+    in bounded memory. Each output row also has RowSkewMS: pitch arrival time minus
+    CAN arrival time in the original row at that time, the pairing error removed here.
+    Fuel level and temperatures are scaled as in process_csv_file.
+    """
+    output_file = f"{os.path.splitext(input_file)[0]}_aligned.csv"
+
+    try:
+        with capture_lines(input_file, phases) as infile, open(output_file, 'w', newline='') as outfile:
+            reader = csv.reader(infile)
+            header = next(reader)
+            if 'CANAgeMS' not in header:
+                print("The capture has no CANAgeMS column, record it with the current firmware to align it")
+                return None
+            col = {name: header.index(name) for name in header}
+
+            writer = csv.writer(outfile)
+            writer.writerow(ALIGN_HEADER)
+            aligned = AlignedWriter(writer, interval_ms)
+            last_ms = None
+
+            for row in reader:
+                if len(row) < len(header) or not row[0].isdigit():
+                    continue  # Comment lines and partial rows
+                time_ms = int(row[0])
+                if last_ms is not None and time_ms < last_ms:
+                    aligned.finish()  # TimeMS restarts after a board reset
+                last_ms = time_ms
+
+                pitch_ms = can_ms = None
+                if row[col['PitchAgeMS']].isdigit():
+                    pitch_ms = time_ms - int(row[col['PitchAgeMS']])
+                    if row[col['PitchFresh']] == '1':
+                        aligned.pitch.add(pitch_ms, (reading_value(row[col['Pitch']]),))
+                if row[col['CANAgeMS']].isdigit():
+                    can_ms = time_ms - int(row[col['CANAgeMS']])
+                    if row[col['CANFresh']] == '1':
+                        aligned.can.add(can_ms, tuple(reading_value(row[col[name]], 100)
+                                                      for name in ('FuelLevel', 'InternalTemp', 'ExternalTemp')))
+
+                skew = pitch_ms - can_ms if pitch_ms is not None and can_ms is not None else None
+                aligned.add_row(time_ms, row[col['Phase']], row[col['MovementDirection']], skew)
+            aligned.finish()
+
+        print(f"Alignment complete!")
+        print(f"{aligned.pitch_readings} angle packets and {aligned.can_readings} CAN frames "
+              f"resampled to {aligned.samples} rows every {interval_ms} ms")
+        if aligned.skew_count:
+            mean = aligned.skew_total / aligned.skew_count
+            spread = max(aligned.skew_squares / aligned.skew_count - mean * mean, 0) ** 0.5
+            print(f"Row skew (pitch - CAN arrival): mean {mean:.1f} ms, stddev {spread:.1f} ms, "
+                  f"min {aligned.skew_min} ms, max {aligned.skew_max} ms")
+        print(f"Output saved to: {output_file}")
+        return output_file
+
+    except (OSError, ValueError) as e:
+        print(f"Error aligning file: {e}")
+        return None
+
 def main():
+    parser = argparse.ArgumentParser(description="Scale fuel level and temperatures in a capture or SD log")
+    parser.add_argument('input_file', nargs='?', help="CSV capture, .ftc indexed capture or FTnnn.BIN log")
+    parser.add_argument('--fast', action='store_true',
+                        help="Vectorized pandas path with NaN and status columns")
+    parser.add_argument('--parquet', action='store_true',
+                        help="Write Parquet instead of CSV (implies --fast)")
+    parser.add_argument('--align', type=int, nargs='?', const=ALIGN_INTERVAL_MS, metavar='MS',
+                        help=f"Resample pitch and CAN readings every MS (default {ALIGN_INTERVAL_MS}) "
+                             "from their arrival times, to <name>_aligned.csv")
+    parser.add_argument('--phases', action='store_true',
+                        help="Collect the firmware's phase summaries into <name>_phases.csv")
+    parser.add_argument('--phase', help="Process only these phases, comma separated (e.g. Stationary3). "
+                                        "A .ftc capture reads just their chunks.")
+    args = parser.parse_args()
+    if args.align is not None and args.align <= 0:
+        parser.error("--align needs a positive interval in ms")
+
     # Check if file was provided as command line argument
-    if len(sys.argv) > 1:
-        input_file = sys.argv[1]
+    if args.input_file:
+        input_file = args.input_file
     else:
         # Ask user for input file
         input_file = input("Enter path to CSV file: ").strip('"')
@@ -79,8 +508,22 @@ def main():
         print(f"Error: File '{input_file}' not found.")
         return
     
+    # SD card logs are decoded to CSV first
+    if input_file.lower().endswith('.bin'):
+        input_file = convert_log_file(input_file)
+        if input_file is None:
+            return
+    
     # Process the file
-    process_csv_file(input_file)
+    phases = args.phase.split(',') if args.phase else None
+    if args.phases:
+        extract_phases(input_file)
+    elif args.align is not None:
+        align_capture(input_file, args.align, phases)
+    elif args.fast or args.parquet:
+        process_csv_vectorized(input_file, parquet=args.parquet, phases=phases)
+    else:
+        process_csv_file(input_file, phases)
 
 if __name__ == "__main__":
     main()
\ No newline at end of file
@@ -0,0 +1,146 @@
+//Host stand-in for the Arduino core, just the parts FuelTableCAN-Serial.cpp uses.
+//Everything here runs on the simulated rig in sim.cpp: time only moves when the
+//firmware calls into the core, and each call costs a little simulated CPU time.
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+//attachInterrupt() modes, LOW is level triggered
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#define NOT_AN_INTERRUPT -1
+#define EXTERNAL_NUM_INTERRUPTS 6
+
+#define SERIAL_RX_BUFFER_SIZE 64
+#define SERIAL_TX_BUFFER_SIZE 64
+
+//No separate flash on the host
+#define PROGMEM
+#define PSTR(s) (s)
+#define memcpy_P memcpy
+#define strcmp_P strcmp
+#define strlen_P strlen
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+#define pgm_read_word(p) (*(const uint16_t*)(p))
+
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper*>(s))
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+//Mega external interrupt pins: 2, 3, 21, 20, 19, 18 are INT0 to INT5
+#define digitalPinToInterrupt(p) ((p) == 2 ? 0 : (p) == 3 ? 1 : (p) == 21 ? 2 : (p) == 20 ? 3 : \
+                                  (p) == 19 ? 4 : (p) == 18 ? 5 : NOT_AN_INTERRUPT)
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+
+void attachInterrupt(uint8_t interruptNum, void (*isr)(), int mode);
+void detachInterrupt(uint8_t interruptNum);
+void noInterrupts();
+void interrupts();
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t b) = 0;
+    virtual size_t write(const uint8_t* data, size_t length);
+    size_t write(const char* text);
+    virtual int availableForWrite() { return 0; }
+
+    size_t print(const char* text);
+    size_t print(const __FlashStringHelper* text);
+    size_t print(char c);
+    size_t print(unsigned char value, int base = DEC);
+    size_t print(int value, int base = DEC);
+    size_t print(unsigned int value, int base = DEC);
+    size_t print(long value, int base = DEC);
+    size_t print(unsigned long value, int base = DEC);
+    size_t print(double value, int digits = 2);
+
+    size_t println();
+    size_t println(const char* text);
+    size_t println(const __FlashStringHelper* text);
+    size_t println(char c);
+    size_t println(unsigned char value, int base = DEC);
+    size_t println(int value, int base = DEC);
+    size_t println(unsigned int value, int base = DEC);
+    size_t println(long value, int base = DEC);
+    size_t println(unsigned long value, int base = DEC);
+    size_t println(double value, int digits = 2);
+
+private:
+    size_t printNumber(unsigned long value, int base);
+};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+//UART with the Mega's 64 byte RX and TX buffers. RX bytes come from the simulated
+//device on the port, TX bytes leave at the baud rate set by begin().
+class HardwareSerial : public Stream {
+public:
+    explicit HardwareSerial(byte port);
+    void begin(unsigned long baud);
+    void end();
+    int available();
+    int read();
+    int peek();
+    int availableForWrite();
+    void flush();
+    size_t write(uint8_t b);
+    using Print::write;
+    operator bool() { return true; }
+
+    //Simulation side
+    void receive(byte b);         //A byte arrives from the device, lost if the RX buffer is full
+    unsigned long baud;
+    bool open;
+    unsigned long rxOverruns;
+
+private:
+    int txPending();              //Bytes still in the TX buffer
+
+    byte port;
+    byte rx[SERIAL_RX_BUFFER_SIZE];
+    uint16_t rxHead;
+    uint16_t rxTail;
+    double txIdleUs;              //Simulated time the TX buffer runs empty
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+extern HardwareSerial Serial2;
+extern HardwareSerial Serial3;
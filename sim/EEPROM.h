@@ -0,0 +1,30 @@
+//Host stand-in for the EEPROM library: 4 KB, erased (0xFF) at the start of each run, so a
+//run starts like a new board and a reset within it sees what the sketch saved.
+#pragma once
+
+#include <Arduino.h>
+
+const int SIM_EEPROM_SIZE = 4096;
+
+class EEPROMClass {
+public:
+    EEPROMClass() : writes(0) { memset(data, 0xFF, sizeof(data)); }
+    uint8_t read(int address) { return (address >= 0 && address < SIM_EEPROM_SIZE) ? data[address] : 0xFF; }
+    void write(int address, uint8_t value) {
+        if (address >= 0 && address < SIM_EEPROM_SIZE) {
+            data[address] = value;
+            writes++;
+        }
+    }
+    void update(int address, uint8_t value) {
+        if (read(address) != value) {
+            write(address, value);
+        }
+    }
+
+    unsigned long writes;    //Cells written, for the end of run report
+private:
+    uint8_t data[SIM_EEPROM_SIZE];
+};
+
+extern EEPROMClass EEPROM;
@@ -0,0 +1,35 @@
+//Host stand-in for the SD library. The simulator has no card: SD.begin() fails and
+//the sketch carries on without logging, as it does on a rig with the card missing.
+#pragma once
+
+#include <Arduino.h>
+
+#define FILE_READ 0x01
+#define FILE_WRITE 0x13
+#define O_READ 0x01
+#define O_WRITE 0x02
+#define O_CREAT 0x10
+
+class File : public Stream {
+public:
+    size_t write(uint8_t b) { return 0; }
+    size_t write(const uint8_t* data, size_t length) { return 0; }
+    using Print::write;
+    int available() { return 0; }
+    int read() { return -1; }
+    int read(void* buffer, uint16_t length) { return -1; }
+    int peek() { return -1; }
+    bool seek(uint32_t position) { return false; }
+    void flush() {}
+    void close() {}
+    operator bool() { return false; }
+};
+
+class SDClass {
+public:
+    bool begin(uint8_t cs) { return false; }
+    bool exists(const char* path) { return false; }
+    File open(const char* path, uint8_t mode = FILE_READ) { return File(); }
+};
+
+extern SDClass SD;
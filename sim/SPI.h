@@ -0,0 +1,25 @@
+//Host stand-in for the SPI library. Transfers with the MCP2515 selected go to its
+//register model in sim.cpp, so the sketch's direct BIT MODIFY of EFLG works.
+#pragma once
+
+#include <Arduino.h>
+
+#define MSBFIRST 1
+#define LSBFIRST 0
+#define SPI_MODE0 0x00
+
+struct SPISettings {
+    SPISettings() {}
+    SPISettings(unsigned long clock, byte bitOrder, byte dataMode) {}
+};
+
+class SPIClass {
+public:
+    void begin() {}
+    void usingInterrupt(uint8_t interruptNumber) {}
+    void beginTransaction(SPISettings settings);
+    void endTransaction();
+    byte transfer(byte data);
+};
+
+extern SPIClass SPI;
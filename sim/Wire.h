@@ -0,0 +1,4 @@
+//Host stand-in for the Wire library, included by the sketch but not used
+#pragma once
+
+#include <Arduino.h>
@@ -0,0 +1,66 @@
+//Host stand-in for the mcp_can library: an MCP2515 with its two RX buffers,
+//fed with LS200 frames by sim.cpp
+#pragma once
+
+#include <Arduino.h>
+
+#define MCP_ANY 0
+#define MCP_STD 1
+#define MCP_EXT 2
+#define MCP_STDEXT 3
+
+#define MCP_NORMAL 0x00
+#define MCP_SLEEP 0x20
+#define MCP_LOOPBACK 0x40
+#define MCP_LISTENONLY 0x60
+
+#define MCP_20MHZ 0
+#define MCP_16MHZ 1
+#define MCP_8MHZ 2
+
+#define CAN_125KBPS 9
+#define CAN_250KBPS 12
+#define CAN_500KBPS 15
+#define CAN_1000KBPS 18
+
+#define CAN_OK 0
+#define CAN_FAILINIT 1
+#define CAN_MSGAVAIL 3
+#define CAN_NOMSG 4
+#define CAN_CTRLERROR 5
+
+#define MCP_EFLG_RX1OVR 0x80
+#define MCP_EFLG_RX0OVR 0x40
+
+#define MCP_RX_BUFFERS 2
+
+struct SimCANFrame {
+    unsigned long id;
+    byte len;
+    byte data[8];
+};
+
+class MCP_CAN {
+public:
+    explicit MCP_CAN(byte cs);
+    byte begin(byte idMode, byte speed, byte clock);
+    byte setMode(byte mode);
+    byte init_Mask(byte num, byte ext, unsigned long mask);
+    byte init_Filt(byte num, byte ext, unsigned long filter);
+    byte checkReceive();
+    byte readMsgBuf(unsigned long* id, byte* len, byte* data);
+    byte checkError();
+    byte getError();
+
+    //Simulation side
+    void receive(const SimCANFrame& frame);  //A frame arrives off the bus
+    bool interruptPending();                 //INT is low while a frame is waiting
+    byte eflg;                               //Error flags, cleared by the sketch over SPI
+    unsigned long framesLost;
+    byte speed;                              //Bit rate begin() was given
+
+private:
+    byte cs;
+    SimCANFrame rx[MCP_RX_BUFFERS];
+    byte rxCount;
+};
@@ -0,0 +1,1218 @@
+//Hardware-in-the-loop simulator for FuelTableCAN-Serial.cpp.
+//
+//The sketch is compiled unchanged against the stand-in headers in this directory and
+//runs on a simulated rig: an L298N driven actuator tilting the table, fuel sloshing in
+//the tank, a WT901 streaming angle packets on Serial2 and an LS200 sending frames to the
+//MCP2515 and the same readings as text lines on Serial3. Time is simulated. It advances by a fixed cost whenever the sketch calls into
+//the core, and in steps through delay() and blocking writes, so a test runs as fast as
+//the host can spin and gives the same result every time for the same seed.
+//
+//Serial (data) goes to stdout or -o, Serial1 (debug) to stderr. Lines can be sent to the
+//sketch's command parser with -c. At the end the simulator prints the row interval
+//jitter, throughput, dropped sensor data and the convergence of every move on stderr.
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <SD.h>
+#include <EEPROM.h>
+#include <mcp_can.h>
+
+#include <time.h>
+#include <unistd.h>
+
+//Simulated CPU time per call into the core. The sketch's waits spin on micros() and
+//millis(), so this sets how fast a spinning loop goes round: about right for a Mega.
+const unsigned long CALL_COST_US = 4;        //millis(), micros()
+const unsigned long PIN_COST_US = 4;         //digitalWrite(), analogWrite()
+const unsigned long SERIAL_COST_US = 1;      //available(), read(), write()
+const unsigned long SPI_COST_US = 10;        //MCP2515 register access
+const unsigned long SPI_FRAME_COST_US = 40;  //Reading one frame out of the MCP2515
+const unsigned long WAIT_STEP_US = 100;      //delay() and blocking writes advance in steps this long,
+                                             //so interrupts are still serviced during them
+const unsigned long PHYSICS_STEP_US = 200;   //Actuator and fuel integration step
+
+//Sketch wiring, as in FuelTableCAN-Serial.cpp
+const byte SIM_MOTOR_ENA = 9;
+const byte SIM_MOTOR_IN1 = 8;
+const byte SIM_MOTOR_IN2 = 7;
+const byte SIM_CAN_CS = 10;
+const byte SIM_CAN_INTERRUPT = 0;            //INT0, pin 2
+
+//Actuator: IN2 high drives it up (pitch increases), IN1 high drives it down
+const float ACTUATOR_MAX_RATE = 1.5;         //Degrees per second at full duty
+const int ACTUATOR_STALL_DUTY = 50;          //Below this duty the actuator doesn't move
+const float ACTUATOR_TIME_CONSTANT = 0.08;   //Seconds for the speed to follow a duty change
+const float PITCH_LIMIT = 15.0;              //End stops, degrees
+
+//Fuel surface, a damped oscillator following the table angle
+const float FUEL_ZERO_COUNTS = 2000.0;       //LS200 reading with the table level
+const float FUEL_COUNTS_PER_DEGREE = 40.0;
+const float SLOSH_FREQUENCY_HZ = 0.6;
+const float SLOSH_DAMPING = 0.15;            //Damping ratio
+const float FUEL_NOISE_COUNTS = 2.0;         //Standard deviation
+const uint16_t INTERNAL_TEMP = 245;
+const uint16_t EXTERNAL_TEMP = 231;
+const unsigned long LS200_CAN_ID = 0x100;
+const unsigned long LS200_SERIAL_BAUD = 9600;
+const int CAN_SPEED_EEPROM_ADDR = 0;         //EEPROM_CAN_SPEED_ADDR and _MAGIC in the sketch
+const byte CAN_SPEED_EEPROM_MAGIC = 0xC5;
+
+//WT901, starting in its factory configuration
+const float WT901_NOISE_DEG = 0.01;          //Standard deviation of the reported angle
+const unsigned long WT901_START_BAUD = 9600;
+const byte WT901_START_RATE = 0x06;          //10Hz
+const uint16_t WT901_START_OUTPUT = 0x1E;    //Accel, gyro, angle and magnetometer packets
+const byte WT901_REG_OUTPUT = 0x02;
+const byte WT901_REG_RATE = 0x03;
+const byte WT901_REG_BAUD = 0x04;
+
+const byte MAX_COMMANDS = 32;
+const byte COMMAND_TEXT_SIZE = 64;
+const uint16_t MAX_MOVES = 256;
+const byte MAX_REPORTED_MOVES = 64;          //Moves listed one per line, the rest only in the totals
+const byte LINE_SIZE = 160;
+
+struct Command {
+    unsigned long timeMs;
+    char text[COMMAND_TEXT_SIZE];
+};
+
+struct Options {
+    const char* dataFile;    //NULL for stdout
+    bool quiet;              //Don't echo Serial1
+    double maxSeconds;       //Stop after this much simulated time
+    unsigned int runs;       //Stop after this many completed tests, 0 only stops on maxSeconds
+    float startPitch;
+    unsigned long seed;
+    float canRateHz;         //LS200 frames per second
+    byte canBusSpeed;        //MCP2515 bit rate code the LS200 sends at
+    byte cachedCANSpeed;     //Bit rate code saved in EEPROM before the run, 0 for none
+    Command commands[MAX_COMMANDS];
+    byte commandCount;
+    Command idleCommands[MAX_COMMANDS];  //Sent one per completed test, in order
+    byte idleCount;
+};
+
+struct Clock {
+    uint64_t nowUs;
+    uint64_t physicsUs;
+    uint64_t endUs;
+    bool interruptsOn;
+    bool inInterrupt;
+    bool spiMasked;          //SPI.usingInterrupt() keeps INT0 off during transactions
+    void (*isr[EXTERNAL_NUM_INTERRUPTS])();
+};
+
+struct Actuator {
+    byte in1;
+    byte in2;
+    int duty;
+    int drive;               //+1 up, -1 down, 0 stopped
+    int lastDrive;           //Last nonzero drive, to count reversals
+    float pitch;             //Degrees
+    float rate;              //Degrees per second
+    unsigned long starts;
+    unsigned long reversals;
+    double runSeconds;
+};
+
+struct Fuel {
+    float surface;           //Degrees, the angle the fuel is sitting at
+    float velocity;
+};
+
+struct WT901Model {
+    unsigned long baud;
+    byte rateCode;
+    uint16_t output;
+    byte command[5];
+    byte commandLength;
+    uint64_t nextUs;
+    unsigned long packets;
+};
+
+struct LS200Model {
+    uint64_t nextUs;
+    unsigned long frames;
+    unsigned long lines;     //Sent on Serial3
+};
+
+//One move of the table, from a "moving to" debug line to "Pitch stabilized"
+struct Move {
+    float target;
+    float startPitch;
+    uint64_t startUs;
+    double seconds;
+    float error;
+    float overshoot;         //Furthest past the target, degrees
+    unsigned long reversals;
+    bool reached;
+};
+
+struct LineBuffer {
+    char text[LINE_SIZE];
+    byte length;
+};
+
+struct StreamStats {
+    unsigned long dataBytes;
+    unsigned long debugBytes;
+    unsigned long rows;
+    unsigned long lastTimeMs;
+    bool haveRow;
+    bool binary;             //Frame sync seen, rows aren't parsed
+    byte lastByte;
+    double intervalMean;     //Welford running mean and sum of squares of the row interval
+    double intervalM2;
+    unsigned long intervalCount;
+    unsigned long intervalMin;
+    unsigned long intervalMax;
+    unsigned int testsCompleted;
+};
+
+void parseOptions(int argc, char** argv);
+void usage(const char* program);
+byte canSpeedCode(const char* kbps);
+uintptr_t reserveStack();
+void startWorld();
+void tick(unsigned long us);
+void spend(unsigned long us);
+void waitUs(unsigned long us);
+void serviceInterrupts();
+void runWorld();
+void stepPhysics(float dt);
+void updateDrive();
+void emitWT901();
+void sendWT901Packet(byte type, int16_t v0, int16_t v1, int16_t v2, int16_t v3);
+float wt901RateHz(byte code);
+unsigned long wt901Baud(uint16_t code);
+void wt901Command(byte b);
+void emitLS200();
+void sendCommands();
+void sendIdleCommand();
+void deliver(byte port, byte b);
+void dataByte(byte b);
+void debugByte(byte b);
+void debugLine(const char* line);
+void startMove(float target);
+void endMove(bool reached);
+float gaussian(float sigma);
+uint64_t nextRandom();
+double wallSeconds();
+void finish(const char* reason);
+void report(const char* reason);
+
+//Provided by FuelTableCAN-Serial.cpp
+void setup();
+void loop();
+extern MCP_CAN CAN;
+
+//avr-libc symbols the sketch uses to measure free SRAM, see reserveStack()
+char __heap_start;
+char* __brkval;
+
+HardwareSerial Serial(0);
+HardwareSerial Serial1(1);
+HardwareSerial Serial2(2);
+HardwareSerial Serial3(3);
+SPIClass SPI;
+SDClass SD;
+EEPROMClass EEPROM;
+
+Options options = {NULL, false, 3600.0, 1, 2.0, 1, 50.0, CAN_1000KBPS, 0, {}, 0, {}, 0};
+Clock simClock;
+Actuator actuator;
+Fuel fuel;
+WT901Model wt901Model;
+LS200Model ls200;
+Move moves[MAX_MOVES];
+uint16_t moveCount;
+unsigned long movesDropped;
+Move* currentMove;
+LineBuffer dataLine;
+LineBuffer debugLineBuffer;
+StreamStats streams;
+FILE* dataFile;
+uint64_t randomState;
+byte spiBytes[4];
+byte spiLength;
+bool canSelected;
+double wallStart;
+
+int main(int argc, char** argv) {
+    parseOptions(argc, argv);
+
+    dataFile = stdout;
+    if (options.dataFile != NULL) {
+        dataFile = fopen(options.dataFile, "wb");
+        if (dataFile == NULL) {
+            fprintf(stderr, "# Sim: can't write %s\n", options.dataFile);
+            return 1;
+        }
+    }
+
+    __brkval = (char*)reserveStack();
+    startWorld();
+    wallStart = wallSeconds();
+
+    setup();
+    for (;;) {
+        loop();
+    }
+}
+
+void parseOptions(int argc, char** argv) {
+    int option;
+    while ((option = getopt(argc, argv, "o:qt:n:c:p:s:r:b:k:h")) != -1) {
+        switch (option) {
+            case 'o':
+                options.dataFile = optarg;
+                break;
+            case 'q':
+                options.quiet = true;
+                break;
+            case 't':
+                options.maxSeconds = atof(optarg);
+                break;
+            case 'n':
+                options.runs = atoi(optarg);
+                break;
+            case 'c': {
+                //-c <ms>:<command> or -c idle:<command>
+                char* text = strchr(optarg, ':');
+                bool idle = strncmp(optarg, "idle:", 5) == 0;
+                byte& count = idle ? options.idleCount : options.commandCount;
+                if (text == NULL || count == MAX_COMMANDS) {
+                    usage(argv[0]);
+                }
+                Command& command = idle ? options.idleCommands[count++] : options.commands[count++];
+                command.timeMs = idle ? 0 : strtoul(optarg, NULL, 10);
+                snprintf(command.text, sizeof(command.text), "%s\n", text + 1);
+                break;
+            }
+            case 'p':
+                options.startPitch = atof(optarg);
+                break;
+            case 's':
+                options.seed = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                options.canRateHz = atof(optarg);
+                break;
+            case 'b':
+                options.canBusSpeed = canSpeedCode(optarg);
+                break;
+            case 'k':
+                options.cachedCANSpeed = canSpeedCode(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    //Commands go out in time order
+    for (byte i = 1; i < options.commandCount; i++) {
+        for (byte j = i; j > 0 && options.commands[j].timeMs < options.commands[j - 1].timeMs; j--) {
+            Command swap = options.commands[j];
+            options.commands[j] = options.commands[j - 1];
+            options.commands[j - 1] = swap;
+        }
+    }
+}
+
+void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -o FILE       write the data stream (Serial) to FILE instead of stdout\n"
+            "  -q            don't echo the debug stream (Serial1)\n"
+            "  -t SECONDS    stop after this much simulated time (default 3600)\n"
+            "  -n RUNS       stop after this many completed tests, 0 runs until -t (default 1)\n"
+            "  -c MS:LINE    send LINE to the command parser at MS, e.g. -c '90000:run sweep 2'\n"
+            "  -c idle:LINE  send LINE when the next test completes, e.g. -c 'idle:run sweep 2'\n"
+            "  -p DEGREES    starting table pitch (default 2.0)\n"
+            "  -s SEED       seed for the sensor noise (default 1)\n"
+            "  -r HZ         LS200 frame rate (default 50)\n"
+            "  -b KBPS       LS200 CAN bit rate, 125, 250, 500 or 1000 (default 1000)\n"
+            "  -k KBPS       start with this bit rate saved in EEPROM as the last one that worked\n",
+            program);
+    exit(2);
+}
+
+byte canSpeedCode(const char* kbps) {
+    switch (atoi(kbps)) {
+        case 125:
+            return CAN_125KBPS;
+        case 250:
+            return CAN_250KBPS;
+        case 500:
+            return CAN_500KBPS;
+        case 1000:
+            return CAN_1000KBPS;
+    }
+    fprintf(stderr, "# Sim: unknown CAN bit rate %s\n", kbps);
+    exit(2);
+}
+
+//The sketch measures free SRAM from the heap end (__brkval) up to its stack. Put that
+//point a little below main()'s frame, in stack the host has already mapped, so
+//paintStack() and sramLowWatermark() walk memory that is safe to touch. Returned as an
+//address, the frame is gone but the pages stay mapped.
+uintptr_t reserveStack() {
+    volatile char reserved[32768];
+    for (size_t i = 0; i < sizeof(reserved); i += 256) {
+        reserved[i] = 0;
+    }
+    return (uintptr_t)reserved;
+}
+
+void startWorld() {
+    simClock.nowUs = 0;
+    simClock.physicsUs = 0;
+    simClock.endUs = (uint64_t)(options.maxSeconds * 1e6);
+    simClock.interruptsOn = true;
+
+    actuator.pitch = options.startPitch;
+    fuel.surface = options.startPitch;
+
+    wt901Model.baud = WT901_START_BAUD;
+    wt901Model.rateCode = WT901_START_RATE;
+    wt901Model.output = WT901_START_OUTPUT;
+    wt901Model.nextUs = 0;
+    ls200.nextUs = 0;
+
+    if (options.cachedCANSpeed != 0) {
+        EEPROM.write(CAN_SPEED_EEPROM_ADDR, CAN_SPEED_EEPROM_MAGIC);
+        EEPROM.write(CAN_SPEED_EEPROM_ADDR + 1, options.cachedCANSpeed);
+        EEPROM.writes = 0;  //Written before the run, not by the sketch
+    }
+
+    randomState = options.seed * 0x9E3779B97F4A7C15ULL + 1;
+}
+
+//Advance time and let a pending interrupt run, as on any cycle of the real loop
+void tick(unsigned long us) {
+    spend(us);
+    serviceInterrupts();
+}
+
+//Advance time with interrupts held off, for work the MCP2515 ISR mustn't interrupt
+void spend(unsigned long us) {
+    simClock.nowUs += us;
+    runWorld();
+}
+
+void waitUs(unsigned long us) {
+    while (us > 0) {
+        unsigned long step = us < WAIT_STEP_US ? us : WAIT_STEP_US;
+        tick(step);
+        us -= step;
+    }
+}
+
+//INT0 is level triggered and stays low while the MCP2515 holds a frame
+void serviceInterrupts() {
+    void (*isr)() = simClock.isr[SIM_CAN_INTERRUPT];
+    if (isr == NULL || !simClock.interruptsOn || simClock.spiMasked || simClock.inInterrupt ||
+        !CAN.interruptPending()) {
+        return;
+    }
+
+    simClock.inInterrupt = true;
+    isr();
+    simClock.inInterrupt = false;
+}
+
+void runWorld() {
+    while (simClock.physicsUs + PHYSICS_STEP_US <= simClock.nowUs) {
+        simClock.physicsUs += PHYSICS_STEP_US;
+        stepPhysics(PHYSICS_STEP_US / 1e6);
+    }
+    if (simClock.nowUs >= wt901Model.nextUs) {
+        emitWT901();
+    }
+    if (simClock.nowUs >= ls200.nextUs) {
+        emitLS200();
+    }
+    sendCommands();
+
+    if (simClock.nowUs >= simClock.endUs) {
+        finish("simulated time limit reached");
+    }
+}
+
+void stepPhysics(float dt) {
+    float speed = 0;
+    if (actuator.drive != 0 && actuator.duty > ACTUATOR_STALL_DUTY) {
+        speed = actuator.drive * ACTUATOR_MAX_RATE * (actuator.duty - ACTUATOR_STALL_DUTY) /
+                (255.0 - ACTUATOR_STALL_DUTY);
+        actuator.runSeconds += dt;
+    }
+    actuator.rate += (speed - actuator.rate) * dt / ACTUATOR_TIME_CONSTANT;
+    actuator.pitch += actuator.rate * dt;
+    if (fabs(actuator.pitch) > PITCH_LIMIT) {
+        actuator.pitch = constrain(actuator.pitch, -PITCH_LIMIT, PITCH_LIMIT);
+        actuator.rate = 0;
+    }
+
+    float w = 2.0 * M_PI * SLOSH_FREQUENCY_HZ;
+    fuel.velocity += (w * w * (actuator.pitch - fuel.surface) - 2.0 * SLOSH_DAMPING * w * fuel.velocity) * dt;
+    fuel.surface += fuel.velocity * dt;
+
+    if (currentMove != NULL) {
+        float direction = currentMove->target >= currentMove->startPitch ? 1.0 : -1.0;
+        float past = (actuator.pitch - currentMove->target) * direction;
+        if (past > currentMove->overshoot) {
+            currentMove->overshoot = past;
+        }
+    }
+}
+
+//Work out the L298N output from IN1, IN2 and the ENA duty
+void updateDrive() {
+    int drive = 0;
+    if (actuator.duty > 0 && actuator.in1 != actuator.in2) {
+        drive = actuator.in2 ? 1 : -1;
+    }
+
+    if (drive != 0 && drive != actuator.drive) {
+        actuator.starts++;
+        if (actuator.lastDrive == -drive) {
+            actuator.reversals++;
+            if (currentMove != NULL) {
+                currentMove->reversals++;
+            }
+        }
+        actuator.lastDrive = drive;
+    }
+    actuator.drive = drive;
+}
+
+//Send the enabled packets for each output period that has passed. Packets sent while
+//Serial2 is at another baud rate arrive as garbage, as they would on the real port.
+void emitWT901() {
+    float rateHz = wt901RateHz(wt901Model.rateCode);
+    byte packetCount = 0;
+    for (byte bit = 1; bit <= 4; bit++) {
+        packetCount += (wt901Model.output >> bit) & 1;
+    }
+    if (rateHz <= 0 || packetCount == 0) {
+        wt901Model.nextUs = simClock.nowUs + 100000;
+        return;
+    }
+
+    //The sensor can't send faster than its baud rate allows
+    double periodUs = 1e6 / rateHz;
+    double wireUs = packetCount * 11 * 10e6 / wt901Model.baud;
+    if (periodUs < wireUs) {
+        periodUs = wireUs;
+    }
+
+    while (wt901Model.nextUs <= simClock.nowUs) {
+        float pitch = actuator.pitch + gaussian(WT901_NOISE_DEG);
+        int16_t angle = (int16_t)lround(pitch / 180.0 * 32768.0);
+        int16_t accel = (int16_t)lround(sin(pitch * M_PI / 180.0) * 2048.0);  //16g full scale
+        int16_t gyro = (int16_t)lround(actuator.rate / 2000.0 * 32768.0);
+
+        if (wt901Model.output & 0x02) {
+            sendWT901Packet(0x51, accel, 0, 2048, 2500);
+        }
+        if (wt901Model.output & 0x04) {
+            sendWT901Packet(0x52, gyro, 0, 0, 2500);
+        }
+        if (wt901Model.output & 0x08) {
+            sendWT901Packet(0x53, angle, 0, 0, 0);
+            wt901Model.packets++;
+        }
+        if (wt901Model.output & 0x10) {
+            sendWT901Packet(0x54, 0, 0, 0, 2500);
+        }
+        wt901Model.nextUs += (uint64_t)periodUs;
+    }
+}
+
+void sendWT901Packet(byte type, int16_t v0, int16_t v1, int16_t v2, int16_t v3) {
+    byte packet[11] = {0x55, type,
+                       (byte)v0, (byte)(v0 >> 8), (byte)v1, (byte)(v1 >> 8),
+                       (byte)v2, (byte)(v2 >> 8), (byte)v3, (byte)(v3 >> 8), 0};
+    for (byte i = 0; i < 10; i++) {
+        packet[10] += packet[i];
+    }
+
+    if (!Serial2.open) {
+        return;
+    }
+    for (byte i = 0; i < sizeof(packet); i++) {
+        Serial2.receive(Serial2.baud == wt901Model.baud ? packet[i] : (byte)nextRandom());
+    }
+}
+
+float wt901RateHz(byte code) {
+    static const float RATES[] = {0, 0.2, 0.5, 1, 2, 5, 10, 20, 50, 100, 125, 200};
+    return code < sizeof(RATES) / sizeof(RATES[0]) ? RATES[code] : 0;
+}
+
+unsigned long wt901Baud(uint16_t code) {
+    static const unsigned long BAUDS[] = {2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400};
+    return code < sizeof(BAUDS) / sizeof(BAUDS[0]) ? BAUDS[code] : 0;
+}
+
+//Bytes the sketch writes to Serial2: FF AA <register> <value LSB> <value MSB>
+void wt901Command(byte b) {
+    if (Serial2.baud != wt901Model.baud) {
+        return;  //The sensor doesn't understand us at the wrong baud rate
+    }
+
+    byte* command = wt901Model.command;
+    if ((wt901Model.commandLength == 0 && b != 0xFF) || (wt901Model.commandLength == 1 && b != 0xAA)) {
+        wt901Model.commandLength = 0;
+        return;
+    }
+    command[wt901Model.commandLength++] = b;
+    if (wt901Model.commandLength < sizeof(wt901Model.command)) {
+        return;
+    }
+    wt901Model.commandLength = 0;
+
+    uint16_t value = command[3] | (command[4] << 8);
+    switch (command[2]) {
+        case WT901_REG_OUTPUT:
+            wt901Model.output = value;
+            break;
+        case WT901_REG_RATE:
+            wt901Model.rateCode = value;
+            wt901Model.nextUs = simClock.nowUs;
+            break;
+        case WT901_REG_BAUD:
+            if (wt901Baud(value) != 0) {
+                wt901Model.baud = wt901Baud(value);
+            }
+            break;
+    }
+}
+
+void emitLS200() {
+    if (options.canRateHz <= 0) {
+        ls200.nextUs = UINT64_MAX;
+        return;
+    }
+
+    while (ls200.nextUs <= simClock.nowUs) {
+        float counts = FUEL_ZERO_COUNTS + FUEL_COUNTS_PER_DEGREE * fuel.surface + gaussian(FUEL_NOISE_COUNTS);
+        uint16_t level = (uint16_t)constrain(lround(counts), 0L, 65535L);
+
+        SimCANFrame frame = {LS200_CAN_ID, 8, {(byte)(level >> 8), (byte)level,
+                                               (byte)(INTERNAL_TEMP >> 8), (byte)INTERNAL_TEMP,
+                                               (byte)(EXTERNAL_TEMP >> 8), (byte)EXTERNAL_TEMP, 0, 0}};
+        if (CAN.speed == options.canBusSpeed) {
+            CAN.receive(frame);  //At another bit rate the MCP2515 only sees errors
+        }
+        ls200.frames++;
+        
+        //Lines sent while Serial3 is closed or at another baud rate are lost
+        if (Serial3.open && Serial3.baud == LS200_SERIAL_BAUD) {
+            char line[24];
+            snprintf(line, sizeof(line), "%u,%u,%u\r\n", level, INTERNAL_TEMP, EXTERNAL_TEMP);
+            for (const char* c = line; *c; c++) {
+                Serial3.receive(*c);
+            }
+            ls200.lines++;
+        }
+        ls200.nextUs += (uint64_t)(1e6 / options.canRateHz);
+    }
+}
+
+//The sketch is about to go idle, so a run command is accepted rather than refused mid-test
+void sendIdleCommand() {
+    static byte sent = 0;
+    if (sent < options.idleCount) {
+        for (const char* c = options.idleCommands[sent].text; *c; c++) {
+            Serial.receive(*c);
+        }
+        sent++;
+    }
+}
+
+void sendCommands() {
+    static byte sent = 0;
+    while (sent < options.commandCount && simClock.nowUs >= options.commands[sent].timeMs * 1000ULL) {
+        for (const char* c = options.commands[sent].text; *c; c++) {
+            Serial.receive(*c);
+        }
+        sent++;
+    }
+}
+
+//What the sketch sends on each port
+void deliver(byte port, byte b) {
+    switch (port) {
+        case 0:
+            dataByte(b);
+            break;
+        case 1:
+            debugByte(b);
+            break;
+        case 2:
+            wt901Command(b);
+            break;
+    }
+}
+
+//Save the data stream and time its rows
+void dataByte(byte b) {
+    putc(b, dataFile);
+    streams.dataBytes++;
+
+    if (streams.lastByte == 0xA5 && b == 0x5A) {
+        streams.binary = true;
+    }
+    streams.lastByte = b;
+    if (streams.binary) {
+        return;
+    }
+
+    if (b != '\n') {
+        if (b != '\r' && dataLine.length < LINE_SIZE - 1) {
+            dataLine.text[dataLine.length++] = b;
+        }
+        return;
+    }
+    dataLine.text[dataLine.length] = '\0';
+    dataLine.length = 0;
+    if (dataLine.text[0] < '0' || dataLine.text[0] > '9') {
+        return;  //Header
+    }
+
+    unsigned long timeMs = strtoul(dataLine.text, NULL, 10);
+    streams.rows++;
+    if (streams.haveRow && timeMs >= streams.lastTimeMs) {
+        unsigned long interval = timeMs - streams.lastTimeMs;
+        if (streams.intervalCount == 0 || interval < streams.intervalMin) {
+            streams.intervalMin = interval;
+        }
+        if (interval > streams.intervalMax) {
+            streams.intervalMax = interval;
+        }
+        streams.intervalCount++;
+        double delta = interval - streams.intervalMean;
+        streams.intervalMean += delta / streams.intervalCount;
+        streams.intervalM2 += delta * (interval - streams.intervalMean);
+    }
+    streams.lastTimeMs = timeMs;
+    streams.haveRow = true;
+}
+
+void debugByte(byte b) {
+    streams.debugBytes++;
+    if (!options.quiet) {
+        putc(b, stderr);
+    }
+
+    if (b != '\n') {
+        if (b != '\r' && debugLineBuffer.length < LINE_SIZE - 1) {
+            debugLineBuffer.text[debugLineBuffer.length++] = b;
+        }
+        return;
+    }
+    debugLineBuffer.text[debugLineBuffer.length] = '\0';
+    debugLineBuffer.length = 0;
+    debugLine(debugLineBuffer.text);
+}
+
+//Follow the test through the sketch's debug messages
+void debugLine(const char* line) {
+    const char* moving = strstr(line, ": moving to ");
+    if (strncmp(line, "# Step ", 7) == 0 && moving != NULL) {
+        startMove(atof(moving + 12));
+    } else if (strncmp(line, "# Adjusting actuator to achieve 0-degree pitch", 46) == 0 ||
+               strcmp(line, "# Returning to zero pitch position") == 0) {
+        startMove(0.0);
+    } else if (strncmp(line, "# Pitch stabilized at near", 26) == 0) {
+        endMove(true);
+    } else if (strncmp(line, "# Test complete", 15) == 0) {
+        endMove(false);
+        streams.testsCompleted++;
+        if (options.runs > 0 && streams.testsCompleted >= options.runs) {
+            finish("test complete");
+        }
+        sendIdleCommand();
+    }
+}
+
+void startMove(float target) {
+    endMove(false);  //The last one never reached its target
+    if (moveCount == MAX_MOVES) {
+        movesDropped++;
+        return;
+    }
+
+    currentMove = &moves[moveCount++];
+    memset(currentMove, 0, sizeof(Move));
+    currentMove->target = target;
+    currentMove->startPitch = actuator.pitch;
+    currentMove->startUs = simClock.nowUs;
+}
+
+void endMove(bool reached) {
+    if (currentMove == NULL) {
+        return;
+    }
+    currentMove->seconds = (simClock.nowUs - currentMove->startUs) / 1e6;
+    currentMove->error = actuator.pitch - currentMove->target;
+    currentMove->reached = reached;
+    currentMove = NULL;
+}
+
+float gaussian(float sigma) {
+    double u1 = ((nextRandom() >> 11) + 1.0) / 9007199254740993.0;
+    double u2 = (nextRandom() >> 11) / 9007199254740992.0;
+    return sigma * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+//xorshift64*
+uint64_t nextRandom() {
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return randomState * 0x2545F4914F6CDD1DULL;
+}
+
+double wallSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void finish(const char* reason) {
+    fflush(dataFile);
+    if (dataFile != stdout) {
+        fclose(dataFile);
+    }
+    report(reason);
+    exit(0);
+}
+
+void report(const char* reason) {
+    double simSeconds = simClock.nowUs / 1e6;
+    double wall = wallSeconds() - wallStart;
+
+    fprintf(stderr, "\n# Sim: stopped, %s\n", reason);
+    fprintf(stderr, "# Sim: %.1f s simulated in %.2f s, %.0fx real time\n",
+            simSeconds, wall, wall > 0 ? simSeconds / wall : 0.0);
+
+    if (streams.binary) {
+        fprintf(stderr, "# Sim: binary data stream, row timing not measured\n");
+    } else if (streams.intervalCount > 0) {
+        fprintf(stderr, "# Sim: %lu rows, interval ms mean %.3f stddev %.3f min %lu max %lu\n",
+                streams.rows, streams.intervalMean, sqrt(streams.intervalM2 / streams.intervalCount),
+                streams.intervalMin, streams.intervalMax);
+    }
+    fprintf(stderr, "# Sim: data %.1f kB at %.2f kB/s (%.0f%% of %lu baud), debug %.1f kB\n",
+            streams.dataBytes / 1000.0, simSeconds > 0 ? streams.dataBytes / 1000.0 / simSeconds : 0.0,
+            Serial.baud && simSeconds > 0 ? 100.0 * streams.dataBytes * 10 / Serial.baud / simSeconds : 0.0,
+            Serial.baud, streams.debugBytes / 1000.0);
+    fprintf(stderr, "# Sim: WT901 %lu angle packets, %lu bytes lost in the Serial2 RX buffer\n",
+            wt901Model.packets, Serial2.rxOverruns);
+    fprintf(stderr, "# Sim: LS200 %lu frames, %lu lost in the MCP2515, %lu serial lines, %lu bytes lost in the Serial3 RX buffer\n",
+            ls200.frames, CAN.framesLost, ls200.lines, Serial3.rxOverruns);
+    fprintf(stderr, "# Sim: actuator %lu starts, %lu reversals, %.1f s running, final pitch %.3f\n",
+            actuator.starts, actuator.reversals, actuator.runSeconds, actuator.pitch);
+
+    if (moveCount == 0) {
+        return;
+    }
+    fprintf(stderr, "# Sim: move   target  seconds   error  overshoot  reversals\n");
+    unsigned int reached = 0;
+    double totalSeconds = 0;
+    double maxSeconds = 0;
+    float maxError = 0;
+    float maxOvershoot = 0;
+    for (uint16_t i = 0; i < moveCount; i++) {
+        const Move& move = moves[i];
+        if (i < MAX_REPORTED_MOVES) {
+            fprintf(stderr, "# Sim: %4u  %+7.2f  %7.2f  %+6.3f  %9.3f  %9lu%s\n", i + 1, move.target, move.seconds,
+                    move.error, move.overshoot, move.reversals, move.reached ? "" : "  not reached");
+        }
+        if (move.reached) {
+            reached++;
+            totalSeconds += move.seconds;
+            maxSeconds = move.seconds > maxSeconds ? move.seconds : maxSeconds;
+            maxError = fabs(move.error) > maxError ? fabs(move.error) : maxError;
+        }
+        maxOvershoot = move.overshoot > maxOvershoot ? move.overshoot : maxOvershoot;
+    }
+    if (moveCount > MAX_REPORTED_MOVES) {
+        fprintf(stderr, "# Sim: ... %u more moves\n", moveCount - MAX_REPORTED_MOVES);
+    }
+    fprintf(stderr, "# Sim: %u of %u moves reached, settle s mean %.2f max %.2f, max |error| %.3f, max overshoot %.3f\n",
+            reached, moveCount, reached ? totalSeconds / reached : 0.0, maxSeconds, maxError, maxOvershoot);
+    if (movesDropped > 0) {
+        fprintf(stderr, "# Sim: %lu moves not tracked\n", movesDropped);
+    }
+}
+
+//Arduino core
+
+unsigned long millis() {
+    tick(CALL_COST_US);
+    return simClock.nowUs / 1000;
+}
+
+unsigned long micros() {
+    tick(CALL_COST_US);
+    return simClock.nowUs;
+}
+
+void delay(unsigned long ms) {
+    waitUs(ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+    waitUs(us);
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+    tick(PIN_COST_US);
+    if (pin == SIM_MOTOR_IN1) {
+        actuator.in1 = value;
+        updateDrive();
+    } else if (pin == SIM_MOTOR_IN2) {
+        actuator.in2 = value;
+        updateDrive();
+    } else if (pin == SIM_CAN_CS) {
+        canSelected = (value == LOW);
+        spiLength = 0;
+    }
+}
+
+int digitalRead(uint8_t pin) {
+    tick(PIN_COST_US);
+    return LOW;
+}
+
+void analogWrite(uint8_t pin, int value) {
+    tick(PIN_COST_US);
+    if (pin == SIM_MOTOR_ENA) {
+        actuator.duty = constrain(value, 0, 255);
+        updateDrive();
+    }
+}
+
+void attachInterrupt(uint8_t interruptNum, void (*isr)(), int mode) {
+    if (interruptNum < EXTERNAL_NUM_INTERRUPTS) {
+        simClock.isr[interruptNum] = isr;
+    }
+}
+
+void detachInterrupt(uint8_t interruptNum) {
+    if (interruptNum < EXTERNAL_NUM_INTERRUPTS) {
+        simClock.isr[interruptNum] = NULL;
+    }
+}
+
+void noInterrupts() {
+    simClock.interruptsOn = false;
+}
+
+void interrupts() {
+    simClock.interruptsOn = true;
+}
+
+//Print, formatted as the Arduino core does
+
+size_t Print::write(const uint8_t* data, size_t length) {
+    size_t written = 0;
+    while (length--) {
+        written += write(*data++);
+    }
+    return written;
+}
+
+size_t Print::write(const char* text) {
+    return text == NULL ? 0 : write((const uint8_t*)text, strlen(text));
+}
+
+size_t Print::print(const char* text) {
+    return write(text);
+}
+
+size_t Print::print(const __FlashStringHelper* text) {
+    return write(reinterpret_cast<const char*>(text));
+}
+
+size_t Print::print(char c) {
+    return write((uint8_t)c);
+}
+
+size_t Print::print(unsigned char value, int base) {
+    return print((unsigned long)value, base);
+}
+
+size_t Print::print(int value, int base) {
+    return print((long)value, base);
+}
+
+size_t Print::print(unsigned int value, int base) {
+    return print((unsigned long)value, base);
+}
+
+size_t Print::print(long value, int base) {
+    if (base == DEC && value < 0) {
+        return print('-') + printNumber(-(unsigned long)value, DEC);
+    }
+    return printNumber(base == DEC ? value : (uint32_t)value, base);  //32-bit like the AVR
+}
+
+size_t Print::print(unsigned long value, int base) {
+    return printNumber(value, base);
+}
+
+size_t Print::print(double value, int digits) {
+    if (isnan(value)) {
+        return print("nan");
+    }
+    if (isinf(value)) {
+        return print("inf");
+    }
+    if (value > 4294967040.0 || value < -4294967040.0) {
+        return print("ovf");
+    }
+    char text[32];
+    snprintf(text, sizeof(text), "%.*f", digits, value);
+    return print(text);
+}
+
+size_t Print::printNumber(unsigned long value, int base) {
+    char text[8 * sizeof(unsigned long) + 1];
+    char* p = &text[sizeof(text) - 1];
+    *p = '\0';
+    if (base < 2) {
+        base = 10;
+    }
+    do {
+        byte digit = value % base;
+        *--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+        value /= base;
+    } while (value > 0);
+    return write(p);
+}
+
+size_t Print::println() {
+    return write("\r\n");
+}
+
+size_t Print::println(const char* text) {
+    return print(text) + println();
+}
+
+size_t Print::println(const __FlashStringHelper* text) {
+    return print(text) + println();
+}
+
+size_t Print::println(char c) {
+    return print(c) + println();
+}
+
+size_t Print::println(unsigned char value, int base) {
+    return print(value, base) + println();
+}
+
+size_t Print::println(int value, int base) {
+    return print(value, base) + println();
+}
+
+size_t Print::println(unsigned int value, int base) {
+    return print(value, base) + println();
+}
+
+size_t Print::println(long value, int base) {
+    return print(value, base) + println();
+}
+
+size_t Print::println(unsigned long value, int base) {
+    return print(value, base) + println();
+}
+
+size_t Print::println(double value, int digits) {
+    return print(value, digits) + println();
+}
+
+//HardwareSerial
+
+HardwareSerial::HardwareSerial(byte port)
+    : baud(0), open(false), rxOverruns(0), port(port), rxHead(0), rxTail(0), txIdleUs(0) {
+}
+
+void HardwareSerial::begin(unsigned long baud) {
+    this->baud = baud;
+    open = true;
+    rxHead = 0;
+    rxTail = 0;
+    txIdleUs = simClock.nowUs;
+}
+
+void HardwareSerial::end() {
+    flush();
+    open = false;
+}
+
+int HardwareSerial::available() {
+    tick(SERIAL_COST_US);
+    return (rxHead + SERIAL_RX_BUFFER_SIZE - rxTail) % SERIAL_RX_BUFFER_SIZE;
+}
+
+int HardwareSerial::read() {
+    tick(SERIAL_COST_US);
+    if (rxHead == rxTail) {
+        return -1;
+    }
+    byte b = rx[rxTail];
+    rxTail = (rxTail + 1) % SERIAL_RX_BUFFER_SIZE;
+    return b;
+}
+
+int HardwareSerial::peek() {
+    return rxHead == rxTail ? -1 : rx[rxTail];
+}
+
+int HardwareSerial::availableForWrite() {
+    tick(SERIAL_COST_US);
+    return SERIAL_TX_BUFFER_SIZE - 1 - txPending();
+}
+
+//Block until the TX buffer has gone out
+void HardwareSerial::flush() {
+    if (txIdleUs > simClock.nowUs) {
+        waitUs((unsigned long)ceil(txIdleUs - simClock.nowUs));
+    }
+}
+
+//Queue a byte, blocking while the TX buffer is full like the real core
+size_t HardwareSerial::write(uint8_t b) {
+    tick(SERIAL_COST_US);
+    if (!open) {
+        return 0;
+    }
+
+    double byteUs = 10e6 / baud;
+    int pending = txPending();
+    if (pending >= SERIAL_TX_BUFFER_SIZE - 1) {
+        waitUs((unsigned long)ceil(txIdleUs - simClock.nowUs - (SERIAL_TX_BUFFER_SIZE - 2) * byteUs));
+    }
+    txIdleUs = (txIdleUs > simClock.nowUs ? txIdleUs : simClock.nowUs) + byteUs;
+    deliver(port, b);
+    return 1;
+}
+
+void HardwareSerial::receive(byte b) {
+    uint16_t next = (rxHead + 1) % SERIAL_RX_BUFFER_SIZE;
+    if (next == rxTail) {
+        rxOverruns++;
+        return;
+    }
+    rx[rxHead] = b;
+    rxHead = next;
+}
+
+int HardwareSerial::txPending() {
+    if (txIdleUs <= simClock.nowUs) {
+        return 0;
+    }
+    return (int)ceil((txIdleUs - simClock.nowUs) * baud / 10e6);
+}
+
+//MCP2515
+
+MCP_CAN::MCP_CAN(byte cs) : eflg(0), framesLost(0), speed(0), cs(cs), rxCount(0) {
+}
+
+byte MCP_CAN::begin(byte idMode, byte speed, byte clock) {
+    spend(1000);
+    this->speed = speed;
+    rxCount = 0;
+    eflg = 0;
+    return CAN_OK;
+}
+
+byte MCP_CAN::setMode(byte mode) {
+    spend(SPI_COST_US);
+    return CAN_OK;
+}
+
+byte MCP_CAN::init_Mask(byte num, byte ext, unsigned long mask) {
+    spend(SPI_COST_US);
+    return CAN_OK;
+}
+
+byte MCP_CAN::init_Filt(byte num, byte ext, unsigned long filter) {
+    spend(SPI_COST_US);
+    return CAN_OK;
+}
+
+byte MCP_CAN::checkReceive() {
+    spend(SPI_COST_US);
+    return rxCount > 0 ? CAN_MSGAVAIL : CAN_NOMSG;
+}
+
+byte MCP_CAN::readMsgBuf(unsigned long* id, byte* len, byte* data) {
+    spend(SPI_FRAME_COST_US);
+    if (rxCount == 0) {
+        return CAN_NOMSG;
+    }
+
+    *id = rx[0].id;
+    *len = rx[0].len;
+    memcpy(data, rx[0].data, rx[0].len);
+    rx[0] = rx[1];
+    rxCount--;
+    return CAN_OK;
+}
+
+byte MCP_CAN::checkError() {
+    spend(SPI_COST_US);
+    return eflg ? CAN_CTRLERROR : CAN_OK;
+}
+
+byte MCP_CAN::getError() {
+    spend(SPI_COST_US);
+    return eflg;
+}
+
+//With both RX buffers full the frame is lost and RX1OVR set (rollover from RXB0 is enabled)
+void MCP_CAN::receive(const SimCANFrame& frame) {
+    if (rxCount == MCP_RX_BUFFERS) {
+        eflg |= MCP_EFLG_RX1OVR;
+        framesLost++;
+        return;
+    }
+    rx[rxCount++] = frame;
+}
+
+bool MCP_CAN::interruptPending() {
+    return rxCount > 0;
+}
+
+//SPI, only the MCP2515 BIT MODIFY instruction (05 <address> <mask> <data>) on EFLG is modelled
+
+void SPIClass::beginTransaction(SPISettings settings) {
+    simClock.spiMasked = true;
+}
+
+void SPIClass::endTransaction() {
+    simClock.spiMasked = false;
+}
+
+byte SPIClass::transfer(byte data) {
+    spend(1);
+    if (!canSelected || spiLength == sizeof(spiBytes)) {
+        return 0;
+    }
+
+    spiBytes[spiLength++] = data;
+    if (spiLength == sizeof(spiBytes) && spiBytes[0] == 0x05 && spiBytes[1] == 0x2D) {
+        CAN.eflg = (CAN.eflg & ~spiBytes[2]) | (spiBytes[3] & spiBytes[2]);
+    }
+    return 0;
+}
@@ -0,0 +1,755 @@
+# Decoding shared by capture_serial.py, postprocess.py and plotter.py for the firmware's binary records, SD logs
+# and indexed captures
+import binascii
+import mmap
+import os
+import struct
+import sys
+from array import array
+from contextlib import contextmanager
+
+try:
+    import numpy as np
+except ImportError:  # Only reading indexed captures needs it
+    np = None
+
+CSV_HEADER = ("TimeMS,FuelLevel,InternalTemp,ExternalTemp,Pitch,Phase,MovementDirection,"
+              "PitchAgeMS,PitchFresh,CANAgeMS,CANFresh,SerialFuelLevel,SerialAgeMS")
+
+# Burst samples captured around motion arrive as "B," lines and are kept in a separate file
+BURST_PREFIX = "B,"
+BURST_HEADER = "BurstId,TimeMS,Source,Pitch,FuelLevel"
+# Each burst's samples follow this line, which counts the samples lost off the start of the burst
+BURST_INFO_PREFIX = "# Burst:"
+
+# Binary framing, must match FuelTableCAN-Serial.cpp
+FRAME_SYNC = b'\xa5\x5a'
+FRAME_TYPE_SAMPLE = 0x01
+FRAME_TYPE_LABEL = 0x02
+FRAME_TYPE_DROPS = 0x03
+FRAME_TYPE_BURST = 0x04
+FRAME_TYPE_BENCH = 0x05
+FRAME_TYPE_PHASE = 0x06
+FRAME_TYPE_PHASE_VALUE = 0x07
+FRAME_TYPE_BURST_HEADER = 0x08
+SAMPLE_FLAG_CAN_DATA = 0x01
+SAMPLE_FLAG_PITCH_VALID = 0x04
+SAMPLE_FLAG_PITCH_FRESH = 0x08
+SAMPLE_FLAG_CAN_FRESH = 0x10
+SAMPLE_FLAG_SERIAL_DATA = 0x20
+BURST_FLAG_PITCH = 0x01
+BURST_FLAG_CAN_VALID = 0x04
+
+# SampleRecord: sequence, timeMs, fuelLevel, internalTemp, externalTemp, pitchCenti, phaseId, directionId, flags,
+# pitchAgeMs, canAgeMs, serialFuelLevel, serialAgeMs. Version 1 logs and older firmware end at pitchAgeMs,
+# versions 2 and 3 at canAgeMs.
+SAMPLE_RECORD = struct.Struct('<HIHHHhBBBHHHH')
+SAMPLE_RECORD_V2 = struct.Struct('<HIHHHhBBBHH')
+SAMPLE_RECORD_V1 = struct.Struct('<HIHHHhBBBH')
+
+# DropReport: records dropped by the firmware's Serial and Serial1 output queues
+DROP_REPORT = struct.Struct('<II')
+
+# BurstRecord: burstId, timeMs, pitchCenti, fuelLevel, flags
+BURST_RECORD = struct.Struct('<HIhHB')
+# BurstHeaderRecord: burstId, startMs, samples, lost
+BURST_HEADER_RECORD = struct.Struct('<HIHI')
+
+# BenchReport: the result of a bench command, printed as a "# Bench:" line
+BENCH_PREFIX = "# Bench:"
+BENCH_REPORT = struct.Struct('<IHIIHHHIHIII')
+BENCH_FIELDS = ('ms', 'rate', 'baud', 'rows', 'dropped', 'missed', 'late_max_us', 'can_frames',
+                'can_lost', 'latency_min_us', 'latency_mean_us', 'latency_max_us')
+
+# Phase summaries, sent at the end of each phase as these lines in CSV mode
+PHASE_SUMMARY_PREFIX = "# Phase summary:"
+PHASE_VALUE_PREFIX = "# Phase value:"
+# PhaseSummaryRecord: phaseId, startMs, durationMs, rows, settleMs
+PHASE_SUMMARY_RECORD = struct.Struct('<BIIII')
+# PhaseValueRecord: phaseId, value, count, mean, min, max, stdDev. Mean and stdDev in hundredths of min and max.
+PHASE_VALUE_RECORD = struct.Struct('<BBIiiiI')
+PHASE_VALUES = ("FuelLevel", "InternalTemp", "ExternalTemp", "Pitch")
+PHASE_VALUE_DECIMALS = (0, 0, 0, 2)  # Of min and max, as the CSV columns
+SETTLE_NOT_SEEN = 0xFFFFFFFF
+
+# SD log layout, must match LogHeader, LogSectorHeader and LogIndexEntry in FuelTableCAN-Serial.cpp
+LOG_MAGIC = 0x474C5446
+LOG_SECTOR_MAGIC = 0x43455346
+LOG_HEADER = struct.Struct('<IHHHI16sBIIH')
+LOG_STEP = struct.Struct('<hhI')  # Target and tolerance in centidegrees, from version 3
+LOG_STEP_FLOAT = struct.Struct('<ffI')  # Degrees, versions 1 and 2
+LOG_SECTOR_HEADER = struct.Struct('<IIIB')
+LOG_INDEX_ENTRY = struct.Struct('<II')
+
+EXTERNAL_TEMP_STATUS = {
+    0xFFFF: "Disabled",
+    0x8001: "Open Circuit",
+    0x8002: "Short Circuit",
+}
+
+
+def format_fixed(value, decimals):
+    """An integer counting in units of the last of decimals digits, printed as the firmware's printFixed()."""
+    if decimals == 0:
+        return str(value)
+    sign = '-' if value < 0 else ''
+    whole, fraction = divmod(abs(value), 10 ** decimals)
+    return f"{sign}{whole}.{fraction:0{decimals}d}"
+
+
+def parse_phase_line(line):
+    """Fields of a "# Phase summary:" or "# Phase value:" line as a dict, None for other lines."""
+    for prefix in (PHASE_SUMMARY_PREFIX, PHASE_VALUE_PREFIX):
+        if line.startswith(prefix):
+            return dict(item.partition('=')[::2] for item in line[len(prefix):].split())
+    return None
+
+
+class BinaryDecoder:
+    """
+    Incremental decoder for the firmware's framed binary records.
+    Feed it raw bytes as they arrive; it yields CSV lines in the same
+    column layout the firmware prints in CSV mode.
+    """
+
+    def __init__(self):
+        self.buffer = bytearray()
+        self.labels = {}
+        self.last_sequence = None
+        self.records = 0
+        self.lost_records = 0
+        self.crc_errors = 0
+        self.device_dropped = 0
+
+    def feed(self, data):
+        self.buffer.extend(data)
+        while True:
+            start = self.buffer.find(FRAME_SYNC)
+            if start < 0:
+                # Keep a trailing sync byte in case the pair is split across reads
+                del self.buffer[:max(0, len(self.buffer) - 1)]
+                return
+            del self.buffer[:start]
+
+            if len(self.buffer) < 4:
+                return
+            frame_type = self.buffer[2]
+            length = self.buffer[3]
+            if len(self.buffer) < 6 + length:
+                return
+
+            body = bytes(self.buffer[2:4 + length])
+            crc = self.buffer[4 + length] | (self.buffer[5 + length] << 8)
+            if binascii.crc_hqx(body, 0xFFFF) != crc:
+                # Bad frame or false sync, resynchronize from the next byte
+                self.crc_errors += 1
+                del self.buffer[:1]
+                continue
+            del self.buffer[:6 + length]
+
+            line = self.handle_frame(frame_type, body[2:])
+            if line is not None:
+                yield line
+
+    def handle_frame(self, frame_type, payload):
+        if frame_type == FRAME_TYPE_LABEL and len(payload) >= 1:
+            self.labels[payload[0]] = payload[1:].decode('ascii', errors='replace')
+            return None
+
+        if frame_type == FRAME_TYPE_DROPS and len(payload) == DROP_REPORT.size:
+            data_dropped, debug_dropped = DROP_REPORT.unpack(payload)
+            self.device_dropped = data_dropped
+            # Same comment line the firmware sends in CSV mode
+            return f"# Dropped records: data={data_dropped} debug={debug_dropped}"
+
+        if frame_type == FRAME_TYPE_BENCH and len(payload) == BENCH_REPORT.size:
+            # Same line the firmware sends in CSV mode, which also names the format
+            values = dict(zip(BENCH_FIELDS, BENCH_REPORT.unpack(payload)))
+            fields = [f"{name}={values[name]}" for name in BENCH_FIELDS[:3]]
+            fields.append("format=binary")
+            fields += [f"{name}={values[name]}" for name in BENCH_FIELDS[3:]]
+            return f"{BENCH_PREFIX} {' '.join(fields)}"
+
+        if frame_type == FRAME_TYPE_PHASE and len(payload) == PHASE_SUMMARY_RECORD.size:
+            phase_id, start_ms, duration_ms, rows, settle_ms = PHASE_SUMMARY_RECORD.unpack(payload)
+            settle = '-' if settle_ms == SETTLE_NOT_SEEN else settle_ms
+            # Same line the firmware sends in CSV mode
+            return (f"{PHASE_SUMMARY_PREFIX} phase={self.labels.get(phase_id, 'Unknown')} start_ms={start_ms} "
+                    f"ms={duration_ms} rows={rows} settle_ms={settle}")
+
+        if frame_type == FRAME_TYPE_PHASE_VALUE and len(payload) == PHASE_VALUE_RECORD.size:
+            phase_id, value, count, mean, low, high, sd = PHASE_VALUE_RECORD.unpack(payload)
+            if value >= len(PHASE_VALUES):
+                return None
+            decimals = PHASE_VALUE_DECIMALS[value]
+            return (f"{PHASE_VALUE_PREFIX} phase={self.labels.get(phase_id, 'Unknown')} value={PHASE_VALUES[value]} "
+                    f"n={count} mean={format_fixed(mean, decimals + 2)} min={format_fixed(low, decimals)} "
+                    f"max={format_fixed(high, decimals)} sd={format_fixed(sd, decimals + 2)}")
+
+        if frame_type == FRAME_TYPE_BURST_HEADER and len(payload) == BURST_HEADER_RECORD.size:
+            burst_id, start_ms, samples, lost = BURST_HEADER_RECORD.unpack(payload)
+            # Same line the firmware sends in CSV mode
+            return f"{BURST_INFO_PREFIX} id={burst_id} start_ms={start_ms} samples={samples} lost={lost}"
+
+        if frame_type == FRAME_TYPE_BURST and len(payload) == BURST_RECORD.size:
+            burst_id, time_ms, pitch_centi, fuel_level, flags = BURST_RECORD.unpack(payload)
+            source = "Pitch" if flags & BURST_FLAG_PITCH else "CAN"
+            fuel = str(fuel_level) if flags & BURST_FLAG_CAN_VALID else "No Data"
+            # Same line the firmware sends in CSV mode
+            return f"{BURST_PREFIX}{burst_id},{time_ms},{source},{pitch_centi / 100:.2f},{fuel}"
+
+        if frame_type != FRAME_TYPE_SAMPLE:
+            return None
+        serial_fuel_level = serial_age_ms = None
+        if len(payload) == SAMPLE_RECORD.size:
+            (sequence, time_ms, fuel_level, internal_temp, external_temp, pitch_centi, phase_id, direction_id,
+             flags, pitch_age_ms, can_age_ms, serial_fuel_level, serial_age_ms) = SAMPLE_RECORD.unpack(payload)
+        elif len(payload) == SAMPLE_RECORD_V2.size:
+            (sequence, time_ms, fuel_level, internal_temp, external_temp,
+             pitch_centi, phase_id, direction_id, flags, pitch_age_ms, can_age_ms) = SAMPLE_RECORD_V2.unpack(payload)
+        elif len(payload) == SAMPLE_RECORD_V1.size:
+            (sequence, time_ms, fuel_level, internal_temp, external_temp,
+             pitch_centi, phase_id, direction_id, flags, pitch_age_ms) = SAMPLE_RECORD_V1.unpack(payload)
+            can_age_ms = None
+        else:
+            return None
+
+        if self.last_sequence is not None:
+            self.lost_records += (sequence - self.last_sequence - 1) & 0xFFFF
+        self.last_sequence = sequence
+        self.records += 1
+
+        if flags & SAMPLE_FLAG_CAN_DATA:
+            fuel = str(fuel_level)
+            internal = str(internal_temp)
+            external = EXTERNAL_TEMP_STATUS.get(external_temp, str(external_temp))
+            can_age = "No Data" if can_age_ms is None else str(can_age_ms)
+        else:
+            fuel = internal = external = can_age = "No Data"
+
+        if flags & SAMPLE_FLAG_PITCH_VALID:
+            pitch = f"{pitch_centi / 100:.2f}"
+            age = str(pitch_age_ms)
+        else:
+            pitch = age = "No Data"
+        fresh = 1 if flags & SAMPLE_FLAG_PITCH_FRESH else 0
+        can_fresh = 1 if flags & SAMPLE_FLAG_CAN_FRESH else 0
+        if serial_fuel_level is not None and flags & SAMPLE_FLAG_SERIAL_DATA:
+            serial_fuel, serial_age = str(serial_fuel_level), str(serial_age_ms)
+        else:
+            serial_fuel = serial_age = "No Data"
+
+        phase = self.labels.get(phase_id, "Unknown")
+        direction = self.labels.get(direction_id, "Unknown")
+        return (f"{time_ms},{fuel},{internal},{external},{pitch},{phase},{direction},{age},{fresh},{can_age},{can_fresh},"
+                f"{serial_fuel},{serial_age}")
+
+
+def read_log_header(file):
+    """
+    Read the header sector of an SD log. Returns a dict with the sample interval,
+    the profile name and steps, and the data and index sector counts.
+    """
+    data = file.read(LOG_HEADER.size)
+    if len(data) < LOG_HEADER.size:
+        raise ValueError("Log file is too short")
+
+    (magic, version, sector_size, record_size, sample_interval_us, profile_name,
+     step_count, data_sectors, index_sector, index_count) = LOG_HEADER.unpack(data)
+    if magic != LOG_MAGIC:
+        raise ValueError("Not a FuelTable log file")
+
+    # Step targets and tolerances are returned in degrees
+    step_format, scale = (LOG_STEP, 100) if version >= 3 else (LOG_STEP_FLOAT, 1)
+    steps = []
+    for _ in range(step_count):
+        target, tolerance, dwell_ms = step_format.unpack(file.read(step_format.size))
+        steps.append({'target': target / scale, 'tolerance': tolerance / scale, 'dwell_ms': dwell_ms})
+
+    return {
+        'version': version,
+        'sector_size': sector_size,
+        'record_size': record_size,
+        'sample_interval_us': sample_interval_us,
+        'profile': profile_name.rstrip(b'\0').decode('ascii', errors='replace'),
+        'steps': steps,
+        'data_sectors': data_sectors,
+        'index_sector': index_sector,
+        'index_count': index_count,
+    }
+
+
+def read_log_index(file, header):
+    """Return (sector, time_ms) for every indexed phase start, empty if the log was never closed."""
+    if header['index_count'] == 0:
+        return []
+    file.seek(header['index_sector'] * header['sector_size'])
+    data = file.read(header['index_count'] * LOG_INDEX_ENTRY.size)
+    return list(LOG_INDEX_ENTRY.iter_unpack(data))
+
+
+def read_log(file, header, decoder, first_sector=1):
+    """
+    Yield CSV lines for the records in an SD log, from first_sector onwards.
+    first_sector should be 1 or an indexed sector, which start with the labels they need.
+    A log that was never closed is read until the first sector that isn't part of it.
+    """
+    sector_size = header['sector_size']
+    record_size = header['record_size']
+    last_sector = header['data_sectors'] if header['data_sectors'] else None
+
+    sector_number = first_sector
+    file.seek(sector_number * sector_size)
+    while last_sector is None or sector_number <= last_sector:
+        sector = file.read(sector_size)
+        if len(sector) < sector_size:
+            break
+        magic, number, first_time_ms, record_count = LOG_SECTOR_HEADER.unpack_from(sector)
+        if magic != LOG_SECTOR_MAGIC or number != sector_number:
+            break
+
+        for slot in range(1, record_count + 1):
+            offset = slot * record_size
+            frame_type = sector[offset]
+            length = sector[offset + 1]
+            line = decoder.handle_frame(frame_type, sector[offset + 2:offset + 2 + length])
+            if line is not None:
+                yield line
+        sector_number += 1
+
+
+class BurstWriter:
+    """
+    Writes burst lines to their own CSV file next to the main capture,
+    created with its header when the first burst line arrives.
+    """
+
+    def __init__(self, filename):
+        self.filename = f"{os.path.splitext(filename)[0]}_burst.csv"
+        self.file = None
+        self.samples = 0
+
+    def write(self, line):
+        if self.file is None:
+            self.file = open(self.filename, 'w')
+            self.file.write(BURST_HEADER + '\n')
+        self.file.write(line[len(BURST_PREFIX):] + '\n')
+        self.samples += 1
+
+    def flush(self):
+        if self.file is not None:
+            self.file.flush()
+
+    def close(self):
+        if self.file is not None:
+            self.file.close()
+
+
+# Indexed capture (.ftc), written by capture_serial.py with INDEXED_MODE and read by postprocess.py
+# and plotter.py. CAPTURE_HEADER and a CAPTURE_COLUMN per column, then chunks. Each chunk is a
+# CAPTURE_CHUNK header and a payload padded to 8 bytes:
+#   'L' label text, its index in the label field. Phase and MovementDirection are stored as label indices.
+#   'R' rows of one phase, label the phase and count the rows. The payload holds each of
+#       CAPTURE_COLUMNS as a little-endian array, each array padded to 8 bytes, so it can be used
+#       straight from a memory map.
+#   'C' a comment or other line that isn't a row, count the number of rows captured before it.
+# A closed capture ends with an index: CAPTURE_INDEX, a CAPTURE_ENTRY per chunk, a CAPTURE_WINDOW
+# per run of chunks of one phase, then CAPTURE_TRAILER giving the index offset. A capture that
+# was never closed is read by scanning the chunk headers instead.
+CAPTURE_MAGIC = b'FTCP'
+CAPTURE_VERSION = 1
+CAPTURE_CHUNK_MAGIC = b'FCHK'
+CAPTURE_INDEX_MAGIC = b'FTIX'
+CAPTURE_TRAILER_MAGIC = b'FTIE'
+CAPTURE_CHUNK_ROWS = 1024  # Rows per chunk, a phase change also starts a new one
+CAPTURE_NO_DATA = -0x80000000  # "No Data" in a signed column
+CAPTURE_HEADER = struct.Struct('<4sHHI')  # magic, version, column count, chunk rows
+CAPTURE_COLUMN = struct.Struct('<16sc')  # name, struct type code
+CAPTURE_CHUNK = struct.Struct('<4scxHII')  # magic, kind, label, count, payload length
+CAPTURE_INDEX = struct.Struct('<4sII')  # magic, chunk count, window count
+CAPTURE_ENTRY = struct.Struct('<QcxHIQII')  # offset, kind, label, count, first_row, first_ms, last_ms
+CAPTURE_WINDOW = struct.Struct('<HxxIIQIIIQQ')  # phase, first chunk, chunks, first_row, rows, start_ms,
+                                                # end_ms, offset, end offset
+CAPTURE_TRAILER = struct.Struct('<Q4s')  # index offset, magic
+
+# The CSV columns but Phase, which is per chunk. Pitch is in centidegrees, ExternalTemp keeps the
+# raw status codes and FreshFlags are 0 or 1.
+CAPTURE_COLUMNS = (
+    ('TimeMS', 'I'),
+    ('FuelLevel', 'i'),
+    ('InternalTemp', 'i'),
+    ('ExternalTemp', 'i'),
+    ('Pitch', 'i'),
+    ('MovementDirection', 'H'),
+    ('PitchAgeMS', 'i'),
+    ('PitchFresh', 'b'),
+    ('CANAgeMS', 'i'),
+    ('CANFresh', 'b'),
+    ('SerialFuelLevel', 'i'),
+    ('SerialAgeMS', 'i'),
+)
+CAPTURE_ARRAY_TYPES = {'I': '<u4', 'i': '<i4', 'H': '<u2', 'b': 'i1'}
+EXTERNAL_TEMP_CODES = {text: code for code, text in EXTERNAL_TEMP_STATUS.items()}
+
+
+def is_indexed_capture(filename):
+    return filename.lower().endswith('.ftc')
+
+
+def padded(length):
+    return -(-length // 8) * 8
+
+
+def parse_count(text):
+    return CAPTURE_NO_DATA if text == "No Data" else int(text)
+
+
+def parse_capture_row(line):
+    """(phase, values in CAPTURE_COLUMNS order) of a data row, None for anything else."""
+    fields = line.split(',')
+    if len(fields) < 11 or not fields[0].isdigit():
+        return None
+    fields += ["No Data"] * (13 - len(fields))  # Captures from before the serial columns
+    try:
+        pitch = CAPTURE_NO_DATA if fields[4] == "No Data" else round(float(fields[4]) * 100)
+        external = EXTERNAL_TEMP_CODES.get(fields[3])
+        values = [int(fields[0]), parse_count(fields[1]), parse_count(fields[2]),
+                  parse_count(fields[3]) if external is None else external, pitch, fields[6],
+                  parse_count(fields[7]), int(fields[8]), parse_count(fields[9]), int(fields[10]),
+                  parse_count(fields[11]), parse_count(fields[12])]
+    except ValueError:
+        return None
+    return fields[5], values
+
+
+def format_count(value):
+    return "No Data" if value == CAPTURE_NO_DATA else str(value)
+
+
+def format_capture_row(phase, direction, values):
+    """The CSV line the firmware sent for a row, from its values in CAPTURE_COLUMNS order."""
+    (time_ms, fuel, internal, external, pitch, _, pitch_age, pitch_fresh, can_age, can_fresh,
+     serial_fuel, serial_age) = values
+    external = "No Data" if external == CAPTURE_NO_DATA else EXTERNAL_TEMP_STATUS.get(external, str(external))
+    pitch = "No Data" if pitch == CAPTURE_NO_DATA else f"{pitch / 100:.2f}"
+    return (f"{time_ms},{format_count(fuel)},{format_count(internal)},{external},{pitch},{phase},{direction},"
+            f"{format_count(pitch_age)},{pitch_fresh},{format_count(can_age)},{can_fresh},"
+            f"{format_count(serial_fuel)},{format_count(serial_age)}")
+
+
+def chunk_payload_size(rows):
+    return sum(padded(rows * struct.calcsize(code)) for _, code in CAPTURE_COLUMNS)
+
+
+def capture_windows(entries):
+    """
+    Runs of row chunks of one phase, from the chunk entries in file order. chunks counts
+    from first_chunk to the run's last row chunk, including labels and comments in between.
+    """
+    windows = []
+    for number, (offset, kind, label, count, first_row, first_ms, last_ms) in enumerate(entries):
+        if kind != b'R':
+            continue
+        end = offset + CAPTURE_CHUNK.size + chunk_payload_size(count)
+        if windows and windows[-1]['label'] == label:
+            window = windows[-1]
+            window['chunks'] = number - window['first_chunk'] + 1
+            window['rows'] += count
+            window['end_ms'] = last_ms
+            window['end_offset'] = end
+        else:
+            windows.append({'label': label, 'first_chunk': number, 'chunks': 1, 'first_row': first_row,
+                            'rows': count, 'start_ms': first_ms, 'end_ms': last_ms, 'offset': offset,
+                            'end_offset': end})
+    return windows
+
+
+class IndexedCaptureWriter:
+    """
+    Writes captured lines as an indexed capture. Rows are held until a chunk is full or the
+    phase changes, comments and labels are written as they arrive. Used like the CSV file.
+    """
+
+    def __init__(self, filename, chunk_rows=CAPTURE_CHUNK_ROWS):
+        self.file = open(filename, 'wb')
+        self.chunk_rows = chunk_rows
+        self.labels = {}
+        self.entries = []
+        self.rows = 0  # Rows already in chunks
+        self.phase = None
+        self.last_ms = 0
+        self.pending = [array(code) for _, code in CAPTURE_COLUMNS]
+
+        header = CAPTURE_HEADER.pack(CAPTURE_MAGIC, CAPTURE_VERSION, len(CAPTURE_COLUMNS), chunk_rows)
+        for name, code in CAPTURE_COLUMNS:
+            header += CAPTURE_COLUMN.pack(name.encode(), code.encode())
+        self.file.write(header + bytes(padded(len(header)) - len(header)))
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def write(self, text):
+        for line in text.splitlines():
+            self.add_line(line.strip())
+
+    def add_line(self, line):
+        if not line or line.startswith('TimeMS'):
+            return
+        row = parse_capture_row(line)
+        if row is None:
+            row = self.rows + len(self.pending[0])
+            self.write_chunk(b'C', 0, row, row, line.encode('utf-8'), self.last_ms, self.last_ms)
+            return
+
+        phase, values = row
+        phase = self.label(phase)
+        if phase != self.phase or len(self.pending[0]) >= self.chunk_rows:
+            self.write_rows()
+            self.phase = phase
+        values[5] = self.label(values[5])
+        for column, value in zip(self.pending, values):
+            column.append(value)
+        self.last_ms = values[0]
+
+    def label(self, text):
+        index = self.labels.get(text)
+        if index is None:
+            index = self.labels[text] = len(self.labels)
+            self.write_chunk(b'L', index, 0, 0, text.encode('utf-8'), 0, 0)
+        return index
+
+    def write_rows(self):
+        count = len(self.pending[0])
+        if count == 0:
+            return
+        first_ms, last_ms = self.pending[0][0], self.pending[0][-1]
+        payload = bytearray()
+        for column in self.pending:
+            if sys.byteorder == 'big':
+                column.byteswap()
+            data = column.tobytes()
+            payload += data + bytes(padded(len(data)) - len(data))
+        self.write_chunk(b'R', self.phase, count, self.rows, payload, first_ms, last_ms)
+        self.rows += count
+        self.pending = [array(code) for _, code in CAPTURE_COLUMNS]
+
+    def write_chunk(self, kind, label, count, first_row, payload, first_ms, last_ms):
+        offset = self.file.tell()
+        self.file.write(CAPTURE_CHUNK.pack(CAPTURE_CHUNK_MAGIC, kind, label, count, len(payload)))
+        self.file.write(payload + bytes(padded(len(payload)) - len(payload)))
+        self.entries.append((offset, kind, label, count, first_row, first_ms, last_ms))
+
+    def flush(self):
+        self.file.flush()  # Rows still pending are written with their chunk
+
+    def close(self):
+        if self.file.closed:
+            return
+        self.write_rows()
+        windows = capture_windows(self.entries)
+        offset = self.file.tell()
+        self.file.write(CAPTURE_INDEX.pack(CAPTURE_INDEX_MAGIC, len(self.entries), len(windows)))
+        for entry in self.entries:
+            self.file.write(CAPTURE_ENTRY.pack(*entry))
+        for w in windows:
+            self.file.write(CAPTURE_WINDOW.pack(w['label'], w['first_chunk'], w['chunks'], w['first_row'], w['rows'],
+                                                w['start_ms'], w['end_ms'], w['offset'], w['end_offset']))
+        self.file.write(CAPTURE_TRAILER.pack(offset, CAPTURE_TRAILER_MAGIC))
+        self.file.close()
+
+
+class IndexedCapture:
+    """
+    An indexed capture, memory mapped. windows lists each run of a phase with its rows, times
+    and file offsets, from the index of a closed capture or by scanning one that wasn't.
+    columns() and lines() read only the chunks of the windows asked for.
+    """
+
+    def __init__(self, filename):
+        self.file = open(filename, 'rb')
+        self.map = mmap.mmap(self.file.fileno(), 0, access=mmap.ACCESS_READ)
+        magic, version, column_count, self.chunk_rows = CAPTURE_HEADER.unpack_from(self.map)
+        if magic != CAPTURE_MAGIC:
+            raise ValueError("Not an indexed FuelTable capture")
+        if version > CAPTURE_VERSION:
+            raise ValueError(f"Indexed capture version {version} is newer than this reader")
+        self.data_start = padded(CAPTURE_HEADER.size + column_count * CAPTURE_COLUMN.size)
+
+        index = self.read_index()
+        self.indexed = index is not None
+        if self.indexed:
+            self.entries, self.windows = index
+        else:
+            self.entries = self.scan_chunks()
+            self.windows = capture_windows(self.entries)
+        self.labels = {}
+        for offset, kind, label, _, _, _, _ in self.entries:
+            if kind == b'L':
+                self.labels[label] = self.payload(offset).decode('utf-8', errors='replace')
+        for window in self.windows:
+            window['phase'] = self.labels.get(window['label'], "Unknown")
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def close(self):
+        self.map.close()
+        self.file.close()
+
+    def read_index(self):
+        """Chunk entries and windows from the index, None if the capture was never closed."""
+        if len(self.map) < self.data_start + CAPTURE_TRAILER.size:
+            return None
+        offset, magic = CAPTURE_TRAILER.unpack_from(self.map, len(self.map) - CAPTURE_TRAILER.size)
+        if magic != CAPTURE_TRAILER_MAGIC or offset + CAPTURE_INDEX.size > len(self.map):
+            return None
+        magic, chunk_count, window_count = CAPTURE_INDEX.unpack_from(self.map, offset)
+        if magic != CAPTURE_INDEX_MAGIC:
+            return None
+        start = offset + CAPTURE_INDEX.size
+        entries = list(CAPTURE_ENTRY.iter_unpack(self.map[start:start + chunk_count * CAPTURE_ENTRY.size]))
+        start += chunk_count * CAPTURE_ENTRY.size
+        names = ('label', 'first_chunk', 'chunks', 'first_row', 'rows', 'start_ms', 'end_ms', 'offset', 'end_offset')
+        windows = [dict(zip(names, values)) for values in
+                   CAPTURE_WINDOW.iter_unpack(self.map[start:start + window_count * CAPTURE_WINDOW.size])]
+        return entries, windows
+
+    def scan_chunks(self):
+        """Chunk entries from the chunk headers, up to the first incomplete chunk."""
+        entries = []
+        rows = 0
+        last_ms = 0
+        offset = self.data_start
+        while offset + CAPTURE_CHUNK.size <= len(self.map):
+            magic, kind, label, count, length = CAPTURE_CHUNK.unpack_from(self.map, offset)
+            end = offset + CAPTURE_CHUNK.size + padded(length)
+            if magic != CAPTURE_CHUNK_MAGIC or end > len(self.map):
+                break
+            if kind == b'R':
+                first_ms = struct.unpack_from('<I', self.map, offset + CAPTURE_CHUNK.size)[0]
+                last_ms = struct.unpack_from('<I', self.map, offset + CAPTURE_CHUNK.size + 4 * (count - 1))[0]
+                entries.append((offset, kind, label, count, rows, first_ms, last_ms))
+                rows += count
+            else:
+                time_ms = last_ms if kind == b'C' else 0
+                entries.append((offset, kind, label, count, count if kind == b'C' else 0, time_ms, time_ms))
+            offset = end
+        return entries
+
+    def payload(self, offset):
+        _, _, _, _, length = CAPTURE_CHUNK.unpack_from(self.map, offset)
+        start = offset + CAPTURE_CHUNK.size
+        return self.map[start:start + length]
+
+    def select(self, phases=None):
+        """Windows of the named phases, every window without names."""
+        return [w for w in self.windows if phases is None or w['phase'] in phases]
+
+    def row_chunks(self, windows=None):
+        """Row chunk entries of the windows, in file order."""
+        windows = self.windows if windows is None else windows
+        for window in windows:
+            for entry in self.entries[window['first_chunk']:window['first_chunk'] + window['chunks']]:
+                if entry[1] == b'R':
+                    yield entry
+
+    def chunk_columns(self, entry):
+        """Each column of one row chunk as a numpy array over the memory map."""
+        offset, _, _, count, _, _, _ = entry
+        position = offset + CAPTURE_CHUNK.size
+        columns = {}
+        for name, code in CAPTURE_COLUMNS:
+            dtype = np.dtype(CAPTURE_ARRAY_TYPES[code])
+            columns[name] = np.frombuffer(self.map, dtype=dtype, count=count, offset=position)
+            position += padded(count * dtype.itemsize)
+        return columns
+
+    def chunk_values(self, entry):
+        """Each column of one row chunk as a list, without numpy."""
+        offset, _, _, count, _, _, _ = entry
+        position = offset + CAPTURE_CHUNK.size
+        columns = []
+        for _, code in CAPTURE_COLUMNS:
+            values = array(code)
+            values.frombytes(self.map[position:position + count * values.itemsize])
+            if sys.byteorder == 'big':
+                values.byteswap()
+            columns.append(values.tolist())
+            position += padded(count * values.itemsize)
+        return columns
+
+    def columns(self, windows=None):
+        """
+        Columns of the windows' rows joined into numpy arrays, with Phase and MovementDirection as
+        text. Values are as stored: see CAPTURE_COLUMNS, and capture_floats() for plain numbers.
+        """
+        chunks = [(entry, self.chunk_columns(entry)) for entry in self.row_chunks(windows)]
+        labels = np.array([self.labels.get(i, "Unknown") for i in range(max(self.labels, default=-1) + 1)] or [""],
+                          dtype=object)
+        result = {}
+        for name, code in CAPTURE_COLUMNS:
+            parts = [columns[name] for _, columns in chunks]
+            result[name] = np.concatenate(parts) if parts else np.zeros(0, CAPTURE_ARRAY_TYPES[code])
+        result['Phase'] = labels[np.concatenate([np.full(entry[3], entry[2]) for entry, _ in chunks])
+                                 if chunks else np.zeros(0, int)]
+        result['MovementDirection'] = labels[result['MovementDirection']]
+        return result
+
+    def lines(self, windows=None):
+        """CSV_HEADER, then the windows' rows and comments as the CSV lines capture_serial.py would have written."""
+        yield CSV_HEADER
+        if windows is None:
+            ranges = None
+        else:
+            ranges = [(w['first_row'], w['first_row'] + w['rows']) for w in windows]
+        comments = sorted((entry[4], entry[0]) for entry in self.entries if entry[1] == b'C' and
+                          (ranges is None or any(start <= entry[4] < end for start, end in ranges)))
+        next_comment = 0
+
+        for entry in self.row_chunks(windows):
+            phase = self.labels.get(entry[2], "Unknown")
+            for row_number, values in enumerate(zip(*self.chunk_values(entry)), entry[4]):
+                while next_comment < len(comments) and comments[next_comment][0] <= row_number:
+                    yield self.payload(comments[next_comment][1]).decode('utf-8', errors='replace')
+                    next_comment += 1
+                yield format_capture_row(phase, self.labels.get(values[5], "Unknown"), values)
+        for _, offset in comments[next_comment:]:
+            yield self.payload(offset).decode('utf-8', errors='replace')
+
+
+def capture_floats(values, name):
+    """A column from IndexedCapture.columns() as float64 in CSV units, NaN where the CSV has a sentinel string."""
+    result = values.astype(np.float64)
+    missing = values == CAPTURE_NO_DATA
+    if name == 'ExternalTemp':
+        missing |= np.isin(values, list(EXTERNAL_TEMP_STATUS))
+    result[missing] = np.nan
+    if name == 'Pitch':
+        result /= 100
+    return result
+
+
+@contextmanager
+def capture_lines(filename, phases=None):
+    """
+    The lines of a CSV or indexed capture, header first, as a context manager. phases limits the
+    rows to those phases; an indexed capture reads only the chunks holding them.
+    """
+    if is_indexed_capture(filename):
+        with IndexedCapture(filename) as capture:
+            yield capture.lines(None if phases is None else capture.select(phases))
+        return
+
+    def selected(line):
+        fields = line.split(',')
+        return len(fields) <= 5 or not fields[0].isdigit() or fields[5] in phases
+
+    with open(filename, 'r', newline='') as file:
+        lines = (line.rstrip('\r\n') for line in file)
+        yield lines if phases is None else (line for line in lines if selected(line))